@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 /**
  * Enumeration for mapping direction.
@@ -12,6 +13,83 @@ typedef enum{
     STREAM_OUT_IN = 1
 } MAGICDirection;
 
+/**
+ * Index engines available behind the MAGIC API.
+ * All engines return the same mappings; they differ in speed and memory.
+ */
+typedef enum{
+    MAGIC_ENGINE_RBTREE = 0,      /* Red-black trees, first nodes stored inline */
+    MAGIC_ENGINE_RBTREE_HEAP = 1, /* Red-black trees, every node on the heap */
+    MAGIC_ENGINE_PERSISTENT = 2,  /* Path-copying red-black trees, O(1) checkpoints */
+    MAGIC_ENGINE_COUNT
+} MAGICEngineKind;
+
+/**
+ * Size of the index behind a MAGIC instance.
+ */
+typedef struct{
+    const char *engine; /* Name of the engine */
+    int edits;          /* Number of edits applied */
+    int nodes;          /* Number of index nodes */
+    int depth;          /* Longest root-to-leaf path of the shift index */
+    size_t bytes;       /* Memory held by the instance */
+} MAGICStats;
+
+/**
+ * Operations whose latency MAGICrecordLatency measures.
+ */
+typedef enum{
+    MAGIC_OP_ADD = 0,
+    MAGIC_OP_REMOVE = 1,
+    MAGIC_OP_MAP_IN_OUT = 2, /* MAGICmap with STREAM_IN_OUT */
+    MAGIC_OP_MAP_OUT_IN = 3, /* MAGICmap with STREAM_OUT_IN */
+    MAGIC_OP_COUNT
+} MAGICOperation;
+
+/**
+ * Number of buckets per latency histogram: one per nanosecond below 64 ns,
+ * then 32 per power of two up to 2^40 ns (about 3% resolution).
+ */
+#define MAGIC_LATENCY_BUCKETS 1152
+
+/**
+ * Latency histograms of one or more instances, in nanoseconds. Plain counts,
+ * so snapshots taken on different instances or threads add up with
+ * MAGIClatencyMerge.
+ */
+typedef struct{
+    unsigned long long counts[MAGIC_OP_COUNT][MAGIC_LATENCY_BUCKETS]; /* Operations per bucket */
+    unsigned long long total[MAGIC_OP_COUNT];                         /* Operations recorded */
+    unsigned long long sum[MAGIC_OP_COUNT];                           /* Sum of latencies */
+    unsigned long long max[MAGIC_OP_COUNT];                           /* Largest latency */
+} MAGICLatency;
+
+/**
+ * Kind of an edit in an edit list.
+ */
+typedef enum{
+    MAGIC_EDIT_ADD = 0,
+    MAGIC_EDIT_REMOVE = 1
+} MAGICEditKind;
+
+/**
+ * One edit, as passed to MAGICadd or MAGICremove.
+ */
+typedef struct{
+    MAGICEditKind kind; /* Addition or removal */
+    int pos;            /* Starting position */
+    int length;         /* Number of bytes */
+} MAGICEdit;
+
+/**
+ * Number of edits and bytes they add and remove, as MAGICeditsBefore reports them.
+ */
+typedef struct{
+    int edits;          /* Number of edits */
+    long long added;    /* Bytes added */
+    long long removed;  /* Bytes removed */
+} MAGICEditTotals;
+
 /**
  * Opaque data structure for modification.
  */
@@ -22,12 +100,31 @@ typedef struct modification MODIFICATION;
  */
 typedef struct magic *MAGIC;
 
+/**
+ * Opaque saved state of a MAGIC instance.
+ */
+typedef struct magicCheckpoint *MAGICCheckpoint;
+
 /**
  * Initializes the MAGIC ADT.
  * @return A pointer to the initialized MAGIC instance.
  */
 MAGIC MAGICinit(void);
 
+/**
+ * Initializes the MAGIC ADT with a specific index engine.
+ * @param kind The engine to use.
+ * @return A pointer to the initialized MAGIC instance, or NULL on failure.
+ */
+MAGIC MAGICinitWithEngine(MAGICEngineKind kind);
+
+/**
+ * Returns the name of an engine.
+ * @param kind The engine kind.
+ * @return The engine name, or NULL if the kind is unknown.
+ */
+const char *MAGICengineName(MAGICEngineKind kind);
+
 /**
  * Removes a segment of bytes from the stream.
  * @param m The MAGIC instance.
@@ -53,6 +150,335 @@ void MAGICadd(MAGIC m, int pos, int length);
  */
 int MAGICmap(MAGIC m, MAGICDirection direction, int pos);
 
+/**
+ * Maps a byte position and reports how many following positions map
+ * contiguously.
+ * @param m The MAGIC instance.
+ * @param direction The mapping direction.
+ * @param pos The byte position to query.
+ * @param run Receives the length of the run, at least 1: for k < *run,
+ *            pos + k maps to the result plus k, or to -1 if the result is -1.
+ * @return The same value as MAGICmap.
+ */
+int MAGICmapRun(MAGIC m, MAGICDirection direction, int pos, int *run);
+
+/**
+ * Maps an array of byte positions; results[i] = MAGICmap(m, direction, positions[i]).
+ * Positions out of order are looked up several at a time, which overlaps
+ * their cache misses on large indexes.
+ * @param m The MAGIC instance.
+ * @param direction The mapping direction.
+ * @param positions The byte positions to query.
+ * @param results Receives the mapped positions (may be the same array as positions).
+ * @param count The number of positions.
+ */
+void MAGICmapMany(MAGIC m, MAGICDirection direction, const int *positions, int *results, size_t count);
+
+/**
+ * Maps an array of byte positions on several threads, with the same results
+ * as MAGICmapMany. Each thread maps the positions of one range of values, so
+ * that it walks its own part of the index: sorted positions are cut into
+ * contiguous slices, others are first grouped by range (a copy of up to 4M
+ * positions and their indices at a time).
+ * The instance must not be modified during the call.
+ * @param m The MAGIC instance.
+ * @param direction The mapping direction.
+ * @param positions The byte positions to query.
+ * @param results Receives the mapped positions (may be the same array as positions).
+ * @param count The number of positions.
+ * @param threads The number of threads, or 0 for one per online CPU.
+ * @return The number of threads used.
+ */
+int MAGICmapManyParallel(MAGIC m, MAGICDirection direction, const int *positions, int *results,
+                         size_t count, int threads);
+
+/**
+ * Applies a list of edits in order, as MAGICadd and MAGICremove would. On
+ * large indexes the insertion paths of the edits ahead are prefetched, so
+ * a burst costs about half as much as the same edits made one by one.
+ * @param m The MAGIC instance.
+ * @param edits The edits to apply.
+ * @param count The number of edits.
+ */
+void MAGICapplyEdits(MAGIC m, const MAGICEdit *edits, size_t count);
+
+/**
+ * Builds a MAGIC instance from an edit log, with its nodes in one block. The
+ * result maps exactly like an instance built with MAGICapplyEdits, which it
+ * is faster than. Mappings depend on the shape insertion in log order gives
+ * the trees, so the edits are inserted in that order on one thread.
+ * @param edits The edits, in the order they were applied.
+ * @param count The number of edits.
+ * @return A new MAGIC instance using the default engine, or NULL on failure.
+ */
+MAGIC MAGICbuild(const MAGICEdit *edits, size_t count);
+
+/**
+ * Builds a MAGIC instance mapping one version of a buffer to another, from a
+ * byte-level diff of the two versions. The result maps exactly like an
+ * instance fed the diff's hunks, left to right, each as a removal then an
+ * addition at its position in the edited stream.
+ * @param a The original version.
+ * @param alen The length of the original version.
+ * @param b The edited version.
+ * @param blen The length of the edited version.
+ * @return A new MAGIC instance using the default engine, or NULL on failure.
+ */
+MAGIC MAGICfromDiff(const void *a, size_t alen, const void *b, size_t blen);
+
+/**
+ * Supplies inserted content when rewriting a stream.
+ * @param ctx The context given to the rewrite call.
+ * @param pos The output position of the first byte to produce.
+ * @param dst Receives the bytes at output positions [pos, pos + len).
+ * @param len The number of bytes to produce.
+ */
+typedef void (*MAGICInsertCallback)(void *ctx, int pos, void *dst, size_t len);
+
+/**
+ * Reads input for MAGICapplyStream, as read(2) does.
+ * @return The number of bytes read, 0 at the end of the input, -1 on error.
+ */
+typedef long (*MAGICReadCallback)(void *ctx, void *buf, size_t len);
+
+/**
+ * Writes output for MAGICapplyStream.
+ * @return 0 on success, anything else to abort.
+ */
+typedef int (*MAGICWriteCallback)(void *ctx, const void *buf, size_t len);
+
+/**
+ * Returns the length of the output produced from an input of inlen bytes:
+ * inlen plus the bytes added minus the bytes removed (0 if negative).
+ * @param m The MAGIC instance.
+ * @param inlen The input length.
+ * @return The output length.
+ */
+size_t MAGICoutputLength(MAGIC m, size_t inlen);
+
+/**
+ * Counts the edits recorded at positions lower than pos, in O(log n).
+ * @param m The MAGIC instance.
+ * @param pos The position.
+ * @param totals Receives the number of those edits and the bytes they add
+ *               and remove; may be NULL.
+ * @return The number of edits, or -1 if m is NULL.
+ */
+int MAGICeditsBefore(MAGIC m, int pos, MAGICEditTotals *totals);
+
+/**
+ * Finds the k-th edit in position order, edits at the same position in the
+ * order they were recorded, in O(log n).
+ * @param m The MAGIC instance.
+ * @param k The rank, from 0.
+ * @param edit Receives the edit; may be NULL.
+ * @return 0, or -1 if m is NULL or k is out of range.
+ */
+int MAGICselectEdit(MAGIC m, int k, MAGICEdit *edit);
+
+/**
+ * Rewrites a buffer through the mapping. Output byte j is the input byte
+ * MAGICmap(m, STREAM_OUT_IN, j) when it exists, and is produced by the
+ * insert callback otherwise. Runs of unchanged bytes are copied in blocks.
+ * @param m The MAGIC instance.
+ * @param in The input stream.
+ * @param inlen The input length.
+ * @param insert Produces inserted content (NULL for zeros).
+ * @param ctx Passed to insert.
+ * @param out Receives MAGICoutputLength(m, inlen) bytes.
+ * @return The number of bytes written, or -1 on error.
+ */
+long long MAGICapply(MAGIC m, const void *in, size_t inlen, MAGICInsertCallback insert, void *ctx, void *out);
+
+/**
+ * Streaming variant of MAGICapply for inputs that do not fit in memory. Input
+ * is pulled through read and output pushed through write in chunks, and the
+ * result is the same as MAGICapply on the whole input. Fails when the mapping
+ * refers back to input that has already been dropped.
+ * @param m The MAGIC instance.
+ * @param inlen The total input length.
+ * @param read Reads the input.
+ * @param write Writes the output.
+ * @param insert Produces inserted content (NULL for zeros).
+ * @param ctx Passed to the three callbacks.
+ * @param chunk Size of the input window and output buffer, 0 for 1 MiB.
+ * @return The number of bytes written, or -1 on error.
+ */
+long long MAGICapplyStream(MAGIC m, size_t inlen, MAGICReadCallback read, MAGICWriteCallback write,
+                           MAGICInsertCallback insert, void *ctx, size_t chunk);
+
+/**
+ * Progress of MAGICtoIovec through a stream that arrives in chunks. Zero it,
+ * then set inputLength, before the first call.
+ */
+typedef struct{
+    size_t inputLength; /* Total input length, which fixes the output length */
+    size_t chunkStart;  /* Input position of the first byte of the chunk, set by the caller */
+    size_t output;      /* Next output position to describe */
+    size_t inserted;    /* Bytes of inserted content already described */
+} MAGICIovecCursor;
+
+/**
+ * Describes the rewritten stream as an iovec list for writev or sendmsg,
+ * without copying payload. Unchanged runs point into the input chunk and
+ * inserted runs into the caller's insert storage. Call again with the same
+ * chunk while the list comes back full, and with the next chunk when it
+ * comes back short; the output is complete when cursor->output reaches
+ * MAGICoutputLength(m, cursor->inputLength).
+ * A chunk may repeat the tail of the previous one, for mappings that refer
+ * back slightly, as MAGICapplyStream does.
+ * @param m The MAGIC instance.
+ * @param cursor The progress through the stream.
+ * @param in The current input chunk, at input position cursor->chunkStart.
+ * @param inlen The length of the chunk.
+ * @param inserts Every inserted byte, in output order.
+ * @param insertlen The length of inserts.
+ * @param iov Receives the entries.
+ * @param cap The capacity of iov.
+ * @return The number of entries written, or -1 when the output needs input
+ *         before the chunk or more inserted bytes than insertlen.
+ */
+int MAGICtoIovec(MAGIC m, MAGICIovecCursor *cursor, const void *in, size_t inlen,
+                 const void *inserts, size_t insertlen, struct iovec *iov, int cap);
+
+/**
+ * Rewrites a file through the mapping with as little user-space copying as
+ * possible: unchanged ranges are copied by the kernel (copy_file_range, or
+ * sendfile, or a read/write loop when neither applies) and only inserted
+ * bytes are written from user space.
+ * @param m The MAGIC instance.
+ * @param in_fd The input, a regular file.
+ * @param out_fd The output, written at its current offset.
+ * @param inserts Every inserted byte, in output order.
+ * @param insertlen The length of inserts.
+ * @return The number of bytes written, or -1 on error.
+ */
+long long MAGICrewriteFile(MAGIC m, int in_fd, int out_fd, const void *inserts, size_t insertlen);
+
+/**
+ * Returns the current version of a MAGIC instance.
+ * @param m The MAGIC instance.
+ * @return The number of edits leading to the current state, or -1.
+ */
+int MAGICversion(MAGIC m);
+
+/**
+ * Starts keeping every later version of a MAGIC instance for MAGICmapAt.
+ * Only MAGIC_ENGINE_PERSISTENT supports it; each edit then copies O(log n) nodes.
+ * @param m The MAGIC instance.
+ * @return 0 on success, -1 on failure.
+ */
+int MAGICenableHistory(MAGIC m);
+
+/**
+ * Maps a byte position as it was mapped right after a given version.
+ * @param m The MAGIC instance.
+ * @param version The number of edits applied at the time of the query.
+ * @param direction The mapping direction.
+ * @param pos The byte position to query.
+ * @return The mapped position, or -1 if not found or the version is not kept.
+ */
+int MAGICmapAt(MAGIC m, int version, MAGICDirection direction, int pos);
+
+/**
+ * Starts or stops recording the latency of MAGICadd, MAGICremove and
+ * MAGICmap (per direction) on an instance. Off by default; recording costs
+ * two clock reads per operation (see test_magic_bench.c). Builds with
+ * -DMAGIC_LATENCY_TSC read the x86 time stamp counter instead of
+ * clock_gettime. Stopping drops the histograms; clones do not record.
+ * @param m The MAGIC instance.
+ * @param enable Non-zero to start, zero to stop.
+ * @return 0 on success, -1 on failure.
+ */
+int MAGICrecordLatency(MAGIC m, int enable);
+
+/**
+ * Copies the latency histograms of an instance. Like every other call, it
+ * must not run concurrently with operations on the same instance.
+ * @param m The MAGIC instance.
+ * @param latency Receives the histograms.
+ * @return 0 on success, -1 if the instance does not record latency.
+ */
+int MAGIClatency(MAGIC m, MAGICLatency *latency);
+
+/**
+ * Adds the counts of one set of histograms to another, for instance to
+ * combine the instances of every thread.
+ * @param into The histograms to add to.
+ * @param from The histograms to add.
+ */
+void MAGIClatencyMerge(MAGICLatency *into, const MAGICLatency *from);
+
+/**
+ * Returns the latency under which a share of the operations ran.
+ * @param latency The histograms.
+ * @param op The operation.
+ * @param percentile The share, in [0, 100], e.g. 99.9.
+ * @return The latency in nanoseconds, within 3% above the exact value and
+ *         never above the maximum; 0 if nothing was recorded.
+ */
+unsigned long long MAGIClatencyPercentile(const MAGICLatency *latency, MAGICOperation op, double percentile);
+
+/**
+ * Writes one histogram in HdrHistogram's percentile distribution text
+ * format, values in nanoseconds, for the usual plotting tools.
+ * @param latency The histograms.
+ * @param op The operation.
+ * @param out The stream to write to.
+ * @return 0 on success, -1 on error.
+ */
+int MAGIClatencyExport(const MAGICLatency *latency, MAGICOperation op, FILE *out);
+
+/**
+ * Reports the size of the index. Runs in time linear in the number of edits.
+ * With the mutable engines, edits in arithmetic progression (same length,
+ * evenly spaced, in ascending order) fold into run nodes, so nodes can be far
+ * fewer than edits; depth counts the levels below run nodes.
+ * @param m The MAGIC instance.
+ * @param stats Filled with the statistics.
+ */
+void MAGICstats(MAGIC m, MAGICStats *stats);
+
+/**
+ * Moves the index into one block laid out for lookups (van Emde Boas order),
+ * without changing any mapping. Worth calling in quiet moments once many
+ * edits have scattered the nodes over the heap. O(n) time, needs a second
+ * copy of the index meanwhile. Only MAGIC_ENGINE_RBTREE supports it.
+ * @param m The MAGIC instance.
+ * @return 0 on success, -1 on failure (m is left unchanged).
+ */
+int MAGICoptimize(MAGIC m);
+
+/**
+ * Saves the current state of a MAGIC instance.
+ * O(1) with MAGIC_ENGINE_PERSISTENT, a copy of the index with other engines.
+ * @param m The MAGIC instance.
+ * @return A checkpoint, or NULL on failure. Free it with MAGICcheckpointFree.
+ */
+MAGICCheckpoint MAGICcheckpoint(MAGIC m);
+
+/**
+ * Restores a MAGIC instance to a checkpoint. The checkpoint stays valid.
+ * @param m The MAGIC instance.
+ * @param cp A checkpoint taken on an instance using the same engine.
+ * @return 0 on success, -1 on failure (m is left unchanged).
+ */
+int MAGICrollback(MAGIC m, MAGICCheckpoint cp);
+
+/**
+ * Frees a checkpoint.
+ * @param cp The checkpoint to free.
+ */
+void MAGICcheckpointFree(MAGICCheckpoint cp);
+
+/**
+ * Creates an independent copy of a MAGIC instance.
+ * O(1) with MAGIC_ENGINE_PERSISTENT, a copy of the index with other engines.
+ * @param m The MAGIC instance to copy.
+ * @return The copy, or NULL on failure.
+ */
+MAGIC MAGICclone(MAGIC m);
+
 /**
  * Destroys the MAGIC instance and frees memory.
  * @param m The MAGIC instance to destroy.
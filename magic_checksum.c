@@ -0,0 +1,456 @@
+#include "magic_checksum.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+
+
+/*
+    Internet checksum (RFC 1071).
+
+    One's-complement addition of 16-bit words is addition modulo 0xffff, so
+    sums are kept as plain integers reduced modulo 0xffff. A byte at an even
+    offset is the high half of its word and weighs 256, a byte at an odd
+    offset weighs 1. Moving a range by an odd distance swaps its bytes within
+    their words, which multiplies its sum by 256 (256 * 256 = 1 modulo 0xffff).
+*/
+enum { ONES_MODULUS = 0xffff };
+
+// Moves a sum to the other byte parity
+static uint32_t swapSum(uint32_t sum) {
+    return (uint32_t)(((uint64_t)sum << 8) % ONES_MODULUS);
+}
+
+/*
+    Sums data as if data[0] were at input offset `offset`, modulo 0xffff.
+    Native 32-bit loads are summed as they come: hi * 65536 + lo is hi + lo
+    modulo 0xffff, so each load adds its two native 16-bit words.
+*/
+static uint32_t internetSum(const unsigned char *data, size_t len, size_t offset) {
+    uint64_t words = 0, tail = 0;
+    size_t k = 0;
+    for (; k + 4 <= len; k += 4) {
+        uint32_t w;
+        memcpy(&w, data + k, sizeof(w));
+        words += w;
+    }
+    uint32_t sum = (uint32_t)(words % ONES_MODULUS);
+    const uint16_t one = 1;
+    if (*(const unsigned char*)&one) // Little endian: native words have the even byte low
+        sum = swapSum(sum);
+
+    for (; k < len; k++) {
+        tail += k & 1 ? data[k] : (uint32_t)data[k] << 8;
+    }
+    sum = (uint32_t)((sum + tail) % ONES_MODULUS);
+    return offset & 1 ? swapSum(sum) : sum;
+}
+
+// Header checksums are the complement of the sum, 0xffff for a zero sum
+static uint32_t internetChecksum(uint32_t sum) {
+    return ONES_MODULUS - sum;
+}
+
+static uint32_t internetSumOf(uint32_t checksum) {
+    return (ONES_MODULUS - (checksum & 0xffff)) % ONES_MODULUS;
+}
+
+/*
+    CRC-32 (reflected polynomial 0xedb88320), table driven four bytes at a
+    time. Shifting a CRC by n zero bytes is a multiplication by x^(8n) modulo
+    the polynomial, computed from the table of x^(2^k) as in zlib; x has
+    order dividing 2^32 - 1, which gives the inverse shifts.
+*/
+#define CRC_POLY 0xedb88320u
+static const uint64_t CRC_ORDER = 0xffffffffULL;
+
+static uint32_t crcTable[4][256];
+static uint32_t x2nTable[32];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+// Product of two polynomials modulo the CRC polynomial (bit 31 is x^0)
+static uint32_t multModP(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) modulo the CRC polynomial
+static uint32_t x2nModP(uint64_t n, unsigned k) {
+    uint32_t p = (uint32_t)1 << 31;
+    while (n) {
+        if (n & 1)
+            p = multModP(x2nTable[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static void crcInit(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+        }
+        crcTable[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 4; t++) {
+            crcTable[t][n] = (crcTable[t - 1][n] >> 8) ^ crcTable[0][crcTable[t - 1][n] & 0xff];
+        }
+    }
+    uint32_t p = (uint32_t)1 << 30; // x^1
+    x2nTable[0] = p;
+    for (int n = 1; n < 32; n++) {
+        x2nTable[n] = p = multModP(p, p);
+    }
+}
+
+static uint32_t crc32Of(const unsigned char *data, size_t len) {
+    uint32_t c = 0xffffffffu;
+    size_t k = 0;
+    for (; k + 4 <= len; k += 4) {
+        c ^= (uint32_t)data[k] | (uint32_t)data[k + 1] << 8 | (uint32_t)data[k + 2] << 16 | (uint32_t)data[k + 3] << 24;
+        c = crcTable[3][c & 0xff] ^ crcTable[2][(c >> 8) & 0xff] ^ crcTable[1][(c >> 16) & 0xff] ^ crcTable[0][c >> 24];
+    }
+    for (; k < len; k++) {
+        c = (c >> 8) ^ crcTable[0][(c ^ data[k]) & 0xff];
+    }
+    return c ^ 0xffffffffu;
+}
+
+// CRC of a buffer followed by n more bytes, without the contribution of those bytes
+static uint32_t crcShift(uint32_t crc, uint64_t n) {
+    return n ? multModP(x2nModP(n, 3), crc) : crc;
+}
+
+// Inverse of crcShift
+static uint32_t crcUnshift(uint32_t crc, uint64_t n) {
+    uint64_t bits = (n % CRC_ORDER) * 8 % CRC_ORDER;
+    return bits ? multModP(x2nModP(CRC_ORDER - bits, 0), crc) : crc;
+}
+
+/*
+    Computes a checksum over a whole buffer.
+
+    Arguments:
+    ----------
+    - kind : The checksum.
+    - data, len : The bytes.
+
+    Return:
+    -------
+    - The checksum. Internet checksums are in [1, 0xffff].
+*/
+uint32_t MAGICchecksum(MAGICChecksumKind kind, const void *data, size_t len){
+    if (!data && len > 0)
+        return 0;
+
+    if (kind == MAGIC_CHECKSUM_INTERNET)
+        return internetChecksum(internetSum((const unsigned char*)data, len, 0));
+    pthread_once(&crcOnce, crcInit);
+    return crc32Of((const unsigned char*)data, len);
+}
+
+/*
+    Returns the CRC-32 of the concatenation of two buffers.
+
+    Arguments:
+    ----------
+    - crc1 : The CRC-32 of the first buffer.
+    - crc2, len2 : The CRC-32 and length of the second buffer.
+
+    Return:
+    -------
+    - The CRC-32 of both buffers, without reading them.
+*/
+uint32_t MAGICcrc32Combine(uint32_t crc1, uint32_t crc2, size_t len2){
+    pthread_once(&crcOnce, crcInit);
+    return crcShift(crc1, len2) ^ crc2;
+}
+
+/*
+    A range of the output: `length` bytes taken from input position `in`, or
+    from the insert storage at `in` when `inserted` is set.
+*/
+typedef struct {
+    size_t out, in, length;
+    bool inserted;
+    size_t first, last;  // Input segments [first, last) the range covers
+} Piece;
+
+// Change in distance to the end of the stream of `length` input bytes
+typedef struct {
+    long long delta;
+    size_t length;
+} Move;
+
+static int compareMove(const void *a, const void *b) {
+    long long x = ((const Move*)a)->delta, y = ((const Move*)b)->delta;
+    return x < y ? -1 : x > y;
+}
+
+static int compareSize(const void *a, const void *b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Index of the segment starting at input position `pos`
+static size_t segmentAt(const size_t *bounds, size_t count, size_t pos) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (bounds[mid] < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+    Derives the checksum of a rewritten stream from the checksum of its input.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - kind : The checksum.
+    - checksum : The checksum of the whole input, as `MAGICchecksum()` returns it.
+    - in, inlen : The input stream.
+    - inserts, insertlen : Every inserted byte of the output, in output order.
+    - result : Receives the checksum of the output.
+
+    Return:
+    -------
+    - The number of bytes read from in and inserts, or -1 on invalid
+      arguments, allocation failure, when inlen exceeds INT_MAX or when
+      inserts is too short.
+
+    Behavior:
+    ---------
+    - The output is what `MAGICapply()` writes, with inserted content from
+      inserts as in `MAGICtoIovec()`. It is cut with `MAGICmapRun()` into
+      runs of input and inserted ranges, and the input into segments at
+      every run boundary, so each segment appears in the output a known
+      number of times.
+    - Internet checksum: each segment adds its sum once per even move and its
+      byte-swapped sum once per odd move. Segments that move the same way as
+      the largest one are not read; their total is the input sum minus the
+      other segments.
+    - CRC-32: the CRC of the input is the combination of the segment CRCs,
+      each shifted by the number of bytes after it. Segments that appear
+      once and whose distance to the end changes by the same amount as the
+      most bytes are not read: their joint contribution is the input CRC
+      minus the others, shifted by that amount. The others are read and
+      placed at their output distance to the end.
+    - Inserted bytes are always read. The cost is linear in the bytes read
+      plus O(log inlen) per run.
+*/
+long long MAGICadjustChecksum(MAGIC m, MAGICChecksumKind kind, uint32_t checksum, const void *in, size_t inlen,
+                              const void *inserts, size_t insertlen, uint32_t *result){
+    if (!m || (!in && inlen > 0) || !result || inlen > INT_MAX)
+        return -1;
+
+    size_t outlen = MAGICoutputLength(m, inlen);
+    if (outlen > INT_MAX)
+        return -1;
+
+    // Output ranges, in order
+    size_t pieceCount = 0, pieceCapacity = 16, inserted = 0;
+    Piece *pieces = (Piece*)malloc(pieceCapacity * sizeof(Piece));
+    for (size_t j = 0; pieces && j < outlen; ) {
+        int run;
+        int i = MAGICmapRun(m, STREAM_OUT_IN, (int)j, &run);
+        size_t length = (size_t)run < outlen - j ? (size_t)run : outlen - j;
+        Piece piece = {j, (size_t)i, length, i < 0 || (size_t)i >= inlen, 0, 0};
+        if (piece.inserted) {
+            if (inserted > insertlen || length > insertlen - inserted) {
+                free(pieces);
+                return -1;
+            }
+            piece.in = inserted;
+            inserted += length;
+        } else if (length > inlen - piece.in) {
+            piece.length = length = inlen - piece.in;
+        }
+        if (pieceCount == pieceCapacity) {
+            Piece *bigger = (Piece*)realloc(pieces, 2 * pieceCapacity * sizeof(Piece));
+            if (!bigger) {
+                free(pieces);
+                pieces = NULL;
+                break;
+            }
+            pieces = bigger;
+            pieceCapacity *= 2;
+        }
+        pieces[pieceCount++] = piece;
+        j += length;
+    }
+
+    // Input segments between consecutive run boundaries
+    size_t *bounds = pieces ? (size_t*)malloc((2 * pieceCount + 2) * sizeof(size_t)) : NULL;
+    if (!bounds) {
+        free(pieces);
+        return -1;
+    }
+    size_t boundCount = 0;
+    bounds[boundCount++] = 0;
+    bounds[boundCount++] = inlen;
+    for (size_t p = 0; p < pieceCount; p++) {
+        if (!pieces[p].inserted) {
+            bounds[boundCount++] = pieces[p].in;
+            bounds[boundCount++] = pieces[p].in + pieces[p].length;
+        }
+    }
+    qsort(bounds, boundCount, sizeof(size_t), compareSize);
+    size_t unique = 0;
+    for (size_t b = 0; b < boundCount; b++) {
+        if (unique == 0 || bounds[b] != bounds[unique - 1])
+            bounds[unique++] = bounds[b];
+    }
+    size_t segments = unique - 1; // 0 when the input is empty
+    for (size_t p = 0; p < pieceCount; p++) {
+        if (!pieces[p].inserted) {
+            pieces[p].first = segmentAt(bounds, unique, pieces[p].in);
+            pieces[p].last = segmentAt(bounds, unique, pieces[p].in + pieces[p].length);
+        }
+    }
+
+    // Even and odd moves of each segment, from differences over segment indices
+    long *even = (long*)calloc(segments + 1, sizeof(long));
+    long *odd = (long*)calloc(segments + 1, sizeof(long));
+    uint32_t *sums = (uint32_t*)malloc((segments + 1) * sizeof(uint32_t));
+    if (!even || !odd || !sums) {
+        free(pieces);
+        free(bounds);
+        free(even);
+        free(odd);
+        free(sums);
+        return -1;
+    }
+    for (size_t p = 0; p < pieceCount; p++) {
+        if (!pieces[p].inserted) {
+            long *moves = (pieces[p].out - pieces[p].in) & 1 ? odd : even;
+            moves[pieces[p].first]++;
+            moves[pieces[p].last]--;
+        }
+    }
+    size_t largest = 0;
+    for (size_t s = 0; s < segments; s++) {
+        if (s > 0) {
+            even[s] += even[s - 1];
+            odd[s] += odd[s - 1];
+        }
+        if (bounds[s + 1] - bounds[s] > bounds[largest + 1] - bounds[largest])
+            largest = s;
+    }
+
+    const unsigned char *input = (const unsigned char*)in, *added = (const unsigned char*)inserts;
+    long long read = (long long)inserted;
+    if (kind == MAGIC_CHECKSUM_INTERNET) {
+        // Segments moved like the largest one form the derived class
+        uint64_t rest = 0, total = 0;
+        for (size_t s = 0; s < segments; s++) {
+            if (even[s] == even[largest] && odd[s] == odd[largest])
+                continue;
+            size_t length = bounds[s + 1] - bounds[s];
+            uint32_t sum = internetSum(input + bounds[s], length, bounds[s]);
+            read += (long long)length;
+            rest += sum;
+            total += (uint64_t)(even[s] % ONES_MODULUS) * sum + (uint64_t)(odd[s] % ONES_MODULUS) * swapSum(sum);
+            total %= ONES_MODULUS;
+        }
+        if (segments > 0) {
+            uint32_t derived = (uint32_t)((internetSumOf(checksum) + ONES_MODULUS - rest % ONES_MODULUS) % ONES_MODULUS);
+            total += (uint64_t)(even[largest] % ONES_MODULUS) * derived
+                   + (uint64_t)(odd[largest] % ONES_MODULUS) * swapSum(derived);
+        }
+        for (size_t p = 0; p < pieceCount; p++) {
+            if (pieces[p].inserted)
+                total += internetSum(added + pieces[p].in, pieces[p].length, pieces[p].out);
+        }
+        *result = internetChecksum((uint32_t)(total % ONES_MODULUS));
+    } else {
+        pthread_once(&crcOnce, crcInit);
+
+        // Distance-to-end change of the segments that appear once
+        long long *delta = (long long*)malloc((segments + 1) * sizeof(long long));
+        Move *moves = (Move*)malloc((segments + 1) * sizeof(Move));
+        if (!delta || !moves) {
+            free(delta);
+            free(moves);
+            read = -1;
+            goto done;
+        }
+        size_t moveCount = 0;
+        for (size_t p = 0; p < pieceCount; p++) {
+            for (size_t s = pieces[p].first; !pieces[p].inserted && s < pieces[p].last; s++) {
+                if (even[s] + odd[s] != 1)
+                    continue;
+                size_t end = pieces[p].out + (bounds[s + 1] - pieces[p].in);
+                delta[s] = (long long)(outlen - end) - (long long)(inlen - bounds[s + 1]);
+                moves[moveCount++] = (Move){delta[s], bounds[s + 1] - bounds[s]};
+            }
+        }
+
+        // The distance shared by the most bytes is derived
+        qsort(moves, moveCount, sizeof(Move), compareMove);
+        long long derived = 0;
+        size_t best = 0;
+        for (size_t k = 0, bytes = 0; k < moveCount; k++) {
+            bytes = k > 0 && moves[k].delta == moves[k - 1].delta ? bytes + moves[k].length : moves[k].length;
+            if (bytes > best) {
+                best = bytes;
+                derived = moves[k].delta;
+            }
+        }
+        free(moves);
+
+        uint32_t rest = checksum;
+        for (size_t s = 0; s < segments; s++) {
+            if (even[s] + odd[s] == 1 && delta[s] == derived)
+                continue;
+            size_t length = bounds[s + 1] - bounds[s];
+            sums[s] = crc32Of(input + bounds[s], length);
+            read += (long long)length;
+            rest ^= crcShift(sums[s], inlen - bounds[s + 1]);
+        }
+
+        // Segments of the derived class keep their input contribution, moved by the same distance
+        uint32_t crc = derived >= 0 ? crcShift(rest, (uint64_t)derived) : crcUnshift(rest, (uint64_t)-derived);
+        for (size_t p = 0; p < pieceCount; p++) {
+            size_t after = outlen - pieces[p].out - pieces[p].length;
+            if (pieces[p].inserted) {
+                crc ^= crcShift(crc32Of(added + pieces[p].in, pieces[p].length), after);
+                continue;
+            }
+            for (size_t s = pieces[p].first; s < pieces[p].last; s++) {
+                if (even[s] + odd[s] == 1 && delta[s] == derived)
+                    continue;
+                crc ^= crcShift(sums[s], outlen - (pieces[p].out + (bounds[s + 1] - pieces[p].in)));
+            }
+        }
+        free(delta);
+        *result = crc;
+    }
+
+done:
+    free(pieces);
+    free(bounds);
+    free(even);
+    free(odd);
+    free(sums);
+    return read;
+}
@@ -0,0 +1,56 @@
+#ifndef MAGIC_CHECKSUM_H
+#define MAGIC_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "magic.h"
+
+/**
+ * Checksums that MAGICadjustChecksum can carry over a rewrite.
+ */
+typedef enum{
+    MAGIC_CHECKSUM_INTERNET, /* RFC 1071 one's-complement sum, as stored in IP, TCP and UDP headers */
+    MAGIC_CHECKSUM_CRC32     /* CRC-32 of zlib, Ethernet and PNG */
+} MAGICChecksumKind;
+
+/**
+ * Computes a checksum over a whole buffer.
+ * Internet checksums are never 0: a computed 0 is returned as 0xffff, which
+ * is the same one's-complement value, as UDP sends it.
+ * @param kind The checksum.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return The checksum, in the low 16 bits for the Internet checksum.
+ */
+uint32_t MAGICchecksum(MAGICChecksumKind kind, const void *data, size_t len);
+
+/**
+ * Returns the CRC-32 of the concatenation of two buffers from their CRCs.
+ * @param crc1 The CRC-32 of the first buffer.
+ * @param crc2 The CRC-32 of the second buffer.
+ * @param len2 The length of the second buffer.
+ * @return The CRC-32 of both buffers, in O(log len2).
+ */
+uint32_t MAGICcrc32Combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/**
+ * Derives the checksum of the rewritten stream (the bytes MAGICapply or
+ * MAGICtoIovec produce) from the checksum of the input, reading only part
+ * of the input. Input bytes are grouped by how they move: by parity of the
+ * distance moved for the Internet checksum, by change of distance to the
+ * end for CRC-32. The largest group is derived from the input checksum;
+ * the other groups, removed or repeated bytes and inserted bytes are read.
+ * @param m The MAGIC instance.
+ * @param kind The checksum.
+ * @param checksum The checksum of the whole input, as MAGICchecksum returns it.
+ * @param in The input stream.
+ * @param inlen The input length.
+ * @param inserts Every inserted byte, in output order.
+ * @param insertlen The length of inserts.
+ * @param result Receives the checksum of the output.
+ * @return The number of bytes read from in and inserts, or -1 on error.
+ */
+long long MAGICadjustChecksum(MAGIC m, MAGICChecksumKind kind, uint32_t checksum, const void *in, size_t inlen,
+                              const void *inserts, size_t insertlen, uint32_t *result);
+
+#endif
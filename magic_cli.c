@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "magic.h"
+
+/*
+ * magic-cli: applies edit scripts to a MAGIC instance and answers position
+ * queries, from files or stdin.
+ *
+ * Text scripts hold one command per line:
+ *
+ *     + <pos> <len>    (or `add`)     record an insertion
+ *     - <pos> <len>    (or `remove`)  record a removal
+ *     > <pos>          (or `map`)     print the output position of an input position
+ *     < <pos>          (or `unmap`)   print the input position of an output position
+ *
+ * Positions and lengths are non-negative. Blank lines and lines starting with
+ * `#` are ignored. Each query prints one line holding the mapped position.
+ * On a bad command, the queries before it are answered and the run stops
+ * with an error naming the line.
+ *
+ * Binary scripts (-b) are a sequence of records of three native-endian
+ * int32: {command, pos, len}, where command is 0 for an insertion, 1 for a
+ * removal, 2 for `>` and 3 for `<` (len is ignored for queries). Each query
+ * writes one native-endian int32.
+ *
+ * Regular files are mapped with mmap; pipes and terminals are read through a
+ * large buffer. Commands are parsed in place, so no memory is allocated per
+ * line, and consecutive queries in the same direction are answered with one
+ * MAGICmapMany call.
+ *
+ * Usage: magic-cli [-b] [-e engine] [script]...
+ *   -b         Binary scripts and results
+ *   -e engine  Engine name (see MAGICengineName), default rbtree
+ *   script     Files to run in order, `-` or nothing for stdin
+ */
+
+enum { READ_BUFFER = 1 << 20, OUT_BUFFER = 1 << 16, BATCH = 4096 };
+
+// Commands of binary scripts
+enum { CMD_ADD = 0, CMD_REMOVE = 1, CMD_MAP = 2, CMD_UNMAP = 3 };
+
+/*
+ * State of a run: the instance, the pending batch of queries and the output
+ * buffer.
+ */
+typedef struct {
+    MAGIC m;
+    int binary;
+    const char *name;  // Script being run, for error messages
+    long line;         // Line being parsed (text scripts)
+
+    MAGICDirection direction;
+    int positions[BATCH];
+    int results[BATCH];
+    size_t pending;
+
+    char out[OUT_BUFFER];
+    size_t used;
+} Cli;
+
+static void flushOutput(Cli *cli) {
+    size_t done = 0;
+    while (done < cli->used) {
+        ssize_t n = write(STDOUT_FILENO, cli->out + done, cli->used - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("magic-cli: write");
+            exit(1);
+        }
+        done += (size_t)n;
+    }
+    cli->used = 0;
+}
+
+static void emit(Cli *cli, int value) {
+    if (cli->used + 16 > OUT_BUFFER)
+        flushOutput(cli);
+
+    if (cli->binary) {
+        int32_t v = value;
+        memcpy(cli->out + cli->used, &v, sizeof(v));
+        cli->used += sizeof(v);
+        return;
+    }
+
+    char digits[12];
+    int n = 0;
+    unsigned u = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do {
+        digits[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (value < 0)
+        cli->out[cli->used++] = '-';
+    while (n)
+        cli->out[cli->used++] = digits[--n];
+    cli->out[cli->used++] = '\n';
+}
+
+// Answers the pending queries, in order
+static void flushQueries(Cli *cli) {
+    if (!cli->pending)
+        return;
+    MAGICmapMany(cli->m, cli->direction, cli->positions, cli->results, cli->pending);
+    for (size_t i = 0; i < cli->pending; i++) {
+        emit(cli, cli->results[i]);
+    }
+    cli->pending = 0;
+}
+
+static void query(Cli *cli, MAGICDirection direction, int pos) {
+    if (cli->pending == BATCH || (cli->pending && cli->direction != direction))
+        flushQueries(cli);
+    cli->direction = direction;
+    cli->positions[cli->pending++] = pos;
+}
+
+static void edit(Cli *cli, int command, int pos, int length) {
+    flushQueries(cli);
+    if (command == CMD_ADD) {
+        MAGICadd(cli->m, pos, length);
+    } else {
+        MAGICremove(cli->m, pos, length);
+    }
+}
+
+// Answers the queries before the bad command, then reports it and exits
+_Noreturn static void fail(Cli *cli, const char *what) {
+    flushQueries(cli);
+    flushOutput(cli);
+    if (cli->binary) {
+        fprintf(stderr, "magic-cli: %s: %s\n", cli->name, what);
+    } else {
+        fprintf(stderr, "magic-cli: %s:%ld: %s\n", cli->name, cli->line, what);
+    }
+    exit(1);
+}
+
+static const char *skipBlanks(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+// Parses a non-negative decimal int at p, or fails
+static const char *parseInt(Cli *cli, const char *p, const char *end, int *value) {
+    p = skipBlanks(p, end);
+    if (p < end && *p == '+')
+        p++;
+    if (p == end || (unsigned)(*p - '0') > 9)
+        fail(cli, "expected a non-negative number");
+
+    long long v = 0;
+    while (p < end && (unsigned)(*p - '0') <= 9) {
+        v = v * 10 + (*p++ - '0');
+        if (v > INT32_MAX)
+            fail(cli, "number out of range");
+    }
+    *value = (int)v;
+    return p;
+}
+
+// Runs one text line [p, end), without its newline
+static void runLine(Cli *cli, const char *p, const char *end) {
+    p = skipBlanks(p, end);
+    if (p == end || *p == '#')
+        return;
+
+    const char *word = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        p++;
+    size_t len = (size_t)(p - word);
+
+    int command, pos, length = 0;
+    if (len == 1 && (*word == '+' || *word == '-' || *word == '>' || *word == '<')) {
+        command = *word == '+' ? CMD_ADD : *word == '-' ? CMD_REMOVE : *word == '>' ? CMD_MAP : CMD_UNMAP;
+    } else if (len == 3 && !memcmp(word, "add", 3)) {
+        command = CMD_ADD;
+    } else if (len == 6 && !memcmp(word, "remove", 6)) {
+        command = CMD_REMOVE;
+    } else if (len == 3 && !memcmp(word, "map", 3)) {
+        command = CMD_MAP;
+    } else if (len == 5 && !memcmp(word, "unmap", 5)) {
+        command = CMD_UNMAP;
+    } else {
+        fail(cli, "unknown command");
+    }
+
+    p = parseInt(cli, p, end, &pos);
+    if (command == CMD_ADD || command == CMD_REMOVE)
+        p = parseInt(cli, p, end, &length);
+    if (skipBlanks(p, end) != end)
+        fail(cli, "trailing characters");
+
+    if (command == CMD_MAP || command == CMD_UNMAP) {
+        query(cli, command == CMD_MAP ? STREAM_IN_OUT : STREAM_OUT_IN, pos);
+    } else {
+        edit(cli, command, pos, length);
+    }
+}
+
+/*
+ * Runs the complete commands of [data, data + size). With `last` set, a final
+ * line without newline is run as well. Returns the number of bytes consumed.
+ */
+static size_t runChunk(Cli *cli, const char *data, size_t size, int last) {
+    if (cli->binary) {
+        size_t records = size / 12;
+        for (size_t i = 0; i < records; i++) {
+            int32_t r[3];
+            memcpy(r, data + i * 12, sizeof(r));
+            if (r[1] < 0 || ((r[0] == CMD_ADD || r[0] == CMD_REMOVE) && r[2] < 0))
+                fail(cli, "expected a non-negative number");
+            if (r[0] == CMD_MAP || r[0] == CMD_UNMAP) {
+                query(cli, r[0] == CMD_MAP ? STREAM_IN_OUT : STREAM_OUT_IN, r[1]);
+            } else if (r[0] == CMD_ADD || r[0] == CMD_REMOVE) {
+                edit(cli, r[0], r[1], r[2]);
+            } else {
+                fail(cli, "unknown command");
+            }
+        }
+        if (last && size % 12)
+            fail(cli, "truncated record");
+        return records * 12;
+    }
+
+    const char *p = data, *end = data + size;
+    for (;;) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl)
+            break;
+        cli->line++;
+        runLine(cli, p, nl);
+        p = nl + 1;
+    }
+    if (last && p < end) {
+        cli->line++;
+        runLine(cli, p, end);
+        p = end;
+    }
+    return (size_t)(p - data);
+}
+
+// Runs a whole script from a file descriptor
+static void runScript(Cli *cli, int fd, char *buffer) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+#ifdef POSIX_MADV_SEQUENTIAL
+            posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+            runChunk(cli, data, (size_t)st.st_size, 1);
+            munmap(data, (size_t)st.st_size);
+            return;
+        }
+    }
+
+    // Pipes and terminals: keep the unconsumed tail of each read
+    size_t kept = 0;
+    for (;;) {
+        ssize_t n = read(fd, buffer + kept, READ_BUFFER - kept);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("magic-cli: read");
+            exit(1);
+        }
+        size_t size = kept + (size_t)n;
+        size_t used = runChunk(cli, buffer, size, n == 0);
+        if (n == 0)
+            return;
+        kept = size - used;
+        if (kept == READ_BUFFER)
+            fail(cli, "line too long");
+        memmove(buffer, buffer + used, kept);
+    }
+}
+
+int main(int argc, char **argv) {
+    static Cli cli;
+    MAGICEngineKind engine = MAGIC_ENGINE_RBTREE;
+    int first = 1;
+
+    for (; first < argc && argv[first][0] == '-' && argv[first][1]; first++) {
+        if (!strcmp(argv[first], "-b")) {
+            cli.binary = 1;
+        } else if (!strcmp(argv[first], "-e") && first + 1 < argc) {
+            const char *name = argv[++first];
+            for (engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+                if (!strcmp(MAGICengineName(engine), name)) break;
+            }
+            if (engine == MAGIC_ENGINE_COUNT) {
+                fprintf(stderr, "magic-cli: unknown engine %s\n", name);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "usage: magic-cli [-b] [-e engine] [script]...\n");
+            return 2;
+        }
+    }
+
+    cli.m = MAGICinitWithEngine(engine);
+    char *buffer = malloc(READ_BUFFER);
+    if (!cli.m || !buffer) {
+        fprintf(stderr, "magic-cli: out of memory\n");
+        return 1;
+    }
+
+    if (first == argc) {
+        cli.name = "<stdin>";
+        runScript(&cli, STDIN_FILENO, buffer);
+    }
+    for (int i = first; i < argc; i++) {
+        int fd = strcmp(argv[i], "-") ? open(argv[i], O_RDONLY) : STDIN_FILENO;
+        if (fd < 0) {
+            perror(argv[i]);
+            return 1;
+        }
+        cli.name = fd == STDIN_FILENO ? "<stdin>" : argv[i];
+        cli.line = 0;
+        runScript(&cli, fd, buffer);
+        if (fd != STDIN_FILENO) close(fd);
+    }
+
+    flushQueries(&cli);
+    flushOutput(&cli);
+    free(buffer);
+    MAGICdestroy(cli.m);
+    return 0;
+}
+
+/*
+gcc -Wall -pedantic -std=c11 -O3 -o magic-cli magic_cli.c magic.c
+printf '+ 3 2\n> 5\n< 5\n' | ./magic-cli
+*/
@@ -0,0 +1,295 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "magic.h"
+
+/*
+ * pymagic: CPython bindings of MAGIC.
+ *
+ *     import pymagic
+ *     m = pymagic.Magic()              # or Magic("persistent")
+ *     m.add(10, 4)
+ *     m.remove(30, 2)
+ *     m.map(pymagic.IN_OUT, 12)        # one position
+ *     m.map_array(pymagic.IN_OUT, a)   # every position of a, in place
+ *
+ * map_array takes any writable C-contiguous buffer of 32-bit or 64-bit
+ * signed integers (NumPy int32 and int64 arrays, array.array('i'), ...),
+ * maps it in place with MAGICmapMany and returns it. The buffer is used
+ * directly, without copying, and the GIL is released while it is mapped,
+ * so other Python threads keep running. Positions that MAGICmap cannot
+ * take (negative or beyond INT_MAX) map to -1.
+ *
+ * Each Magic object has a lock, so that add or remove from another thread
+ * waits for a map_array in progress.
+ */
+
+// Number of 64-bit positions narrowed to int and mapped at a time
+#define WIDE_CHUNK 4096
+
+typedef struct {
+    PyObject_HEAD
+    MAGIC m;
+    PyThread_type_lock lock;
+} MagicObject;
+
+// Takes the lock of an object, releasing the GIL while waiting for it
+static void lockMagic(MagicObject *self) {
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void unlockMagic(MagicObject *self) {
+    PyThread_release_lock(self->lock);
+}
+
+static int parseDirection(int direction) {
+    if (direction != STREAM_IN_OUT && direction != STREAM_OUT_IN) {
+        PyErr_SetString(PyExc_ValueError, "direction must be IN_OUT or OUT_IN");
+        return -1;
+    }
+    return 0;
+}
+
+static int Magic_init(MagicObject *self, PyObject *args, PyObject *kwds) {
+    static char *keywords[] = {"engine", NULL};
+    const char *engine = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z", keywords, &engine))
+        return -1;
+
+    int kind = MAGIC_ENGINE_RBTREE;
+    if (engine) {
+        for (kind = 0; kind < MAGIC_ENGINE_COUNT; kind++) {
+            if (strcmp(engine, MAGICengineName((MAGICEngineKind)kind)) == 0)
+                break;
+        }
+        if (kind == MAGIC_ENGINE_COUNT) {
+            PyErr_Format(PyExc_ValueError, "unknown engine '%s'", engine);
+            return -1;
+        }
+    }
+
+    if (!self->lock) {
+        self->lock = PyThread_allocate_lock();
+        if (!self->lock) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    MAGIC m = MAGICinitWithEngine((MAGICEngineKind)kind);
+    if (!m) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    lockMagic(self);
+    MAGICdestroy(self->m);
+    self->m = m;
+    unlockMagic(self);
+    return 0;
+}
+
+static void Magic_dealloc(MagicObject *self) {
+    MAGICdestroy(self->m);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Checks that __init__ ran, which subclasses may skip
+static int checkInitialized(MagicObject *self) {
+    if (!self->m) {
+        PyErr_SetString(PyExc_RuntimeError, "Magic object is not initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *recordEdit(MagicObject *self, PyObject *args, void (*edit)(MAGIC, int, int)) {
+    int pos, length;
+    if (!PyArg_ParseTuple(args, "ii", &pos, &length) || checkInitialized(self) < 0)
+        return NULL;
+    if (pos < 0 || length <= 0) {
+        PyErr_SetString(PyExc_ValueError, "pos must be >= 0 and length > 0");
+        return NULL;
+    }
+    lockMagic(self);
+    edit(self->m, pos, length);
+    unlockMagic(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Magic_add(MagicObject *self, PyObject *args) {
+    return recordEdit(self, args, MAGICadd);
+}
+
+static PyObject *Magic_remove(MagicObject *self, PyObject *args) {
+    return recordEdit(self, args, MAGICremove);
+}
+
+static PyObject *Magic_map(MagicObject *self, PyObject *args) {
+    int direction, pos;
+    if (!PyArg_ParseTuple(args, "ii", &direction, &pos) || parseDirection(direction) < 0
+        || checkInitialized(self) < 0)
+        return NULL;
+    lockMagic(self);
+    int result = MAGICmap(self->m, (MAGICDirection)direction, pos);
+    unlockMagic(self);
+    return PyLong_FromLong(result);
+}
+
+static PyObject *Magic_output_length(MagicObject *self, PyObject *args) {
+    Py_ssize_t inlen;
+    if (!PyArg_ParseTuple(args, "n", &inlen) || checkInitialized(self) < 0)
+        return NULL;
+    if (inlen < 0) {
+        PyErr_SetString(PyExc_ValueError, "inlen must be >= 0");
+        return NULL;
+    }
+    lockMagic(self);
+    size_t length = MAGICoutputLength(self->m, (size_t)inlen);
+    unlockMagic(self);
+    return PyLong_FromSize_t(length);
+}
+
+/*
+    Returns the size in bytes of the integers a buffer format describes: 4 or
+    8 for signed integers in native byte order, 0 for anything else.
+*/
+static Py_ssize_t integerFormat(const char *format, Py_ssize_t itemsize) {
+    const int one = 1;
+    bool littleEndian = *(const unsigned char*)&one == 1;
+    if (!format)
+        return 0;
+    if (*format == '@' || *format == '=' || (*format == '<' && littleEndian) || (*format == '>' && !littleEndian))
+        format++;
+    if (format[0] == '\0' || format[1] != '\0' || !strchr("ilq", format[0]))
+        return 0;
+    return itemsize == 4 || itemsize == 8 ? itemsize : 0;
+}
+
+// Maps 64-bit positions, narrowing them to int a chunk at a time
+static void mapWide(MAGIC m, MAGICDirection direction, int64_t *positions, size_t count, int threads) {
+    int chunk[WIDE_CHUNK];
+    for (size_t first = 0; first < count; first += WIDE_CHUNK) {
+        size_t n = count - first < WIDE_CHUNK ? count - first : WIDE_CHUNK;
+        for (size_t i = 0; i < n; i++) {
+            int64_t pos = positions[first + i];
+            chunk[i] = pos >= 0 && pos <= INT_MAX ? (int)pos : -1;
+        }
+        if (threads == 1) {
+            MAGICmapMany(m, direction, chunk, chunk, n);
+        } else {
+            MAGICmapManyParallel(m, direction, chunk, chunk, n, threads);
+        }
+        for (size_t i = 0; i < n; i++) {
+            positions[first + i] = chunk[i];
+        }
+    }
+}
+
+static PyObject *Magic_map_array(MagicObject *self, PyObject *args, PyObject *kwds) {
+    static char *keywords[] = {"direction", "array", "threads", NULL};
+    int direction, threads = 1;
+    PyObject *array;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO|i", keywords, &direction, &array, &threads)
+        || parseDirection(direction) < 0 || checkInitialized(self) < 0)
+        return NULL;
+    if (threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "threads must be >= 0");
+        return NULL;
+    }
+
+    Py_buffer view;
+    if (PyObject_GetBuffer(array, &view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+        return NULL;
+    Py_ssize_t width = integerFormat(view.format, view.itemsize);
+    if (width == 0) {
+        PyErr_Format(PyExc_TypeError, "expected 32-bit or 64-bit signed integers, got format '%s'",
+                     view.format ? view.format : "B");
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    size_t count = (size_t)(view.len / view.itemsize);
+
+    lockMagic(self);
+    Py_BEGIN_ALLOW_THREADS
+    if (width == 8) {
+        mapWide(self->m, (MAGICDirection)direction, (int64_t*)view.buf, count, threads);
+    } else if (threads == 1) {
+        MAGICmapMany(self->m, (MAGICDirection)direction, (int*)view.buf, (int*)view.buf, count);
+    } else {
+        MAGICmapManyParallel(self->m, (MAGICDirection)direction, (int*)view.buf, (int*)view.buf, count, threads);
+    }
+    Py_END_ALLOW_THREADS
+    unlockMagic(self);
+
+    PyBuffer_Release(&view);
+    Py_INCREF(array);
+    return array;
+}
+
+static PyMethodDef Magic_methods[] = {
+    {"add", (PyCFunction)Magic_add, METH_VARARGS,
+     "add(pos, length)\n\nRecords length bytes inserted at pos."},
+    {"remove", (PyCFunction)Magic_remove, METH_VARARGS,
+     "remove(pos, length)\n\nRecords length bytes removed from pos."},
+    {"map", (PyCFunction)Magic_map, METH_VARARGS,
+     "map(direction, pos) -> int\n\nMaps one position; -1 if it has no image."},
+    {"map_array", (PyCFunction)(void(*)(void))Magic_map_array, METH_VARARGS | METH_KEYWORDS,
+     "map_array(direction, array, threads=1) -> array\n\n"
+     "Maps every position of a writable buffer of int32 or int64 in place and\n"
+     "returns it. The GIL is released meanwhile. threads > 1 (0 for one per\n"
+     "CPU) splits the work with MAGICmapManyParallel."},
+    {"output_length", (PyCFunction)Magic_output_length, METH_VARARGS,
+     "output_length(inlen) -> int\n\nLength of the output for an input of inlen bytes."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject MagicType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymagic.Magic",
+    .tp_doc = PyDoc_STR("Magic(engine=None)\n\nPosition mapping through a series of insertions and removals."),
+    .tp_basicsize = sizeof(MagicObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Magic_init,
+    .tp_dealloc = (destructor)Magic_dealloc,
+    .tp_methods = Magic_methods,
+};
+
+static struct PyModuleDef magicModule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "pymagic",
+    .m_doc = "Bindings of the MAGIC position mapping library.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_pymagic(void) {
+    if (PyType_Ready(&MagicType) < 0)
+        return NULL;
+
+    PyObject *module = PyModule_Create(&magicModule);
+    if (!module)
+        return NULL;
+    Py_INCREF(&MagicType);
+    if (PyModule_AddObject(module, "Magic", (PyObject*)&MagicType) < 0
+        || PyModule_AddIntConstant(module, "IN_OUT", STREAM_IN_OUT) < 0
+        || PyModule_AddIntConstant(module, "OUT_IN", STREAM_OUT_IN) < 0) {
+        Py_DECREF(&MagicType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
+
+/*
+gcc -Wall -pedantic -std=c11 -O3 -pthread -shared -fPIC $(python3-config --includes) \
+    -o pymagic$(python3-config --extension-suffix) magic_python.c magic.c
+python3 test_magic_python.py
+*/
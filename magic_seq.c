@@ -0,0 +1,352 @@
+#include "magic_seq.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include <string.h>
+
+
+
+/*
+    One edit of the original stream.
+
+    Fields:
+    -------
+    - seq : Original sequence number of the edit.
+    - delta : Bytes inserted before seq (> 0), or removed from seq on (< 0).
+    - before : Shift of the stream just before the edit, modulo 2^32, folded
+               edits included: the edit lands at seq + before in the
+               rewritten stream.
+*/
+typedef struct {
+    uint32_t seq;
+    int32_t delta;
+    uint32_t before;
+} SeqEdit;
+
+/*
+    Sequence-space mapping.
+
+    Fields:
+    -------
+    - base : First original sequence number of the window. Every kept edit
+             starts at or after it, and sequence numbers are compared by
+             their distance from it.
+    - window : How far behind the newest edit the base is kept.
+    - front : End of the newest edit, which drags the window forward.
+    - offset : Shift of everything folded, which applies from base on.
+    - edits : Kept edits in [first, first + count), in stream order, inserts
+              before removals at the same sequence number.
+*/
+struct magicSeq {
+    uint32_t base;
+    uint32_t window;
+    uint32_t front;
+    uint32_t offset;
+    SeqEdit *edits;
+    size_t first, count, capacity;
+};
+
+// Largest window, so that any two numbers of a window compare without ambiguity
+#define SEQ_MAX_WINDOW (1u << 30)
+
+// Distance of seq ahead of the base; numbers behind it are 2^31 or more away
+static uint32_t seqAhead(const struct magicSeq *s, uint32_t seq) {
+    return seq - s->base;
+}
+
+static bool seqBehind(const struct magicSeq *s, uint32_t seq) {
+    return seqAhead(s, seq) >= (1u << 31);
+}
+
+// First original sequence number after an edit
+static uint32_t seqEnd(const SeqEdit *e) {
+    return e->delta < 0 ? e->seq - (uint32_t)e->delta : e->seq;
+}
+
+/*
+    Creates a sequence-space mapping.
+
+    Arguments:
+    ----------
+    - isn : Initial sequence number, the first base of the window.
+    - window : Distance kept between the newest edit and the base, in
+               (0, 2^30].
+
+    Return:
+    -------
+    - The mapping, or NULL on invalid arguments or allocation failure.
+*/
+MAGICSeq MAGICseqInit(uint32_t isn, uint32_t window){
+    if (window == 0 || window > SEQ_MAX_WINDOW)
+        return NULL;
+
+    MAGICSeq s = (MAGICSeq)calloc(1, sizeof(struct magicSeq));
+    if (!s)
+        return NULL;
+    s->base = isn;
+    s->front = isn;
+    s->window = window;
+    s->capacity = 16;
+    s->edits = (SeqEdit*)malloc(s->capacity * sizeof(SeqEdit));
+    if (!s->edits) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/*
+    Destroys a sequence-space mapping.
+
+    Arguments:
+    ----------
+    - s : The mapping (may be NULL).
+*/
+void MAGICseqDestroy(MAGICSeq s){
+    if (!s)
+        return;
+    free(s->edits);
+    free(s);
+}
+
+/*
+    Folds the edits that lie wholly behind the base into the offset. A
+    removal that straddles the base pulls the base back to its start.
+*/
+static void seqFold(MAGICSeq s) {
+    SeqEdit *edits = s->edits + s->first;
+    size_t folded = 0;
+    while (folded < s->count) {
+        const SeqEdit *e = &edits[folded];
+        uint32_t end = seqEnd(e);
+        bool behind = e->delta > 0 ? seqBehind(s, e->seq) : seqBehind(s, end) || end == s->base;
+        if (!behind)
+            break;
+        s->offset = e->before + (uint32_t)e->delta;
+        folded++;
+    }
+    s->first += folded;
+    s->count -= folded;
+    if (s->count > 0 && seqBehind(s, s->edits[s->first].seq))
+        s->base = s->edits[s->first].seq;
+    if (s->count == 0)
+        s->first = 0;
+}
+
+/*
+    Moves the window base forward and folds the edits behind it.
+
+    Arguments:
+    ----------
+    - s : The mapping.
+    - seq : The new base, ignored unless it is ahead of the current one.
+*/
+void MAGICseqAdvance(MAGICSeq s, uint32_t seq){
+    if (!s || seqBehind(s, seq) || seq == s->base)
+        return;
+    s->base = seq;
+    seqFold(s);
+}
+
+// Index, among the kept edits, where an edit at seq of the given kind belongs
+static size_t seqSlot(const MAGICSeq s, uint32_t seq, bool removal) {
+    const SeqEdit *edits = s->edits + s->first;
+    uint32_t ahead = seqAhead(s, seq);
+    size_t lo = 0, hi = s->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint32_t other = seqAhead(s, edits[mid].seq);
+        // Inserts go after inserts at the same number and before removals
+        if (other < ahead || (other == ahead && (removal || edits[mid].delta > 0))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool seqReserve(MAGICSeq s) {
+    if (s->first + s->count < s->capacity)
+        return true;
+    if (s->first > 0) {
+        memmove(s->edits, s->edits + s->first, s->count * sizeof(SeqEdit));
+        s->first = 0;
+        if (s->count < s->capacity)
+            return true;
+    }
+    SeqEdit *bigger = (SeqEdit*)realloc(s->edits, 2 * s->capacity * sizeof(SeqEdit));
+    if (!bigger)
+        return false;
+    s->edits = bigger;
+    s->capacity *= 2;
+    return true;
+}
+
+/*
+    Records an edit of delta bytes at seq. Edits behind the window are
+    folded into the offset at once; the others are inserted in order, which
+    is O(1) for edits in stream order and O(w) otherwise.
+*/
+static int seqRecord(MAGICSeq s, uint32_t seq, int32_t delta) {
+    uint32_t length = delta < 0 ? (uint32_t)-delta : (uint32_t)delta;
+
+    if (seqBehind(s, seq)) {
+        // Shifts every kept edit; a removal may not reach into the window
+        if (delta < 0 && !seqBehind(s, seq + length) && seq + length != s->base)
+            return -1;
+        s->offset += (uint32_t)delta;
+        for (size_t k = s->first; k < s->first + s->count; k++) {
+            s->edits[k].before += (uint32_t)delta;
+        }
+        return 0;
+    }
+
+    size_t slot = seqSlot(s, seq, delta < 0);
+    SeqEdit *edits = s->edits + s->first;
+    uint32_t ahead = seqAhead(s, seq);
+    if (slot > 0 && edits[slot - 1].delta < 0 && seqAhead(s, seqEnd(&edits[slot - 1])) > ahead)
+        return -1; // Inside an earlier removal
+    if (delta < 0 && slot < s->count && seqAhead(s, edits[slot].seq) < ahead + length)
+        return -1; // A later edit falls inside this removal
+    if (ahead + length >= (1u << 31))
+        return -1;
+    if (!seqReserve(s))
+        return -1;
+
+    edits = s->edits + s->first;
+    memmove(edits + slot + 1, edits + slot, (s->count - slot) * sizeof(SeqEdit));
+    edits[slot].seq = seq;
+    edits[slot].delta = delta;
+    edits[slot].before = slot > 0 ? edits[slot - 1].before + (uint32_t)edits[slot - 1].delta : s->offset;
+    s->count++;
+    for (size_t k = slot + 1; k < s->count; k++) {
+        edits[k].before += (uint32_t)delta;
+    }
+
+    // The newest edit drags the window
+    uint32_t end = seqEnd(&edits[slot]);
+    if (seqAhead(s, end) > seqAhead(s, s->front))
+        s->front = end;
+    if (seqAhead(s, s->front) > s->window)
+        MAGICseqAdvance(s, s->front - s->window);
+    return 0;
+}
+
+/*
+    Records bytes inserted into the stream.
+
+    Arguments:
+    ----------
+    - s : The mapping.
+    - seq : Original sequence number the bytes are inserted before.
+    - length : Number of bytes, in (0, 2^30].
+
+    Return:
+    -------
+    - 0, or -1 on invalid arguments, when seq lies inside a removed range, or
+      on allocation failure.
+*/
+int MAGICseqAdd(MAGICSeq s, uint32_t seq, int length){
+    if (!s || length <= 0 || (uint32_t)length > SEQ_MAX_WINDOW)
+        return -1;
+    return seqRecord(s, seq, length);
+}
+
+/*
+    Records original bytes removed from the stream.
+
+    Arguments:
+    ----------
+    - s : The mapping.
+    - seq : First removed original sequence number.
+    - length : Number of bytes, in (0, 2^30].
+
+    Return:
+    -------
+    - 0, or -1 on invalid arguments, when the range overlaps another edit or
+      straddles the window base, or on allocation failure.
+*/
+int MAGICseqRemove(MAGICSeq s, uint32_t seq, int length){
+    if (!s || length <= 0 || (uint32_t)length > SEQ_MAX_WINDOW)
+        return -1;
+    return seqRecord(s, seq, -length);
+}
+
+/*
+    Translates a sequence or acknowledgment number.
+
+    Arguments:
+    ----------
+    - s : The mapping.
+    - direction : STREAM_IN_OUT for an original sequence number,
+                  STREAM_OUT_IN for a rewritten acknowledgment number.
+    - seq : The number.
+
+    Return:
+    -------
+    - The translated number.
+
+    Behavior:
+    ---------
+    - A sequence number inside a removed range maps to the next surviving
+      byte. An acknowledgment inside inserted bytes maps to the original
+      byte they precede, and one just past a removal acknowledges the
+      removed bytes too.
+    - Numbers behind the window are translated with the folded offset.
+    - Binary search over the kept edits: O(log w).
+*/
+uint32_t MAGICseqMap(MAGICSeq s, MAGICDirection direction, uint32_t seq){
+    if (!s)
+        return seq;
+
+    const SeqEdit *edits = s->edits + s->first;
+    size_t lo = 0, hi = s->count;
+
+    if (!direction) { // STREAM_IN_OUT
+        if (seqBehind(s, seq))
+            return seq + s->offset;
+        uint32_t ahead = seqAhead(s, seq);
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (seqAhead(s, edits[mid].seq) <= ahead) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0)
+            return seq + s->offset;
+        const SeqEdit *e = &edits[lo - 1];
+        if (e->delta < 0 && ahead - seqAhead(s, e->seq) < (uint32_t)-e->delta)
+            return e->seq + e->before;
+        return seq + e->before + (uint32_t)e->delta;
+    }
+
+    // STREAM_OUT_IN: edits land in the rewritten stream in the same order
+    uint32_t outBase = s->base + s->offset;
+    uint32_t ahead = seq - outBase;
+    if (ahead >= (1u << 31))
+        return seq - s->offset;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (edits[mid].seq + edits[mid].before - outBase <= ahead) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0)
+        return seq - s->offset;
+    const SeqEdit *e = &edits[lo - 1];
+    uint32_t landed = e->seq + e->before;
+    if (e->delta > 0 && seq - landed < (uint32_t)e->delta)
+        return e->seq;
+    return seq - e->before - (uint32_t)e->delta;
+}
+
+/*
+    Returns the number of edits kept in the window.
+*/
+size_t MAGICseqEdits(MAGICSeq s){
+    return s ? s->count : 0;
+}
@@ -0,0 +1,80 @@
+#ifndef MAGIC_SEQ_H
+#define MAGIC_SEQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "magic.h"
+
+/**
+ * Sequence-space mapping for one direction of a TCP connection.
+ *
+ * Edits are recorded at original sequence numbers, which wrap around modulo
+ * 2^32 and are compared relative to the window base. Only edits inside the
+ * window are kept; edits that fall behind it are folded into a single
+ * offset, so memory is bounded by the number of edits per window.
+ */
+typedef struct magicSeq *MAGICSeq;
+
+/**
+ * Creates a sequence-space mapping.
+ * @param isn The initial sequence number, which starts the window.
+ * @param window How far behind the newest edit the window reaches, at most 2^30.
+ * @return The new mapping, or NULL on invalid arguments or allocation failure.
+ */
+MAGICSeq MAGICseqInit(uint32_t isn, uint32_t window);
+
+/**
+ * Destroys a sequence-space mapping.
+ * @param s The mapping.
+ */
+void MAGICseqDestroy(MAGICSeq s);
+
+/**
+ * Records length bytes inserted before the original byte seq.
+ * @param s The mapping.
+ * @param seq The original sequence number the bytes are inserted before.
+ * @param length The number of bytes.
+ * @return 0, or -1 on invalid arguments, when seq lies inside a removed
+ *         range, or on allocation failure.
+ */
+int MAGICseqAdd(MAGICSeq s, uint32_t seq, int length);
+
+/**
+ * Records the original bytes [seq, seq + length) as removed.
+ * @param s The mapping.
+ * @param seq The first removed original sequence number.
+ * @param length The number of bytes.
+ * @return 0, or -1 on invalid arguments, when the range overlaps another
+ *         edit, or on allocation failure.
+ */
+int MAGICseqRemove(MAGICSeq s, uint32_t seq, int length);
+
+/**
+ * Moves the window base forward, typically to the highest acknowledged
+ * original sequence number. Edits that end before it are folded.
+ * @param s The mapping.
+ * @param seq The new base; ignored if it is not ahead of the current one.
+ */
+void MAGICseqAdvance(MAGICSeq s, uint32_t seq);
+
+/**
+ * Translates a sequence number.
+ * STREAM_IN_OUT maps an original sequence number (from the sender) to the
+ * rewritten stream; STREAM_OUT_IN maps a rewritten acknowledgment number
+ * (from the receiver) back to the original stream. Numbers behind the window
+ * are translated with the folded offset. O(log w) in the edits in the window.
+ * @param s The mapping.
+ * @param direction The mapping direction.
+ * @param seq The sequence or acknowledgment number.
+ * @return The translated number.
+ */
+uint32_t MAGICseqMap(MAGICSeq s, MAGICDirection direction, uint32_t seq);
+
+/**
+ * Returns the number of edits kept in the window.
+ * @param s The mapping.
+ * @return The number of edits, 0 if s is NULL.
+ */
+size_t MAGICseqEdits(MAGICSeq s);
+
+#endif
@@ -0,0 +1,401 @@
+#define _POSIX_C_SOURCE 200809L
+#include "magic_streams.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+/*
+    Open-addressing table from stream identifiers to stream indices.
+
+    Fields:
+    -------
+    - keys : Stream identifiers.
+    - values : Index of each stream, in order of first appearance.
+    - used : Marks occupied slots.
+    - capacity : Number of slots (a power of two).
+    - size : Number of streams stored.
+*/
+typedef struct {
+    unsigned long *keys;
+    size_t *values;
+    bool *used;
+    size_t capacity;
+    size_t size;
+} StreamTable;
+
+// Mixes the bits of a stream identifier (splitmix64 finalizer)
+static size_t hashStream(unsigned long stream) {
+    uint64_t x = (uint64_t)stream;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (size_t)(x ^ (x >> 31));
+}
+
+static bool streamTableInit(StreamTable *table, size_t capacity) {
+    table->keys = (unsigned long*)malloc(capacity * sizeof(unsigned long));
+    table->values = (size_t*)malloc(capacity * sizeof(size_t));
+    table->used = (bool*)calloc(capacity, sizeof(bool));
+    table->capacity = capacity;
+    table->size = 0;
+    return table->keys && table->values && table->used;
+}
+
+static void streamTableFree(StreamTable *table) {
+    free(table->keys);
+    free(table->values);
+    free(table->used);
+}
+
+// Returns the slot holding `stream`, or the empty slot where it belongs
+static size_t streamTableSlot(const StreamTable *table, unsigned long stream) {
+    size_t mask = table->capacity - 1;
+    size_t slot = hashStream(stream) & mask;
+    while (table->used[slot] && table->keys[slot] != stream) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool streamTableGrow(StreamTable *table) {
+    StreamTable bigger;
+    if (!streamTableInit(&bigger, table->capacity * 2)) {
+        streamTableFree(&bigger);
+        return false;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->used[i]) {
+            size_t slot = streamTableSlot(&bigger, table->keys[i]);
+            bigger.used[slot] = true;
+            bigger.keys[slot] = table->keys[i];
+            bigger.values[slot] = table->values[i];
+        }
+    }
+    bigger.size = table->size;
+    streamTableFree(table);
+    *table = bigger;
+    return true;
+}
+
+/*
+    Returns the index of a stream, assigning the next one to new streams.
+    Returns (size_t)-1 if the table cannot grow.
+*/
+static size_t streamTableIndex(StreamTable *table, unsigned long stream) {
+    size_t slot = streamTableSlot(table, stream);
+    if (table->used[slot])
+        return table->values[slot];
+
+    if (2 * (table->size + 1) > table->capacity) {
+        if (!streamTableGrow(table))
+            return (size_t)-1;
+        slot = streamTableSlot(table, stream);
+    }
+    table->used[slot] = true;
+    table->keys[slot] = stream;
+    table->values[slot] = table->size;
+    return table->size++;
+}
+
+/*
+    Queue of streams owned by one worker.
+
+    Fields:
+    -------
+    - tasks : Stream indices, largest stream first.
+    - range : Packed [head, tail) of the remaining tasks: head in the high 32
+              bits, tail in the low 32 bits. Packing both ends in one word lets
+              the owner and the thieves claim tasks with a single compare and
+              swap, and no task is ever pushed once the run has started.
+*/
+typedef struct {
+    size_t *tasks;
+    _Atomic uint64_t range;
+} StreamQueue;
+
+/*
+    Claims one task of a queue.
+
+    Arguments:
+    ----------
+    - queue : The queue.
+    - owner : True to take from the head (largest remaining stream), false to
+              steal from the tail (smallest remaining stream).
+    - task : Receives the stream index.
+
+    Return:
+    -------
+    - True if a task was claimed, false if the queue is empty.
+*/
+static bool streamQueueTake(StreamQueue *queue, bool owner, size_t *task) {
+    uint64_t range = atomic_load(&queue->range);
+    for (;;) {
+        uint32_t head = (uint32_t)(range >> 32), tail = (uint32_t)range;
+        if (head >= tail)
+            return false;
+
+        uint64_t next = owner ? ((uint64_t)(head + 1) << 32) | tail
+                              : ((uint64_t)head << 32) | (tail - 1);
+        if (atomic_compare_exchange_weak(&queue->range, &range, next)) {
+            *task = queue->tasks[owner ? head : tail - 1];
+            return true;
+        }
+    }
+}
+
+/*
+    State shared by the workers of one MAGICprocessStreams run.
+*/
+typedef struct {
+    const MAGICEdit *edits;        // Edits grouped by stream, in log order within a stream
+    const size_t *offsets;         // First edit of each stream (streams + 1 entries)
+    const unsigned long *ids;      // Identifier of each stream
+    StreamQueue *queues;           // One queue per worker
+    int workers;
+    MAGICStreamCallback callback;
+    void *ctx;
+    atomic_bool failed;            // Set when an instance could not be created
+} StreamRun;
+
+/*
+    Arguments and results of one worker.
+*/
+typedef struct {
+    StreamRun *run;
+    int id;
+    size_t steals;
+    double busy; // Seconds spent replaying streams
+} StreamWorker;
+
+static double monotonicSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void replayStream(StreamRun *run, size_t stream) {
+    MAGIC m = MAGICinit();
+    if (!m) {
+        atomic_store(&run->failed, true);
+        return;
+    }
+    size_t first = run->offsets[stream];
+    MAGICapplyEdits(m, run->edits + first, run->offsets[stream + 1] - first);
+    if (run->callback) {
+        run->callback(run->ids[stream], stream, m, run->ctx);
+    }
+    MAGICdestroy(m);
+}
+
+/*
+    Worker loop: drains its own queue, then steals from the other workers
+    until every queue is empty. Tasks are only ever removed, so a full pass
+    over empty queues means the run is over.
+*/
+static void *streamWorker(void *arg) {
+    StreamWorker *worker = (StreamWorker*)arg;
+    StreamRun *run = worker->run;
+    size_t task;
+
+    for (;;) {
+        bool found = streamQueueTake(&run->queues[worker->id], true, &task);
+        for (int k = 1; k < run->workers && !found; k++) {
+            int victim = (worker->id + k) % run->workers;
+            if (streamQueueTake(&run->queues[victim], false, &task)) {
+                worker->steals++;
+                found = true;
+            }
+        }
+        if (!found)
+            break;
+
+        double start = monotonicSeconds();
+        replayStream(run, task);
+        worker->busy += monotonicSeconds() - start;
+    }
+    return NULL;
+}
+
+// A stream and its number of edits, for scheduling
+typedef struct {
+    size_t edits;
+    size_t stream;
+} StreamSize;
+
+// Orders streams by decreasing number of edits, then by index
+static int compareStreamSize(const void *a, const void *b) {
+    const StreamSize *x = (const StreamSize*)a, *y = (const StreamSize*)b;
+    if (x->edits != y->edits)
+        return x->edits > y->edits ? -1 : 1;
+    return x->stream < y->stream ? -1 : (x->stream > y->stream);
+}
+
+/*
+    Replays an interleaved multi-stream edit log, one MAGIC instance per stream.
+
+    Arguments:
+    ----------
+    - records : The log, in the order the edits were applied.
+    - count : Number of records.
+    - threads : Number of worker threads, or 0 for one per online CPU.
+    - callback : Called once per stream with its instance (may be NULL).
+    - ctx : Passed to the callback.
+    - report : Filled with throughput and load balance figures (may be NULL).
+
+    Return:
+    -------
+    - 0 on success, -1 on failure.
+
+    Behavior:
+    ---------
+    - The log is read once: each record is routed to its stream through a hash
+      table, then a counting pass groups the edits by stream, keeping log order
+      within each stream.
+    - Streams are sorted by decreasing size and dealt round-robin to one queue
+      per worker. Each worker replays the largest streams of its own queue
+      first; once it runs dry it steals the smallest remaining streams of the
+      others, so a few huge streams do not leave the other cores idle.
+    - Only one instance per worker is alive at any time: the callback receives
+      it, and it is destroyed when the callback returns.
+*/
+int MAGICprocessStreams(const MAGICStreamRecord *records, size_t count, int threads,
+                        MAGICStreamCallback callback, void *ctx, MAGICStreamReport *report){
+    if (!records && count > 0)
+        return -1;
+
+    double start = monotonicSeconds();
+    int result = -1;
+    StreamTable table;
+    size_t *streamOf = (size_t*)malloc((count > 0 ? count : 1) * sizeof(size_t));
+    size_t *offsets = NULL, *order = NULL;
+    StreamSize *sizes = NULL;
+    unsigned long *ids = NULL;
+    MAGICEdit *edits = NULL;
+    StreamQueue *queues = NULL;
+    StreamWorker *workers = NULL;
+    pthread_t *handles = NULL;
+    bool *started = NULL;
+
+    if (!streamTableInit(&table, 1024) || !streamOf)
+        goto done;
+
+    // 1. Route every record to its stream
+    for (size_t i = 0; i < count; i++) {
+        streamOf[i] = streamTableIndex(&table, records[i].stream);
+        if (streamOf[i] == (size_t)-1)
+            goto done;
+    }
+    size_t streams = table.size;
+
+    // 2. Group the edits by stream with a counting pass
+    offsets = (size_t*)calloc(streams + 1, sizeof(size_t));
+    ids = (unsigned long*)malloc((streams > 0 ? streams : 1) * sizeof(unsigned long));
+    edits = (MAGICEdit*)malloc((count > 0 ? count : 1) * sizeof(MAGICEdit));
+    if (!offsets || !ids || !edits)
+        goto done;
+    for (size_t i = 0; i < count; i++) {
+        offsets[streamOf[i] + 1]++;
+        ids[streamOf[i]] = records[i].stream;
+    }
+    for (size_t s = 0; s < streams; s++) {
+        offsets[s + 1] += offsets[s];
+    }
+    for (size_t i = 0; i < count; i++) {
+        edits[offsets[streamOf[i]]++] = records[i].edit;
+    }
+    for (size_t s = streams; s > 0; s--) {
+        offsets[s] = offsets[s - 1];
+    }
+    offsets[0] = 0;
+
+    // 3. Deal the streams, largest first, round-robin to one queue per worker
+    threads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > streams)
+        threads = streams > 0 ? (int)streams : 1;
+    size_t perQueue = (streams + (size_t)threads - 1) / (size_t)threads;
+    if (perQueue > UINT32_MAX)
+        goto done;
+
+    sizes = (StreamSize*)malloc((streams > 0 ? streams : 1) * sizeof(StreamSize));
+    order = (size_t*)malloc((size_t)threads * (perQueue > 0 ? perQueue : 1) * sizeof(size_t));
+    queues = (StreamQueue*)calloc((size_t)threads, sizeof(StreamQueue));
+    workers = (StreamWorker*)calloc((size_t)threads, sizeof(StreamWorker));
+    handles = (pthread_t*)malloc((size_t)threads * sizeof(pthread_t));
+    started = (bool*)calloc((size_t)threads, sizeof(bool));
+    if (!sizes || !order || !queues || !workers || !handles || !started)
+        goto done;
+    for (size_t s = 0; s < streams; s++) {
+        sizes[s].edits = offsets[s + 1] - offsets[s];
+        sizes[s].stream = s;
+    }
+    qsort(sizes, streams, sizeof(StreamSize), compareStreamSize);
+
+    StreamRun run = {edits, offsets, ids, queues, threads, callback, ctx, false};
+    for (int t = 0; t < threads; t++) {
+        queues[t].tasks = order + (size_t)t * perQueue;
+        workers[t].run = &run;
+        workers[t].id = t;
+    }
+    for (size_t s = 0; s < streams; s++) {
+        size_t t = s % (size_t)threads;
+        queues[t].tasks[s / (size_t)threads] = sizes[s].stream;
+    }
+    for (int t = 0; t < threads; t++) {
+        size_t dealt = streams / (size_t)threads + ((size_t)t < streams % (size_t)threads);
+        atomic_init(&queues[t].range, (uint64_t)dealt);
+    }
+
+    // 4. Run the workers; a worker whose thread fails to start is simply
+    //    drained by the others
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&handles[t], NULL, streamWorker, &workers[t]) == 0;
+    }
+    streamWorker(&workers[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t])
+            pthread_join(handles[t], NULL);
+    }
+    result = atomic_load(&run.failed) ? -1 : 0;
+
+    if (report) {
+        report->streams = streams;
+        report->records = count;
+        report->threads = threads;
+        report->steals = 0;
+        report->maxBusySeconds = report->meanBusySeconds = 0;
+        int ran = 0;
+        for (int t = 0; t < threads; t++) {
+            if (t > 0 && !started[t])
+                continue;
+            report->steals += workers[t].steals;
+            report->meanBusySeconds += workers[t].busy;
+            if (workers[t].busy > report->maxBusySeconds)
+                report->maxBusySeconds = workers[t].busy;
+            ran++;
+        }
+        report->meanBusySeconds /= ran;
+        report->seconds = monotonicSeconds() - start;
+        report->editsPerSecond = report->seconds > 0 ? (double)count / report->seconds : 0;
+    }
+
+done:
+    streamTableFree(&table);
+    free(streamOf);
+    free(offsets);
+    free(ids);
+    free(edits);
+    free(sizes);
+    free(order);
+    free(queues);
+    free(workers);
+    free(handles);
+    free(started);
+    return result;
+}
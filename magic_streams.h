@@ -0,0 +1,57 @@
+#ifndef MAGIC_STREAMS_H
+#define MAGIC_STREAMS_H
+
+#include <stddef.h>
+#include "magic.h"
+
+/**
+ * One record of an interleaved multi-stream edit log.
+ */
+typedef struct{
+    unsigned long stream; /* Identifier of the stream the edit belongs to */
+    MAGICEdit edit;       /* The edit, in the coordinates of that stream */
+} MAGICStreamRecord;
+
+/**
+ * Called once per stream, from a worker thread, with the MAGIC instance
+ * holding all the edits of the stream. The instance is destroyed when the
+ * callback returns; use MAGICclone to keep it.
+ * @param stream The stream identifier.
+ * @param index The rank of the stream in order of first appearance in the log.
+ * @param m The MAGIC instance of the stream.
+ * @param ctx The context passed to MAGICprocessStreams.
+ */
+typedef void (*MAGICStreamCallback)(unsigned long stream, size_t index, MAGIC m, void *ctx);
+
+/**
+ * Throughput and load balance of a MAGICprocessStreams run.
+ */
+typedef struct{
+    size_t streams;         /* Number of distinct streams */
+    size_t records;         /* Number of records processed */
+    int threads;            /* Number of worker threads */
+    size_t steals;          /* Streams taken from another worker's queue */
+    double seconds;         /* Wall-clock time, routing included */
+    double editsPerSecond;  /* records / seconds */
+    double maxBusySeconds;  /* Busy time of the most loaded worker */
+    double meanBusySeconds; /* Mean busy time of the workers */
+} MAGICStreamReport;
+
+/**
+ * Replays an interleaved edit log into one MAGIC instance per stream.
+ * Records are routed to their stream in a single pass, then streams are
+ * processed on a work-stealing pool of threads. The largest streams are
+ * scheduled first and idle workers steal from the others, so skewed stream
+ * sizes do not leave cores idle.
+ * @param records The log, in the order the edits were applied.
+ * @param count The number of records.
+ * @param threads The number of worker threads, or 0 for one per online CPU.
+ * @param callback Called once per stream (may be NULL).
+ * @param ctx Passed to the callback.
+ * @param report Filled with throughput and load balance figures (may be NULL).
+ * @return 0 on success, -1 on allocation failure.
+ */
+int MAGICprocessStreams(const MAGICStreamRecord *records, size_t count, int threads,
+                        MAGICStreamCallback callback, void *ctx, MAGICStreamReport *report);
+
+#endif
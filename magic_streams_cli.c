@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "magic_streams.h"
+
+/*
+ * magic-streams: offline reprocessing of a multi-stream edit log.
+ *
+ * Reads an interleaved log with one record per line:
+ *
+ *     <stream id> <op> <pos> <len>
+ *
+ * where <op> is `+`, `a` or `add` for an insertion and `-`, `r` or `remove`
+ * for a removal. Blank lines and lines starting with `#` are ignored.
+ *
+ * Every stream is replayed into its own MAGIC instance on a work-stealing
+ * thread pool. One snapshot line per stream, in order of first appearance,
+ * is written to stdout:
+ *
+ *     <stream id> edits <n> nodes <n> depth <n> [<probe>:<mapped> ...]
+ *
+ * and throughput and load balance figures are written to stderr.
+ *
+ * Usage: magic-streams [-t threads] [-r] [-p pos]... [log]
+ *   -t threads  Worker threads (default: one per online CPU)
+ *   -p pos      Position to map in every stream (repeatable)
+ *   -r          Map probes from output to input instead of input to output
+ */
+
+enum { MAX_PROBES = 64 };
+
+typedef struct {
+    const int *probes;
+    int probeCount;
+    MAGICDirection direction;
+    MAGICStats *stats;  // One per stream
+    int *mapped;        // probeCount per stream
+    unsigned long *ids; // One per stream
+} Snapshots;
+
+static void usage(void) {
+    fprintf(stderr, "usage: magic-streams [-t threads] [-r] [-p pos]... [log]\n");
+}
+
+// Reads a whole stream into a NUL-terminated buffer
+static char *readAll(FILE *f, size_t *size) {
+    size_t capacity = 1 << 20, used = 0;
+    char *buffer = malloc(capacity);
+    while (buffer) {
+        used += fread(buffer + used, 1, capacity - used - 1, f);
+        if (used < capacity - 1)
+            break;
+        char *bigger = realloc(buffer, capacity * 2);
+        if (!bigger) {
+            free(buffer);
+            return NULL;
+        }
+        buffer = bigger;
+        capacity *= 2;
+    }
+    if (buffer) {
+        buffer[used] = '\0';
+        *size = used;
+    }
+    return buffer;
+}
+
+static int parseOp(const char *op, size_t len, MAGICEditKind *kind) {
+    if ((len == 1 && (*op == '+' || *op == 'a')) || (len == 3 && !strncmp(op, "add", 3))) {
+        *kind = MAGIC_EDIT_ADD;
+        return 0;
+    }
+    if ((len == 1 && (*op == '-' || *op == 'r')) || (len == 6 && !strncmp(op, "remove", 6))) {
+        *kind = MAGIC_EDIT_REMOVE;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Parses the log in place. Returns the number of records, or -1 after
+ * reporting the first malformed line.
+ */
+static long parseLog(char *text, MAGICStreamRecord **records) {
+    size_t capacity = 1024, count = 0;
+    MAGICStreamRecord *out = malloc(capacity * sizeof(MAGICStreamRecord));
+    long line = 0;
+
+    for (char *p = text; out && *p; ) {
+        char *end = strchr(p, '\n');
+        if (end) *end = '\0';
+        line++;
+
+        char *q = p + strspn(p, " \t\r");
+        if (*q && *q != '#') {
+            MAGICStreamRecord r;
+            char *next, *start = q;
+            r.stream = strtoul(start, &next, 10);
+            q = next + strspn(next, " \t");
+            size_t opLen = strcspn(q, " \t");
+            int ok = next != start && parseOp(q, opLen, &r.edit.kind) == 0;
+            if (ok) {
+                r.edit.pos = (int)strtol(q + opLen, &next, 10);
+                r.edit.length = (int)strtol(next, &q, 10);
+                ok = q != next && q[strspn(q, " \t\r")] == '\0';
+            }
+            if (!ok) {
+                fprintf(stderr, "magic-streams: malformed record on line %ld\n", line);
+                free(out);
+                return -1;
+            }
+            if (count == capacity) {
+                MAGICStreamRecord *bigger = realloc(out, 2 * capacity * sizeof(MAGICStreamRecord));
+                if (!bigger) {
+                    free(out);
+                    out = NULL;
+                    break;
+                }
+                out = bigger;
+                capacity *= 2;
+            }
+            out[count++] = r;
+        }
+        if (!end) break;
+        p = end + 1;
+    }
+
+    if (!out) {
+        fprintf(stderr, "magic-streams: out of memory\n");
+        return -1;
+    }
+    *records = out;
+    return (long)count;
+}
+
+// Runs on worker threads: each stream writes only its own slots
+static void snapshotStream(unsigned long stream, size_t index, MAGIC m, void *ctx) {
+    Snapshots *snapshots = ctx;
+    snapshots->ids[index] = stream;
+    MAGICstats(m, &snapshots->stats[index]);
+    for (int i = 0; i < snapshots->probeCount; i++) {
+        snapshots->mapped[index * snapshots->probeCount + i] =
+            MAGICmap(m, snapshots->direction, snapshots->probes[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    int threads = 0, probes[MAX_PROBES], probeCount = 0;
+    MAGICDirection direction = STREAM_IN_OUT;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc && probeCount < MAX_PROBES) {
+            probes[probeCount++] = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-r")) {
+            direction = STREAM_OUT_IN;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            usage();
+            return 2;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    FILE *in = path && strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    size_t size = 0;
+    char *text = readAll(in, &size);
+    if (in != stdin) fclose(in);
+    if (!text) {
+        fprintf(stderr, "magic-streams: cannot read the log\n");
+        return 1;
+    }
+
+    MAGICStreamRecord *records = NULL;
+    long count = parseLog(text, &records);
+    free(text);
+    if (count < 0)
+        return 1;
+
+    // Streams are numbered by first appearance, so the record count bounds them
+    size_t slots = count > 0 ? (size_t)count : 1;
+    Snapshots snapshots = {probes, probeCount, direction,
+                           calloc(slots, sizeof(MAGICStats)),
+                           calloc(slots * (probeCount > 0 ? probeCount : 1), sizeof(int)),
+                           calloc(slots, sizeof(unsigned long))};
+    MAGICStreamReport report;
+    if (!snapshots.stats || !snapshots.mapped || !snapshots.ids
+        || MAGICprocessStreams(records, (size_t)count, threads, snapshotStream, &snapshots, &report) != 0) {
+        fprintf(stderr, "magic-streams: out of memory\n");
+        return 1;
+    }
+
+    for (size_t s = 0; s < report.streams; s++) {
+        MAGICStats *st = &snapshots.stats[s];
+        printf("%lu edits %d nodes %d depth %d", snapshots.ids[s], st->edits, st->nodes, st->depth);
+        for (int i = 0; i < probeCount; i++) {
+            printf(" %d:%d", probes[i], snapshots.mapped[s * probeCount + i]);
+        }
+        putchar('\n');
+    }
+
+    fprintf(stderr, "%zu records, %zu streams, %d threads: %.3f s, %.0f edits/s\n",
+            report.records, report.streams, report.threads, report.seconds, report.editsPerSecond);
+    fprintf(stderr, "load balance: busiest worker %.3f s, mean %.3f s (%.2fx), %zu steals\n",
+            report.maxBusySeconds, report.meanBusySeconds,
+            report.meanBusySeconds > 0 ? report.maxBusySeconds / report.meanBusySeconds : 1.0,
+            report.steals);
+
+    free(records);
+    free(snapshots.stats);
+    free(snapshots.mapped);
+    free(snapshots.ids);
+    return 0;
+}
@@ -1,6 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 #include "magic.h"
+#include "magic_streams.h"
+#include "magic_checksum.h"
+#include "magic_seq.h"
+#if defined(__linux__) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(MAGIC_NO_PROBES)
+#define TEST_PROBES 1
+#include <elf.h>
+#endif
+
+// Engine under test, every test case is run once per engine
+static MAGICEngineKind engine = MAGIC_ENGINE_RBTREE;
 
 /*
  * Test Plan for MAGIC Byte Stream Mapping System
@@ -14,7 +29,7 @@
 // Tests basic mapping and how it changes after insertion
 void test_mapping(void) {
     // Initialize a new MAGIC mapping object
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     // Verify identity mapping for untouched positions
     assert(MAGICmap(m, STREAM_IN_OUT, 3) == 3);
@@ -37,7 +52,7 @@ void test_mapping(void) {
 
 // Tests a basic insertion of bytes
 void test_addition(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     // Insert 3 bytes at position 5
     MAGICadd(m, 5, 3);
@@ -52,7 +67,7 @@ void test_addition(void) {
 
 // Tests deletion/removal of bytes
 void test_suppression(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     // Remove 3 bytes starting at position 6 (removes 6, 7, 8)
     MAGICremove(m, 6, 3);
@@ -68,7 +83,7 @@ void test_suppression(void) {
 
 // Stress test: multiple additions and removals over a large range
 void test_large_operations(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     // Add 5 bytes every 10 positions (from 0 to 990)
     for (int i = 0; i < 1000; i += 10) {
@@ -86,9 +101,593 @@ void test_large_operations(void) {
     MAGICdestroy(m);
 }
 
+// Tests that mappings stay consistent when an instance outgrows its inline nodes
+void test_small_to_large(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+
+    // Insert 1 byte every 100 positions, well past the inline node capacity
+    for (int i = 0; i < 40; i++) {
+        MAGICadd(m, i * 100, 1);
+
+        // Every position after the last edit is shifted by the number of edits
+        assert(MAGICmap(m, STREAM_IN_OUT, i * 100 + 50) == i * 100 + 50 + (i + 1));
+        assert(MAGICmap(m, STREAM_OUT_IN, i * 100 + 50 + (i + 1)) == i * 100 + 50);
+    }
+
+    MAGICdestroy(m);
+}
+
+// Tests the index statistics reported by the engine
+void test_stats(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+    MAGICStats stats;
+
+    MAGICstats(m, &stats);
+    assert(stats.edits == 0 && stats.nodes == 0 && stats.depth == 0);
+    size_t empty = stats.bytes;
+
+    // A removal is indexed twice (shift and deletion), an addition once
+    MAGICadd(m, 10, 4);
+    MAGICremove(m, 2, 3);
+    MAGICstats(m, &stats);
+    assert(stats.edits == 2);
+    assert(stats.nodes == 3);
+    assert(stats.depth == 2);
+    assert(stats.bytes >= empty); // The pooled engine holds its first nodes inline
+
+    // Alternate lengths, so that the edits do not fold into a run node
+    for (int i = 0; i < 32; i++) {
+        MAGICadd(m, 100 + i, 1 + i % 2);
+    }
+    MAGICstats(m, &stats);
+    assert(stats.nodes == 35 && stats.bytes > empty);
+
+    MAGICdestroy(m);
+}
+
+// Tests that a rollback discards every edit made after the checkpoint
+void test_checkpoint_rollback(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+
+    MAGICadd(m, 10, 5);
+    MAGICCheckpoint cp = MAGICcheckpoint(m);
+    assert(cp != NULL);
+
+    // Speculative edits
+    MAGICadd(m, 0, 3);
+    MAGICremove(m, 20, 4);
+    assert(MAGICmap(m, STREAM_IN_OUT, 5) == 8);
+    assert(MAGICmap(m, STREAM_IN_OUT, 25) == 29);
+
+    // Back to the checkpoint, twice to check it stays usable
+    for (int i = 0; i < 2; i++) {
+        assert(MAGICrollback(m, cp) == 0);
+        assert(MAGICmap(m, STREAM_IN_OUT, 0) == 0);
+        assert(MAGICmap(m, STREAM_IN_OUT, 12) == 17);
+        assert(MAGICmap(m, STREAM_IN_OUT, 21) == 26);
+        MAGICadd(m, 0, 1);
+    }
+
+    MAGICcheckpointFree(cp);
+    MAGICdestroy(m);
+}
+
+// Tests that a clone and its original evolve independently
+void test_clone(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+    MAGICadd(m, 10, 5);
+
+    MAGIC copy = MAGICclone(m);
+    assert(copy != NULL);
+    MAGICadd(copy, 0, 2);
+    MAGICremove(m, 0, 2);
+
+    assert(MAGICmap(m, STREAM_IN_OUT, 12) == 15);
+    assert(MAGICmap(copy, STREAM_IN_OUT, 12) == 19);
+
+    // The original can be destroyed before its clone
+    MAGICdestroy(m);
+    assert(MAGICmap(copy, STREAM_IN_OUT, 3) == 5);
+    MAGICdestroy(copy);
+}
+
+// Tests mapping against past versions
+void test_history(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+    int kept = MAGICenableHistory(m) == 0; // Only some engines keep versions
+
+    MAGICadd(m, 10, 5);                    // Version 1
+    MAGICCheckpoint cp = MAGICcheckpoint(m);
+    MAGICremove(m, 0, 2);                  // Version 2
+    assert(MAGICversion(m) == 2);
+
+    // The current version is always available
+    assert(MAGICmapAt(m, 2, STREAM_IN_OUT, 12) == 15);
+    assert(MAGICmapAt(m, 3, STREAM_IN_OUT, 12) == -1);
+
+    if (kept) {
+        assert(MAGICmapAt(m, 0, STREAM_IN_OUT, 12) == 12);
+        assert(MAGICmapAt(m, 1, STREAM_IN_OUT, 12) == 17);
+        assert(MAGICmapAt(m, 1, STREAM_OUT_IN, 17) == 12);
+
+        // Rolling back replaces version 2 by the next edit
+        assert(MAGICrollback(m, cp) == 0);
+        assert(MAGICversion(m) == 1);
+        MAGICadd(m, 0, 1);
+        assert(MAGICmapAt(m, 1, STREAM_IN_OUT, 12) == 17);
+        assert(MAGICmapAt(m, 2, STREAM_IN_OUT, 12) == 18);
+    } else {
+        assert(MAGICmapAt(m, 1, STREAM_IN_OUT, 12) == -1);
+    }
+
+    MAGICcheckpointFree(cp);
+    MAGICdestroy(m);
+}
+
+// Tests that batch mapping, sequential or parallel, matches single lookups
+void test_map_many(void) {
+    enum { COUNT = 1000 };
+    static int positions[COUNT], expected[COUNT], results[COUNT];
+    MAGIC m = MAGICinitWithEngine(engine);
+
+    for (int i = 0; i < 200; i++) {
+        if (i % 4 == 3) {
+            MAGICremove(m, i * 13, 4);
+        } else {
+            MAGICadd(m, i * 11, 3);
+        }
+    }
+    for (int i = 0; i < COUNT; i++) {
+        positions[i] = i * 3 - 5;
+        expected[i] = MAGICmap(m, STREAM_IN_OUT, positions[i]);
+    }
+
+    MAGICmapMany(m, STREAM_IN_OUT, positions, results, COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        assert(results[i] == expected[i]);
+    }
+
+    for (int threads = 1; threads <= 7; threads += 3) {
+        int used = MAGICmapManyParallel(m, STREAM_IN_OUT, positions, results, COUNT, threads);
+        assert(used >= 1 && used <= threads);
+        for (int i = 0; i < COUNT; i++) {
+            assert(results[i] == expected[i]);
+        }
+    }
+
+    // In place, with more threads than positions
+    int few[3] = {0, 30, 60};
+    int fewExpected[3];
+    for (int i = 0; i < 3; i++) {
+        fewExpected[i] = MAGICmap(m, STREAM_OUT_IN, few[i]);
+    }
+    MAGICmapManyParallel(m, STREAM_OUT_IN, few, few, 3, 8);
+    for (int i = 0; i < 3; i++) {
+        assert(few[i] == fewExpected[i]);
+    }
+    MAGICdestroy(m);
+
+    // Interleaved lookups (above MAGIC_MAP_INTERLEAVE_MIN nodes): positions in random order,
+    // some negative, in place, both directions
+    m = MAGICinitWithEngine(engine);
+    unsigned x = 99;
+    for (int i = 0; i < 20000; i++) {
+        x = x * 1103515245u + 12345u;
+        int pos = (int)((x >> 8) % 200000), length = 1 + (int)((x >> 4) % 12);
+        if (x & 1) {
+            MAGICremove(m, pos, length);
+        } else {
+            MAGICadd(m, pos, length);
+        }
+    }
+    for (int direction = 0; direction < 2; direction++) {
+        for (int i = 0; i < COUNT; i++) {
+            x = x * 1103515245u + 12345u;
+            positions[i] = (int)((x >> 8) % 240000) - (i % 97 == 0 ? 300000 : 0);
+            expected[i] = MAGICmap(m, direction, positions[i]);
+        }
+        MAGICmapMany(m, direction, positions, positions, COUNT);
+        for (int i = 0; i < COUNT; i++) {
+            assert(positions[i] == expected[i]);
+        }
+    }
+
+    // Parallel, positions out of order grouped by range of values, in place
+    for (int threads = 2; threads <= 9; threads += 7) {
+        for (int i = 0; i < COUNT; i++) {
+            x = x * 1103515245u + 12345u;
+            positions[i] = (int)((x >> 8) % 240000) - (i % 97 == 0 ? 300000 : 0);
+            expected[i] = MAGICmap(m, STREAM_OUT_IN, positions[i]);
+        }
+        int used = MAGICmapManyParallel(m, STREAM_OUT_IN, positions, positions, COUNT, threads);
+        assert(used >= 1 && used <= threads);
+        for (int i = 0; i < COUNT; i++) {
+            assert(positions[i] == expected[i]);
+        }
+    }
+
+    // Interleaved, past INT_MAX after net removals: the input is out of range
+    MAGICremove(m, 250000, 1000000);
+    for (int i = 0; i < COUNT; i++) {
+        positions[i] = INT_MAX - i * 1500;
+        expected[i] = MAGICmap(m, STREAM_OUT_IN, positions[i]);
+    }
+    assert(expected[0] == -1 && expected[COUNT - 1] >= 0);
+    MAGICmapMany(m, STREAM_OUT_IN, positions, results, COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        assert(results[i] == expected[i]);
+    }
+    MAGICdestroy(m);
+}
+
+// Tests that runs agree with mapping every position one by one
+void test_map_run(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+    for (int i = 0; i < 60; i++) {
+        if (i % 4 == 3) {
+            MAGICremove(m, (i * 53) % 700, 1 + i % 9);
+        } else {
+            MAGICadd(m, (i * 31) % 700, 1 + i % 6);
+        }
+    }
+
+    for (int direction = 0; direction < 2; direction++) {
+        int pos = 0, runs = 0;
+        while (pos < 1200) {
+            int run;
+            int result = MAGICmapRun(m, direction, pos, &run);
+            assert(run >= 1);
+            for (int k = 0; k < run && pos + k < 1200; k++) {
+                assert(MAGICmap(m, direction, pos + k) == (result < 0 ? -1 : result + k));
+            }
+            pos += run < 1200 ? run : 1200;
+            runs++;
+        }
+        assert(runs < 1200); // Far fewer runs than positions
+    }
+
+    int run;
+    assert(MAGICmapRun(m, STREAM_IN_OUT, -1, &run) == -1 && run == 1);
+    MAGICdestroy(m);
+}
+
+// Inserted bytes are derived from their output position
+static void fill_inserted(void *ctx, int pos, void *dst, size_t len) {
+    (void)ctx;
+    for (size_t k = 0; k < len; k++) {
+        ((unsigned char*)dst)[k] = (unsigned char)(0x80 | (pos + k));
+    }
+}
+
+// Input and output of MAGICapplyStream
+typedef struct {
+    const unsigned char *in;
+    size_t inlen, offset;
+    unsigned char *out;
+    size_t outlen;
+} ApplyIo;
+
+static long read_input(void *ctx, void *buf, size_t len) {
+    ApplyIo *io = ctx;
+    size_t n = io->inlen - io->offset < len ? io->inlen - io->offset : len;
+    memcpy(buf, io->in + io->offset, n);
+    io->offset += n;
+    return (long)n;
+}
+
+static int write_output(void *ctx, const void *buf, size_t len) {
+    ApplyIo *io = ctx;
+    memcpy(io->out + io->outlen, buf, len);
+    io->outlen += len;
+    return 0;
+}
+
+// Tests rewriting bytes against a per-byte loop over MAGICmap
+void test_apply(void) {
+    enum { LEN = 3000 };
+    static unsigned char in[LEN], out[2 * LEN], streamed[2 * LEN];
+    for (int i = 0; i < LEN; i++) {
+        in[i] = (unsigned char)(i % 127);
+    }
+
+    // Edits from left to right in the current stream, as a proxy would record them
+    MAGIC m = MAGICinitWithEngine(engine);
+    for (int pos = 10, i = 0; pos < LEN; pos += 97, i++) {
+        if (i % 3 == 2) {
+            MAGICremove(m, pos, 1 + i % 11);
+        } else {
+            MAGICadd(m, pos, 1 + i % 13);
+        }
+    }
+
+    size_t outlen = MAGICoutputLength(m, LEN);
+    assert(MAGICapply(m, in, LEN, fill_inserted, NULL, out) == (long long)outlen);
+    for (size_t j = 0; j < outlen; j++) {
+        int i = MAGICmap(m, STREAM_OUT_IN, (int)j);
+        unsigned char expected;
+        if (i >= 0 && i < LEN) {
+            expected = in[i];
+        } else {
+            fill_inserted(NULL, (int)j, &expected, 1);
+        }
+        assert(out[j] == expected);
+    }
+
+    ApplyIo io = {in, LEN, 0, streamed, 0};
+    assert(MAGICapplyStream(m, LEN, read_input, write_output, fill_inserted, &io, 256) == (long long)outlen);
+    assert(io.outlen == outlen && memcmp(streamed, out, outlen) == 0);
+
+    // Without edits the output is the input
+    MAGIC identity = MAGICinitWithEngine(engine);
+    assert(MAGICoutputLength(identity, LEN) == LEN);
+    assert(MAGICapply(identity, in, LEN, NULL, NULL, out) == LEN && memcmp(in, out, LEN) == 0);
+    MAGICdestroy(identity);
+    MAGICdestroy(m);
+}
+
+// Tests that iovec lists describe the bytes MAGICapply writes, chunk by chunk
+void test_to_iovec(void) {
+    enum { LEN = 2000 };
+    static unsigned char in[LEN], out[2 * LEN], inserts[2 * LEN], sent[2 * LEN];
+    for (int i = 0; i < LEN; i++) {
+        in[i] = (unsigned char)(i % 127);
+    }
+
+    MAGIC m = MAGICinitWithEngine(engine);
+    for (int pos = 10, i = 0; pos < LEN; pos += 89, i++) {
+        if (i % 3 == 2) {
+            MAGICremove(m, pos, 1 + i % 7);
+        } else {
+            MAGICadd(m, pos, 1 + i % 11);
+        }
+    }
+    size_t outlen = (size_t)MAGICapply(m, in, LEN, fill_inserted, NULL, out);
+    size_t insertlen = 0;
+    for (size_t j = 0; j < outlen; j++) {
+        int i = MAGICmap(m, STREAM_OUT_IN, (int)j);
+        if (i < 0 || i >= LEN) {
+            inserts[insertlen++] = out[j];
+        }
+    }
+
+    // Chunks of 256 input bytes, at most 8 entries per call
+    MAGICIovecCursor cursor = {LEN, 0, 0, 0};
+    struct iovec iov[8];
+    size_t sentlen = 0;
+    for (size_t start = 0; start < LEN; start += 256) {
+        size_t chunk = LEN - start < 256 ? LEN - start : 256;
+        cursor.chunkStart = start;
+        int count;
+        do {
+            count = MAGICtoIovec(m, &cursor, in + start, chunk, inserts, insertlen, iov, 8);
+            assert(count >= 0);
+            for (int k = 0; k < count; k++) {
+                const unsigned char *base = iov[k].iov_base;
+                // No copies: entries point into the chunk or the insert storage
+                assert((base >= in + start && base + iov[k].iov_len <= in + start + chunk)
+                       || (base >= inserts && base + iov[k].iov_len <= inserts + insertlen));
+                memcpy(sent + sentlen, base, iov[k].iov_len);
+                sentlen += iov[k].iov_len;
+            }
+        } while (count == 8);
+    }
+    assert(cursor.output == outlen && cursor.inserted == insertlen);
+    assert(sentlen == outlen && memcmp(sent, out, outlen) == 0);
+
+    // Insert storage that is too short is an error
+    MAGICIovecCursor shortCursor = {LEN, 0, 0, 0};
+    assert(MAGICtoIovec(m, &shortCursor, in, LEN, inserts, 0, iov, 8) == -1);
+    assert(MAGICtoIovec(NULL, &shortCursor, in, LEN, inserts, insertlen, iov, 8) == -1);
+    MAGICdestroy(m);
+}
+
+// Tests rewriting a file against MAGICapply
+void test_rewrite_file(void) {
+    enum { LEN = 5000 };
+    static unsigned char in[LEN], out[2 * LEN], inserts[2 * LEN], written[2 * LEN];
+    for (int i = 0; i < LEN; i++) {
+        in[i] = (unsigned char)(i % 251);
+    }
+
+    MAGIC m = MAGICinitWithEngine(engine);
+    for (int pos = 40, i = 0; pos < LEN; pos += 301, i++) {
+        if (i % 2) {
+            MAGICremove(m, pos, 1 + i % 17);
+        } else {
+            MAGICadd(m, pos, 1 + i % 23);
+        }
+    }
+    size_t outlen = (size_t)MAGICapply(m, in, LEN, fill_inserted, NULL, out);
+    size_t insertlen = 0;
+    for (size_t j = 0; j < outlen; j++) {
+        int i = MAGICmap(m, STREAM_OUT_IN, (int)j);
+        if (i < 0 || i >= LEN) {
+            inserts[insertlen++] = out[j];
+        }
+    }
+
+    FILE *input = tmpfile(), *output = tmpfile();
+    assert(input && output);
+    assert(fwrite(in, 1, LEN, input) == LEN && fflush(input) == 0);
+    assert(MAGICrewriteFile(m, fileno(input), fileno(output), inserts, insertlen) == (long long)outlen);
+    rewind(output);
+    assert(fread(written, 1, sizeof(written), output) == outlen);
+    assert(memcmp(written, out, outlen) == 0);
+
+    // copy_file_range refuses outputs opened for appending: this takes the fallback
+    FILE *appended = tmpfile();
+    assert(appended && fcntl(fileno(appended), F_SETFL, O_APPEND) == 0);
+    assert(MAGICrewriteFile(m, fileno(input), fileno(appended), inserts, insertlen) == (long long)outlen);
+    rewind(appended);
+    assert(fread(written, 1, sizeof(written), appended) == outlen);
+    assert(memcmp(written, out, outlen) == 0);
+    fclose(appended);
+
+    assert(MAGICrewriteFile(m, fileno(input), fileno(output), inserts, insertlen - 1) == -1);
+    assert(MAGICrewriteFile(NULL, fileno(input), fileno(output), inserts, insertlen) == -1);
+    fclose(input);
+    fclose(output);
+    MAGICdestroy(m);
+
+    // A sparse input past INT_MAX with a removal: every output byte comes from the input
+    m = MAGICinitWithEngine(engine);
+    MAGICremove(m, 10, 100);
+    assert(MAGICmap(m, STREAM_OUT_IN, INT_MAX - 100) == INT_MAX);
+    assert(MAGICmap(m, STREAM_OUT_IN, INT_MAX - 99) == -1);
+    FILE *sparse = tmpfile();
+    int sink = open("/dev/null", O_WRONLY);
+    long long sparselen = (1LL << 31) + 1000;
+    assert(sparse && sink >= 0 && ftruncate(fileno(sparse), sparselen) == 0);
+    assert(MAGICrewriteFile(m, fileno(sparse), sink, NULL, 0) == sparselen - 100);
+    close(sink);
+    fclose(sparse);
+    MAGICdestroy(m);
+}
+
+// Tests that adjusted checksums match checksums of the rewritten bytes
+void test_adjust_checksum(void) {
+    enum { LEN = 4000 };
+    static unsigned char in[LEN], out[2 * LEN], inserts[2 * LEN];
+    for (int i = 0; i < LEN; i++) {
+        in[i] = (unsigned char)(i * 37 + 11);
+    }
+
+    // One odd-length insertion near the start: only the bytes before it are read
+    MAGIC m = MAGICinitWithEngine(engine);
+    MAGICadd(m, 100, 3);
+    size_t outlen = (size_t)MAGICapply(m, in, LEN, fill_inserted, NULL, out);
+    memcpy(inserts, out + 100, 3);
+    for (int kind = 0; kind < 2; kind++) {
+        uint32_t adjusted;
+        long long read = MAGICadjustChecksum(m, kind, MAGICchecksum(kind, in, LEN), in, LEN, inserts, 3, &adjusted);
+        assert(read == 103);
+        assert(adjusted == MAGICchecksum(kind, out, outlen));
+    }
+    MAGICdestroy(m);
+
+    // Many edits of both kinds
+    m = MAGICinitWithEngine(engine);
+    for (int pos = 7, i = 0; pos < LEN; pos += 173, i++) {
+        if (i % 3 == 1) {
+            MAGICremove(m, pos, 1 + i % 9);
+        } else {
+            MAGICadd(m, pos, 1 + i % 14);
+        }
+    }
+    outlen = (size_t)MAGICapply(m, in, LEN, fill_inserted, NULL, out);
+    size_t insertlen = 0;
+    for (size_t j = 0; j < outlen; j++) {
+        int i = MAGICmap(m, STREAM_OUT_IN, (int)j);
+        if (i < 0 || i >= LEN) {
+            inserts[insertlen++] = out[j];
+        }
+    }
+    for (int kind = 0; kind < 2; kind++) {
+        uint32_t adjusted;
+        assert(MAGICadjustChecksum(m, kind, MAGICchecksum(kind, in, LEN), in, LEN, inserts, insertlen, &adjusted) >= 0);
+        assert(adjusted == MAGICchecksum(kind, out, outlen));
+        assert(MAGICadjustChecksum(m, kind, 0, in, LEN, inserts, insertlen - 1, &adjusted) == -1);
+    }
+    MAGICdestroy(m);
+
+    // CRC-32 of "123456789" and combination
+    assert(MAGICchecksum(MAGIC_CHECKSUM_CRC32, "123456789", 9) == 0xcbf43926u);
+    assert(MAGICcrc32Combine(MAGICchecksum(MAGIC_CHECKSUM_CRC32, "1234", 4),
+                             MAGICchecksum(MAGIC_CHECKSUM_CRC32, "56789", 5), 5) == 0xcbf43926u);
+}
+
+// Tests TCP sequence-space translation across the 2^32 wraparound
+void test_seq(void) {
+    const uint32_t isn = 0xffffff00u;
+    MAGICSeq s = MAGICseqInit(isn, 1 << 16);
+    assert(s);
+
+    // 10 bytes inserted before the wrap, 4 removed after it
+    assert(MAGICseqAdd(s, isn + 0x80, 10) == 0);
+    assert(MAGICseqRemove(s, isn + 0x180, 4) == 0);
+    assert(MAGICseqEdits(s) == 2);
+
+    assert(MAGICseqMap(s, STREAM_IN_OUT, isn) == isn);
+    assert(MAGICseqMap(s, STREAM_IN_OUT, isn + 0x80) == isn + 0x8a);
+    assert(MAGICseqMap(s, STREAM_IN_OUT, 0x10) == 0x1a);                // 0xffffff00 + 0x110
+    assert(MAGICseqMap(s, STREAM_IN_OUT, 0x81) == 0x80 + 10);           // Removed: next survivor
+    assert(MAGICseqMap(s, STREAM_IN_OUT, 0x84) == 0x84 + 10 - 4);
+
+    assert(MAGICseqMap(s, STREAM_OUT_IN, isn + 0x85) == isn + 0x80);    // Inside the inserted bytes
+    assert(MAGICseqMap(s, STREAM_OUT_IN, 0x1a) == 0x10);
+    assert(MAGICseqMap(s, STREAM_OUT_IN, 0x8a) == 0x84);                // Acknowledges the removed bytes
+    for (uint32_t seq = isn; seq != 0x400; seq++) {
+        uint32_t out = MAGICseqMap(s, STREAM_IN_OUT, seq);
+        if (seq - isn < 0x180 || seq - isn >= 0x184) {
+            assert(MAGICseqMap(s, STREAM_OUT_IN, out) == seq);
+        }
+    }
+
+    // Overlapping edits are refused
+    assert(MAGICseqAdd(s, 0x82, 1) == -1);
+    assert(MAGICseqRemove(s, 0x7e, 4) == -1);
+
+    // Acknowledged edits fold into the offset and keep translating the same
+    MAGICseqAdvance(s, 0x200);
+    assert(MAGICseqEdits(s) == 0);
+    assert(MAGICseqMap(s, STREAM_IN_OUT, 0x300) == 0x300 + 6);
+    assert(MAGICseqMap(s, STREAM_OUT_IN, 0x306) == 0x300);
+    MAGICseqDestroy(s);
+
+    // State stays bounded by the window over a long stream wrapping several times
+    s = MAGICseqInit(0, 1 << 12);
+    uint32_t seq = 0;
+    for (long i = 0; i < 200000; i++) {
+        seq += 100000;
+        assert(MAGICseqAdd(s, seq, 1 + i % 5) == 0);
+        assert(MAGICseqEdits(s) <= 1);
+    }
+    assert(MAGICseqInit(0, 0) == NULL && MAGICseqInit(0, (1u << 30) + 1) == NULL);
+    MAGICseqDestroy(s);
+}
+
+// Tests that a bulk build maps exactly like applying the log in order
+void test_build(void) {
+    enum { COUNT = 20000 }; // Past MAGIC_MAP_INTERLEAVE_MIN nodes, where paths are prefetched
+    static MAGICEdit edits[COUNT];
+
+    for (int i = 0; i < COUNT; i++) {
+        edits[i].kind = i % 3 == 0 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD;
+        edits[i].pos = (i * 7919) % 20000;
+        edits[i].length = 1 + i % 9;
+    }
+    edits[10].length = 0;  // Ignored, as by MAGICadd
+    edits[11].pos = -4;    // Ignored addition
+
+    MAGIC expected = MAGICinit();
+    MAGICapplyEdits(expected, edits, COUNT);
+
+    MAGIC m = MAGICbuild(edits, COUNT);
+    assert(m != NULL);
+    assert(MAGICversion(m) == MAGICversion(expected));
+    for (int pos = 0; pos < 30000; pos += 7) {
+        assert(MAGICmap(m, STREAM_IN_OUT, pos) == MAGICmap(expected, STREAM_IN_OUT, pos));
+        assert(MAGICmap(m, STREAM_OUT_IN, pos) == MAGICmap(expected, STREAM_OUT_IN, pos));
+    }
+    MAGICdestroy(m);
+
+    // The block of a build is replaced by a laid out one
+    m = MAGICbuild(edits, COUNT);
+    assert(MAGICoptimize(m) == 0);
+    for (int pos = 0; pos < 30000; pos += 7) {
+        assert(MAGICmap(m, STREAM_OUT_IN, pos) == MAGICmap(expected, STREAM_OUT_IN, pos));
+    }
+    MAGICdestroy(m);
+
+    MAGIC empty = MAGICbuild(NULL, 0);
+    assert(empty != NULL && MAGICmap(empty, STREAM_IN_OUT, 5) == 5);
+    MAGICdestroy(empty);
+    MAGICdestroy(expected);
+}
+
 // Tests robustness against invalid operations
 void test_invalid_operations(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     // Mapping a negative index should return -1
     assert(MAGICmap(m, STREAM_IN_OUT, -1) == -1);
@@ -99,24 +698,698 @@ void test_invalid_operations(void) {
     // Removing from a very large (out of bounds) position should not crash
     MAGICremove(m, 1000000, 5);
 
+    // Checkpoints only apply to instances of the same engine
+    MAGIC other = MAGICinitWithEngine((engine + 1) % MAGIC_ENGINE_COUNT);
+    MAGICCheckpoint cp = MAGICcheckpoint(other);
+    assert(MAGICrollback(m, cp) == -1);
+    assert(MAGICrollback(m, NULL) == -1);
+    MAGICcheckpointFree(cp);
+    MAGICdestroy(other);
+
     MAGICdestroy(m);
 }
 
+// Tests that a mapping built from two versions equals one built from the edits
+void test_from_diff(void) {
+    enum { LEN = 4000, HUNKS = 30 };
+    static unsigned char a[LEN], b[2 * LEN];
+    MAGICEdit known[2 * HUNKS];
+    int count = 0, blen = 0, ai = 0;
+
+    // Bytes of a repeat with period 128 and inserted bytes are >= 128, so the
+    // shortest edit script is the one below: hunks 100 bytes apart, each
+    // removing and inserting fewer than 64 bytes.
+    for (int i = 0; i < LEN; i++) {
+        a[i] = (unsigned char)(i % 128);
+    }
+    for (int h = 0; h < HUNKS; h++) {
+        int start = 50 + h * 120, removed = h % 4 == 1 ? 0 : 1 + h % 13, added = h % 4 == 2 ? 0 : 1 + h % 7;
+        while (ai < start) b[blen++] = a[ai++];
+        if (removed) {
+            known[count++] = (MAGICEdit){MAGIC_EDIT_REMOVE, blen, removed};
+            ai += removed;
+        }
+        if (added) {
+            known[count++] = (MAGICEdit){MAGIC_EDIT_ADD, blen, added};
+            for (int i = 0; i < added; i++) b[blen++] = (unsigned char)(128 + i);
+        }
+    }
+    while (ai < LEN) b[blen++] = a[ai++];
+
+    MAGIC expected = MAGICinit();
+    MAGICapplyEdits(expected, known, count);
+    MAGIC m = MAGICfromDiff(a, LEN, b, blen);
+    assert(m != NULL && MAGICversion(m) == count);
+    for (int pos = 0; pos < 2 * LEN; pos++) {
+        assert(MAGICmap(m, STREAM_IN_OUT, pos) == MAGICmap(expected, STREAM_IN_OUT, pos));
+        assert(MAGICmap(m, STREAM_OUT_IN, pos) == MAGICmap(expected, STREAM_OUT_IN, pos));
+    }
+    MAGICdestroy(m);
+    MAGICdestroy(expected);
+
+    // Identical versions give the identity
+    m = MAGICfromDiff(a, LEN, a, LEN);
+    assert(m != NULL && MAGICversion(m) == 0 && MAGICmap(m, STREAM_IN_OUT, 123) == 123);
+    MAGICdestroy(m);
+
+    // Everything removed, then everything inserted
+    m = MAGICfromDiff(a, 10, NULL, 0);
+    assert(m != NULL && MAGICmap(m, STREAM_IN_OUT, 3) == -1);
+    MAGICdestroy(m);
+    m = MAGICfromDiff(NULL, 0, a, 10);
+    assert(m != NULL && MAGICmap(m, STREAM_OUT_IN, 3) == -1);
+    MAGICdestroy(m);
+    assert(MAGICfromDiff(NULL, 5, a, 10) == NULL);
+}
+
+// Probes of every stream replayed by MAGICprocessStreams, indexed by stream index
+enum { STREAMS = 40, PROBES = 64 };
+static unsigned long streamIds[STREAMS];
+static int streamProbes[STREAMS][PROBES];
+
+static void record_stream(unsigned long stream, size_t index, MAGIC m, void *ctx) {
+    (void)ctx;
+    assert(index < STREAMS);
+    streamIds[index] = stream;
+    for (int i = 0; i < PROBES; i++) {
+        streamProbes[index][i] = MAGICmap(m, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, i * 23);
+    }
+}
+
+// Tests that replaying an interleaved log gives each stream its own mapping
+void test_process_streams(void) {
+    enum { COUNT = 6000 };
+    static MAGICStreamRecord records[COUNT];
+    static MAGICEdit own[COUNT];
+
+    // Skewed sizes: stream 1000 gets about half of the records
+    for (int i = 0; i < COUNT; i++) {
+        records[i].stream = i % 2 ? 1000 : 1001 + (unsigned long)((i * 2654435761u) % (STREAMS - 1));
+        records[i].edit.kind = i % 3 == 0 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD;
+        records[i].edit.pos = (i * 7919) % 1500;
+        records[i].edit.length = 1 + i % 5;
+    }
+
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        MAGICStreamReport report;
+        assert(MAGICprocessStreams(records, COUNT, threads, record_stream, NULL, &report) == 0);
+        assert(report.records == COUNT && report.streams == STREAMS);
+
+        for (int s = 0; s < STREAMS; s++) {
+            int n = 0;
+            for (int i = 0; i < COUNT; i++) {
+                if (records[i].stream == streamIds[s]) own[n++] = records[i].edit;
+            }
+            MAGIC expected = MAGICinit();
+            MAGICapplyEdits(expected, own, n);
+            for (int i = 0; i < PROBES; i++) {
+                assert(streamProbes[s][i] == MAGICmap(expected, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, i * 23));
+            }
+            MAGICdestroy(expected);
+        }
+    }
+
+    MAGICStreamReport report;
+    assert(MAGICprocessStreams(NULL, 0, 0, NULL, NULL, &report) == 0);
+    assert(report.streams == 0 && report.records == 0);
+    assert(MAGICprocessStreams(NULL, 1, 0, NULL, NULL, NULL) == -1);
+}
+
+// Tests edits in stream order, with occasional earlier edits and rollbacks, against the persistent engine
+void test_append(void) {
+    MAGIC m = MAGICinitWithEngine(engine);
+    MAGIC reference = MAGICinitWithEngine(MAGIC_ENGINE_PERSISTENT);
+    MAGICCheckpoint cp = NULL, referenceCp = NULL;
+    int pos = 0;
+    for (int i = 0; i < 2000; i++) {
+        pos += i % 5;
+        int at = i % 97 == 0 ? pos / 2 : pos; // Mostly at the end, sometimes behind it
+        if (i % 3 == 2) {
+            MAGICremove(m, at, 1 + i % 4);
+            MAGICremove(reference, at, 1 + i % 4);
+        } else {
+            MAGICadd(m, at, 1 + i % 6);
+            MAGICadd(reference, at, 1 + i % 6);
+        }
+        if (i == 700) {
+            cp = MAGICcheckpoint(m);
+            referenceCp = MAGICcheckpoint(reference);
+        }
+        if (i == 1400) { // The rightmost node must be found again after a restore
+            assert(MAGICrollback(m, cp) == 0 && MAGICrollback(reference, referenceCp) == 0);
+        }
+    }
+    for (int j = 0; j < 8000; j += 3) {
+        assert(MAGICmap(m, j & 1, j) == MAGICmap(reference, j & 1, j));
+    }
+    MAGICcheckpointFree(cp);
+    MAGICcheckpointFree(referenceCp);
+    MAGICdestroy(reference);
+    MAGICdestroy(m);
+}
+
+// Checks rank, select and totals against the edit list, sorted by position with ties in recording order
+static void check_aggregates(MAGIC m, const MAGICEdit *edits, int count) {
+    MAGICEdit *sorted = malloc((size_t)count * sizeof(MAGICEdit));
+    assert(sorted);
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        while (j > 0 && sorted[j - 1].pos > edits[i].pos) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = edits[i];
+    }
+
+    long long added = 0, removed = 0;
+    for (int k = 0; k < count; k++) {
+        MAGICEdit edit;
+        assert(MAGICselectEdit(m, k, &edit) == 0);
+        assert(edit.kind == sorted[k].kind && edit.pos == sorted[k].pos && edit.length == sorted[k].length);
+
+        // Rank of the first edit at this position
+        if (k == 0 || sorted[k - 1].pos != sorted[k].pos) {
+            MAGICEditTotals totals;
+            assert(MAGICeditsBefore(m, sorted[k].pos, &totals) == k);
+            assert(totals.edits == k && totals.added == added && totals.removed == removed);
+        }
+        if (sorted[k].kind == MAGIC_EDIT_ADD) {
+            added += sorted[k].length;
+        } else {
+            removed += sorted[k].length;
+        }
+    }
+    assert(MAGICselectEdit(m, count, NULL) == -1 && MAGICselectEdit(m, -1, NULL) == -1);
+    assert(MAGICeditsBefore(m, 1 << 30, NULL) == count);
+    long long length = 100000 + added - removed;
+    assert(MAGICoutputLength(m, 100000) == (size_t)(length > 0 ? length : 0));
+    free(sorted);
+}
+
+// Tests subtree aggregates through insertions, rotations, appends, checkpoints and clones
+void test_aggregates(void) {
+    enum { EDITS = 1500 };
+    static MAGICEdit edits[EDITS];
+    MAGIC m = MAGICinitWithEngine(engine);
+    assert(MAGICeditsBefore(NULL, 0, NULL) == -1 && MAGICselectEdit(NULL, 0, NULL) == -1);
+    assert(MAGICeditsBefore(m, 10, NULL) == 0 && MAGICselectEdit(m, 0, NULL) == -1);
+
+    unsigned x = 7;
+    MAGICCheckpoint cp = NULL;
+    int count = 0, kept = 0;
+    for (int i = 0; i < EDITS; i++) {
+        x = x * 1103515245u + 12345u;
+        // Random positions with repeats, then a run of appends at the end
+        int pos = i < EDITS / 2 ? (int)((x >> 8) % 500) : 500 + i;
+        MAGICEdit edit = { (x >> 3) & 1 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD, pos, 1 + (int)((x >> 4) % 9) };
+        edits[count++] = edit;
+        MAGICapplyEdits(m, &edit, 1);
+        if (i == EDITS / 3) {
+            cp = MAGICcheckpoint(m);
+            kept = count;
+        }
+    }
+    check_aggregates(m, edits, count);
+
+    MAGIC copy = MAGICclone(m);
+    assert(copy);
+    check_aggregates(copy, edits, count);
+    MAGICdestroy(copy);
+
+    assert(MAGICrollback(m, cp) == 0);
+    check_aggregates(m, edits, kept);
+    MAGICcheckpointFree(cp);
+    MAGICdestroy(m);
+
+    if (engine == MAGIC_ENGINE_RBTREE) {
+        MAGIC built = MAGICbuild(edits, EDITS);
+        assert(built);
+        check_aggregates(built, edits, EDITS);
+        MAGICdestroy(built);
+    }
+}
+
+// Tests that a batch of edits, prefetched on large trees, maps exactly like edits made one by one
+void test_apply_edits(void) {
+    enum { COUNT = 20000 };
+    static MAGICEdit edits[COUNT];
+    MAGIC direct = MAGICinitWithEngine(engine);
+    MAGIC batched = MAGICinitWithEngine(engine);
+    int kept = MAGICenableHistory(direct) == 0;
+    assert((MAGICenableHistory(batched) == 0) == kept);
+
+    // The first edits grow the trees past MAGIC_MAP_INTERLEAVE_MIN nodes, the
+    // next ones are inserted with their paths prefetched; some are invalid
+    unsigned x = 42;
+    for (int i = 0; i < COUNT; i++) {
+        x = x * 1103515245u + 12345u;
+        int pos = (int)((x >> 8) % 400000), length = 1 + (int)((x >> 4) % 9);
+        if (i % 1000 == 999) {
+            length = 0;
+        }
+        edits[i] = (MAGICEdit){ x & 1 ? MAGIC_EDIT_ADD : MAGIC_EDIT_REMOVE, pos, length };
+        if (x & 1) {
+            MAGICadd(direct, pos, length);
+        } else {
+            MAGICremove(direct, pos, length);
+        }
+    }
+    MAGICapplyEdits(batched, edits, COUNT);
+
+    MAGICStats a, b;
+    MAGICstats(direct, &a);
+    MAGICstats(batched, &b);
+    assert(a.edits == b.edits && a.nodes == b.nodes && a.depth == b.depth);
+    for (int j = 0; j < 400000; j += 97) {
+        assert(MAGICmap(batched, j & 1, j) == MAGICmap(direct, j & 1, j));
+    }
+    if (kept) {
+        assert(MAGICmapAt(batched, 15000, STREAM_IN_OUT, 5000) == MAGICmapAt(direct, 15000, STREAM_IN_OUT, 5000));
+    }
+    MAGICdestroy(batched);
+    MAGICdestroy(direct);
+}
+
+// Applies the same random edit to every instance
+static void random_edit(MAGIC *instances, int count, unsigned *x, int span) {
+    *x = *x * 1103515245u + 12345u;
+    int pos = (int)((*x >> 8) % (unsigned)span), length = 1 + (int)((*x >> 4) % 9);
+    for (int i = 0; i < count; i++) {
+        if (*x & 1) {
+            MAGICadd(instances[i], pos, length);
+        } else {
+            MAGICremove(instances[i], pos, length);
+        }
+    }
+}
+
+// Checks that two instances give the same answers and runs over [0, end)
+static void assert_same_mapping(MAGIC a, MAGIC b, int end) {
+    for (int d = 0; d < 2; d++) {
+        for (int pos = 0; pos < end; pos++) {
+            int runA, runB;
+            int answer = MAGICmapRun(a, d, pos, &runA);
+            assert(answer == MAGICmapRun(b, d, pos, &runB) && runA == runB);
+            assert(answer == MAGICmap(a, d, pos));
+        }
+    }
+}
+
+// Applies the same edit to every instance, an addition for a positive delta
+static void edit_all(MAGIC *instances, int count, int pos, int delta) {
+    for (int i = 0; i < count; i++) {
+        if (delta > 0) {
+            MAGICadd(instances[i], pos, delta);
+        } else {
+            MAGICremove(instances[i], pos, -delta);
+        }
+    }
+}
+
+// Checks that two instances give the same runs over [0, end) and hold the same edits
+static void assert_same_index(MAGIC a, MAGIC b, int end) {
+    for (int d = 0; d < 2; d++) {
+        for (int pos = 0; pos < end;) {
+            int runA, runB;
+            int answer = MAGICmapRun(a, d, pos, &runA);
+            assert(answer == MAGICmapRun(b, d, pos, &runB) && runA == runB);
+            assert(answer == MAGICmap(a, d, pos) && MAGICmap(a, d, pos + runA - 1) == MAGICmap(b, d, pos + runA - 1));
+            pos += runA;
+        }
+    }
+    assert(MAGICoutputLength(a, 100000) == MAGICoutputLength(b, 100000));
+
+    int positions[64], results[64], expected[64];
+    for (int i = 0; i < 64; i++) {
+        positions[i] = (int)(((long long)i * 7919) % end);
+        expected[i] = MAGICmap(b, STREAM_OUT_IN, positions[i]);
+    }
+    MAGICmapMany(a, STREAM_OUT_IN, positions, results, 64);
+    assert(memcmp(results, expected, sizeof(results)) == 0);
+
+    MAGICStats stats;
+    MAGICstats(a, &stats);
+    for (int k = -1; k <= stats.edits; k++) {
+        MAGICEdit edit, other;
+        assert(MAGICselectEdit(a, k, &edit) == MAGICselectEdit(b, k, &other));
+        if (k < 0 || k >= stats.edits) continue;
+        assert(memcmp(&edit, &other, sizeof(edit)) == 0);
+        for (int pos = edit.pos - 1; pos <= edit.pos + 1; pos++) {
+            MAGICEditTotals totals, otherTotals;
+            assert(MAGICeditsBefore(a, pos, &totals) == MAGICeditsBefore(b, pos, &otherTotals));
+            assert(totals.added == otherTotals.added && totals.removed == otherTotals.removed);
+        }
+    }
+}
+
+// Node counts of an instance and of its twin, which has every edit in a node
+static void progression_stats(MAGIC m, MAGIC twin, MAGICStats *stats, MAGICStats *twinStats) {
+    MAGICstats(m, stats);
+    MAGICstats(twin, twinStats);
+    assert(stats->edits == twinStats->edits && stats->depth == twinStats->depth);
+    if (engine == MAGIC_ENGINE_PERSISTENT)
+        assert(stats->nodes == twinStats->nodes);
+}
+
+// Tests that edits in arithmetic progression fold into run nodes that map exactly like plain trees
+void test_progression(void) {
+    static const struct { int first, stride, delta; } cases[] = {
+        {5, 10, 3}, {5, 10, -3}, {0, 3, 5}, {2, 2, -8}, {7, 0, 4}, {7, 0, -2},
+    };
+    enum { EDITS = 300 };
+    static MAGICEdit edits[EDITS];
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        // The persistent engine keeps a node per edit: the twin to compare with
+        MAGIC all[2] = { MAGICinitWithEngine(engine), MAGICinitWithEngine(MAGIC_ENGINE_PERSISTENT) };
+        MAGIC m = all[0], twin = all[1];
+        int first = cases[c].first, stride = cases[c].stride, delta = cases[c].delta;
+        int end = first + 2 * EDITS * (stride + abs(delta)) + 50;
+        for (int i = 0; i < EDITS; i++) {
+            edits[i] = (MAGICEdit){ delta > 0 ? MAGIC_EDIT_ADD : MAGIC_EDIT_REMOVE, first + i * stride, abs(delta) };
+            edit_all(all, 2, first + i * stride, delta);
+        }
+        MAGICStats stats, twinStats;
+        progression_stats(m, twin, &stats, &twinStats);
+        assert(twinStats.nodes == (delta > 0 ? EDITS : 2 * EDITS));
+        assert(engine == MAGIC_ENGINE_PERSISTENT || stats.nodes * 4 < twinStats.nodes);
+        assert_same_index(m, twin, end);
+
+        // A build folds the same runs
+        MAGIC built = MAGICbuild(edits, EDITS);
+        MAGICStats builtStats;
+        MAGICstats(built, &builtStats);
+        assert(builtStats.nodes * 4 < twinStats.nodes);
+        assert_same_index(built, twin, end);
+        MAGICdestroy(built);
+
+        // Clones and checkpoints copy the run nodes
+        MAGIC copy = MAGICclone(m);
+        MAGICStats copyStats;
+        MAGICstats(copy, &copyStats);
+        assert(copyStats.nodes == stats.nodes);
+        assert_same_index(copy, twin, end);
+        MAGICCheckpoint cp = MAGICcheckpoint(m), twinCp = MAGICcheckpoint(twin);
+        assert(cp && twinCp);
+
+        // Edits among the runs only split the run nodes on their path, and a
+        // second progression folds next to the first one
+        int nodes = stats.nodes;
+        edit_all(all, 2, end / 3 + 1, 2);
+        edit_all(all, 2, end / 5, -4);
+        for (int i = 0; i < EDITS; i++) {
+            edit_all(all, 2, end / 2 + 7 * i, 1 + (delta < 0));
+        }
+        progression_stats(m, twin, &stats, &twinStats);
+        assert(engine == MAGIC_ENGINE_PERSISTENT || stats.nodes < nodes + 4 * stats.depth + 64);
+        assert_same_index(m, twin, 2 * end);
+
+        // A rollback brings the runs back, and the restored progression goes on
+        assert(MAGICrollback(m, cp) == 0 && MAGICrollback(twin, twinCp) == 0);
+        progression_stats(m, twin, &stats, &twinStats);
+        assert(stats.nodes == nodes);
+        for (int i = EDITS; i < EDITS + 50; i++) {
+            edit_all(all, 2, first + i * stride, delta);
+            edit_all(&copy, 1, first + i * stride, delta);
+        }
+        progression_stats(m, twin, &stats, &twinStats);
+        assert(engine == MAGIC_ENGINE_PERSISTENT || stats.nodes * 4 < twinStats.nodes);
+        assert_same_index(m, twin, end);
+        assert_same_index(copy, twin, end);
+
+        MAGICcheckpointFree(cp);
+        MAGICcheckpointFree(twinCp);
+        MAGICdestroy(copy);
+        MAGICdestroy(twin);
+        MAGICdestroy(m);
+    }
+
+    // Progressions of two instances edited in turn both fold
+    MAGIC all[4] = { MAGICinitWithEngine(engine), MAGICinitWithEngine(MAGIC_ENGINE_PERSISTENT),
+                     MAGICinitWithEngine(engine), MAGICinitWithEngine(MAGIC_ENGINE_PERSISTENT) };
+    for (int i = 0; i < EDITS; i++) {
+        edit_all(all, 2, 5 + 10 * i, 3);
+        edit_all(all + 2, 2, 3 + 7 * i, -2);
+    }
+    for (int k = 0; k < 4; k += 2) {
+        MAGICStats stats, twinStats;
+        progression_stats(all[k], all[k + 1], &stats, &twinStats);
+        assert(engine == MAGIC_ENGINE_PERSISTENT || stats.nodes * 4 < twinStats.nodes);
+        assert_same_index(all[k], all[k + 1], 10 * EDITS + 100);
+        MAGICdestroy(all[k]);
+        MAGICdestroy(all[k + 1]);
+    }
+}
+
+// Tests the periodic edits of test_final.c: removes that follow every other add fold with the adds
+void test_periodic_edits(void) {
+    MAGIC all[2] = { MAGICinitWithEngine(engine), MAGICinitWithEngine(MAGIC_ENGINE_PERSISTENT) };
+    MAGIC m = all[0], twin = all[1];
+    for (int i = 0; i < 2000000; i += 20000) {
+        edit_all(all, 2, i, 10000);
+    }
+    for (int i = 5000; i < 1000000; i += 40000) {
+        edit_all(all, 2, i, -5000);
+    }
+    MAGICStats stats, twinStats;
+    progression_stats(m, twin, &stats, &twinStats);
+    assert(twinStats.nodes == 150);
+    assert(engine == MAGIC_ENGINE_PERSISTENT || stats.nodes * 4 < twinStats.nodes);
+    assert_same_index(m, twin, 3100000);
+
+    // A remove across several edits materializes its path only
+    edit_all(all, 2, 200000, -50000);
+    progression_stats(m, twin, &stats, &twinStats);
+    assert(engine == MAGIC_ENGINE_PERSISTENT || stats.nodes * 3 < twinStats.nodes);
+    assert_same_index(m, twin, 3100000);
+
+    MAGIC copy = MAGICclone(m);
+    assert_same_index(copy, twin, 3100000);
+    if (engine == MAGIC_ENGINE_RBTREE) {
+        assert(MAGICoptimize(copy) == 0);
+        assert_same_index(copy, twin, 3100000);
+    }
+
+    // Edits next to the attached removes split the run nodes they fall in
+    edit_all(all, 2, 45001, 7);
+    edit_all(all, 2, 1500000, -1);
+    edit_all(&copy, 1, 45001, 7);
+    edit_all(&copy, 1, 1500000, -1);
+    assert_same_index(m, twin, 3100000);
+    assert_same_index(copy, twin, 3100000);
+
+    MAGICdestroy(copy);
+    MAGICdestroy(twin);
+    MAGICdestroy(m);
+
+}
+
+// Tests that moving the index into one block keeps every mapping
+void test_optimize(void) {
+    enum { SPAN = 3000, END = SPAN + 2000 };
+    MAGIC m = MAGICinitWithEngine(engine);
+    assert(MAGICoptimize(NULL) == -1);
+    if (engine != MAGIC_ENGINE_RBTREE) {
+        assert(MAGICoptimize(m) == -1);
+        MAGICdestroy(m);
+        return;
+    }
+    assert(MAGICoptimize(m) == 0); // Nothing to move
+
+    unsigned x = 7;
+    for (int i = 0; i < 600; i++) {
+        random_edit(&m, 1, &x, SPAN);
+    }
+    MAGIC twin = MAGICclone(m);
+    MAGICStats before, after;
+    MAGICstats(m, &before);
+    assert(MAGICoptimize(m) == 0);
+    MAGICstats(m, &after);
+    assert(after.nodes == before.nodes && after.depth == before.depth);
+    assert_same_mapping(m, twin, END);
+    assert(MAGICeditsBefore(m, END, NULL) == 600 && MAGICoutputLength(m, END) == MAGICoutputLength(twin, END));
+
+    // Later edits, checkpoints and a second layout work on the moved nodes
+    MAGICCheckpoint cp = MAGICcheckpoint(m);
+    MAGIC both[2] = { m, twin };
+    for (int i = 0; i < 300; i++) {
+        random_edit(both, 2, &x, SPAN);
+    }
+    assert_same_mapping(m, twin, END);
+    assert(MAGICoptimize(m) == 0);
+    assert_same_mapping(m, twin, END);
+    assert(MAGICrollback(m, cp) == 0 && MAGICoptimize(m) == 0);
+    assert(MAGICeditsBefore(m, END, NULL) == 600);
+
+    MAGICcheckpointFree(cp);
+    MAGICdestroy(twin);
+    MAGICdestroy(m);
+}
+
+// Tests latency recording, merging and export
+void test_latency(void) {
+    MAGIC m = MAGICinit();
+    MAGICLatency latency, merged;
+    assert(MAGIClatency(m, &latency) == -1);
+    MAGICStats before, after;
+    MAGICstats(m, &before);
+
+    assert(MAGICrecordLatency(m, 1) == 0);
+    MAGICstats(m, &after);
+    assert(after.bytes == before.bytes + sizeof(MAGICLatency));
+    for (int i = 0; i < 100; i++) {
+        MAGICadd(m, i * 10, 2);
+    }
+    for (int i = 0; i < 50; i++) {
+        MAGICremove(m, i * 7, 1);
+    }
+    for (int i = 0; i < 1000; i++) {
+        MAGICmap(m, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, i);
+    }
+    MAGICadd(m, -1, 5);    // Refused: not counted
+    MAGICmap(m, STREAM_IN_OUT, -1);
+
+    assert(MAGIClatency(m, &latency) == 0);
+    assert(latency.total[MAGIC_OP_ADD] == 100);
+    assert(latency.total[MAGIC_OP_REMOVE] == 50);
+    assert(latency.total[MAGIC_OP_MAP_IN_OUT] == 500 && latency.total[MAGIC_OP_MAP_OUT_IN] == 500);
+    for (int op = 0; op < MAGIC_OP_COUNT; op++) {
+        unsigned long long counted = 0;
+        for (int b = 0; b < MAGIC_LATENCY_BUCKETS; b++) {
+            counted += latency.counts[op][b];
+        }
+        assert(counted == latency.total[op]);
+        unsigned long long p50 = MAGIClatencyPercentile(&latency, op, 50);
+        unsigned long long p999 = MAGIClatencyPercentile(&latency, op, 99.9);
+        assert(p50 <= p999 && p999 <= MAGIClatencyPercentile(&latency, op, 100));
+        assert(MAGIClatencyPercentile(&latency, op, 100) == latency.max[op]);
+    }
+
+    // Parallel lookups record on each thread and add up
+    int positions[4000], results[4000];
+    for (int i = 0; i < 4000; i++) positions[i] = i;
+    MAGICmapManyParallel(m, STREAM_IN_OUT, positions, results, 4000, 4);
+    assert(MAGIClatency(m, &merged) == 0 && merged.total[MAGIC_OP_MAP_IN_OUT] == 500 + 4000);
+
+    // Merging two snapshots doubles the counts and keeps the percentiles
+    MAGIC copy = MAGICclone(m);
+    assert(MAGIClatency(copy, &merged) == -1);
+    MAGICdestroy(copy);
+    memcpy(&merged, &latency, sizeof(MAGICLatency));
+    MAGIClatencyMerge(&merged, &latency);
+    assert(merged.total[MAGIC_OP_ADD] == 200 && merged.max[MAGIC_OP_ADD] == latency.max[MAGIC_OP_ADD]);
+    assert(MAGIClatencyPercentile(&merged, MAGIC_OP_MAP_IN_OUT, 90) ==
+           MAGIClatencyPercentile(&latency, MAGIC_OP_MAP_IN_OUT, 90));
+
+    // Export ends with the HdrHistogram footer
+    FILE *out = tmpfile();
+    assert(out && MAGIClatencyExport(&latency, MAGIC_OP_ADD, out) == 0);
+    rewind(out);
+    char line[256];
+    int footer = 0;
+    while (fgets(line, sizeof(line), out)) {
+        if (strstr(line, "Total count") && strstr(line, "100]")) footer = 1;
+    }
+    assert(footer);
+    fclose(out);
+
+    // Stopping drops the histograms
+    assert(MAGICrecordLatency(m, 0) == 0);
+    assert(MAGIClatency(m, &latency) == -1);
+    assert(MAGIClatencyPercentile(&latency, MAGIC_OP_COUNT, 50) == 0);
+    MAGICdestroy(m);
+}
+
+// Tests that the USDT probes are described in the executable, as bpftrace lists them
+void test_probes(void) {
+#ifdef TEST_PROBES
+    static const char *expected[] = {"add", "remove", "map", "destroy"};
+    static const int arguments[] = {4, 4, 5, 2};
+    int found[4] = {0};
+
+    FILE *exe = fopen("/proc/self/exe", "rb");
+    assert(exe);
+    fseek(exe, 0, SEEK_END);
+    long size = ftell(exe);
+    unsigned char *image = malloc((size_t)size);
+    rewind(exe);
+    assert(image && fread(image, 1, (size_t)size, exe) == (size_t)size);
+    fclose(exe);
+
+    const Elf64_Ehdr *header = (const Elf64_Ehdr *)image;
+    const Elf64_Shdr *sections = (const Elf64_Shdr *)(image + header->e_shoff);
+    const char *names = (const char *)image + sections[header->e_shstrndx].sh_offset;
+    for (int i = 0; i < header->e_shnum; i++) {
+        if (strcmp(names + sections[i].sh_name, ".note.stapsdt") != 0) continue;
+        const unsigned char *note = image + sections[i].sh_offset;
+        const unsigned char *end = note + sections[i].sh_size;
+        while (note < end) {
+            const Elf64_Nhdr *n = (const Elf64_Nhdr *)note;
+            const char *owner = (const char *)(n + 1);
+            const char *desc = owner + ((n->n_namesz + 3) & ~3u);
+            assert(n->n_type == 3 && strcmp(owner, "stapsdt") == 0);
+            const char *provider = desc + 3 * 8; // Location, base and semaphore addresses
+            const char *name = provider + strlen(provider) + 1;
+            const char *args = name + strlen(name) + 1;
+            assert(strcmp(provider, "magic") == 0);
+            for (int p = 0; p < 4; p++) {
+                if (strcmp(name, expected[p]) != 0) continue;
+                int count = 0;
+                for (const char *c = args; *c; c++) count += *c == '@';
+                assert(count == arguments[p]);
+                found[p]++;
+            }
+            note = (const unsigned char *)desc + ((n->n_descsz + 3) & ~3u);
+        }
+    }
+    for (int p = 0; p < 4; p++) {
+        assert(found[p] > 0);
+    }
+    free(image);
+#endif
+}
+
 // Entry point: run all test cases
 int main(void) {
     printf("Running tests...\n");
-    test_mapping();
-    test_addition();
-    test_suppression();
-    test_large_operations();
-    test_invalid_operations();
+    for (engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+        printf("Engine: %s\n", MAGICengineName(engine));
+        test_mapping();
+        test_addition();
+        test_suppression();
+        test_large_operations();
+        test_small_to_large();
+        test_stats();
+        test_checkpoint_rollback();
+        test_clone();
+        test_history();
+        test_map_many();
+        test_map_run();
+        test_apply();
+        test_to_iovec();
+        test_rewrite_file();
+        test_adjust_checksum();
+        test_apply_edits();
+        test_progression();
+        test_periodic_edits();
+        test_optimize();
+        test_append();
+        test_aggregates();
+        test_invalid_operations();
+    }
+    test_build();
+    test_from_diff();
+    test_process_streams();
+    test_seq();
+    test_latency();
+    test_probes();
     printf("Tous les tests ont réussi !\n"); // French: "All tests passed!"
     return 0;
 }
 
 /*
  * Compilation:
- *   gcc -Wall -pedantic -std=c11 -O3 -o magic_test_plan magic_test_plan.c magic.c
+ *   gcc -Wall -pedantic -std=c11 -O3 -pthread -o magic_test_plan magic_test_plan.c magic.c magic_streams.c magic_checksum.c magic_seq.c
  *
  * Execution:
  *   ./magic_test_plan
@@ -1,8 +1,20 @@
+#define _GNU_SOURCE // copy_file_range
 #include "magic.h"
 #include "stdbool.h"
 #include "stdlib.h"
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 
 
@@ -12,6 +24,13 @@ typedef enum {
     BLACK  // Black color
 } Color;
 
+// Number of edits and bytes they add and remove
+typedef struct Aggregates {
+    int count;         // Number of edits
+    long long added;   // Bytes added
+    long long removed; // Bytes removed
+} Aggregates;
+
 // Structure representing a node in the Red-Black Tree
 typedef struct RedBlackTreeNode {
     int pos;        // Position or key of the node
@@ -19,13 +38,55 @@ typedef struct RedBlackTreeNode {
     int lazyShift;  // Accumulated shift applied to this node (used for range updates)
     int timestamp;  // Timestamp indicating when this node was modified
     struct RedBlackTreeNode *left, *right, *parent; // Pointers to left, right children and parent node
-    Color color;    // Node color (RED or BLACK) for balancing the tree
+    unsigned char color; // Node color (RED or BLACK) for balancing the tree
+    bool run;       // Whether the node stands for a subtree of evenly spaced edits (see Runs)
+    bool attached;  // Whether the node is a RunNode, with edits attached to its leaves
+    union {
+        int refs;   // Number of references to the node (persistent trees only)
+        int stride; // Distance between the edits of a run node (mutable trees only)
+    };
+    Aggregates sums; // Totals of the node and its left subtree
 } RBNode;
 
+/*
+    Number of nodes stored at the end of struct magic, used by the first
+    edits before nodes are allocated one by one. Chosen with the connection
+    lifecycle of test_magic_bench.c (ns / bytes per connection, best of 3
+    runs of best of 5):
+
+        edits      rbtree-heap    8 on 1st edit       4 inline          8 inline         16 inline
+            0        215 /    621    170 /    334    177 /    621    179 /    908    203 /   1488
+            1        296 /    693    242 /    916    233 /    606    240 /    887    261 /   1488
+            4        462 /   1017    374 /    902    365 /    686    354 /    887    374 /   1488
+            8        694 /   1410    570 /   1062    587 /   1084    547 /   1046    546 /   1488
+           16       1203 /   2297   1086 /   1946   1126 /   1964   1074 /   1924    951 /   1886
+           64       3970 /   7430   3927 /   7069   3885 /   7084   3887 /   7044   5003 /   7005
+         1024      66318 / 109838  69315 / 109476  66646 / 109484  66436 / 109444  89346 / 109405
+
+    4 inline nodes save the allocation of the first ones and, unlike more,
+    never take more memory than the heap engine. 8 are up to 7% faster
+    between 8 and 16 edits but cost 290 more bytes to connections without
+    edits; 16 slow down large instances.
+*/
+#ifndef MAGIC_SMALL_EDITS
+#define MAGIC_SMALL_EDITS 4
+#endif
+
+// Storage for nodes that are not allocated one by one
+typedef struct NodePool {
+    RBNode *nodes;                   // MAGIC_SMALL_EDITS nodes handed out in allocation order
+    int used;                        // Number of pool nodes already handed out
+    RBNode *block;                   // Nodes allocated in one block by a bulk build, or NULL
+    size_t blockSize;                // Number of nodes in block
+} NodePool;
+
 // Structure representing a Red-Black Tree
 typedef struct RedBlackTree {
     RBNode *NIL;   // Sentinel NIL node (used to represent null leaves)
     RBNode *root;  // Root node of the tree
+    NodePool *pool; // Optional pooled node storage (NULL for heap-only trees)
+    RBNode *max;   // Rightmost node, where appended keys go, or NULL when unknown
+    Aggregates totals; // Totals of every node
 } RBTree;
 
 
@@ -50,13 +111,111 @@ RBTree *RBTreeInit(void) {
     }
 
     tree->NIL->color = BLACK;
+    tree->NIL->run = tree->NIL->attached = false;
     tree->NIL->left = tree->NIL->right = tree->NIL->parent = NULL;
     tree->NIL->pos = tree->NIL->delta = tree->NIL->lazyShift = tree->NIL->timestamp = 0;
+    tree->NIL->sums = (Aggregates){0, 0, 0};
     tree->root = tree->NIL; // Tree starts empty.
+    tree->pool = NULL;
+    tree->max = NULL;
+    tree->totals = (Aggregates){0, 0, 0};
 
     return tree;
 }
 
+/*
+    Initializes an empty Red-Black Tree stored inside another structure.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the tree storage to initialize.
+    - nil : Storage for the sentinel NIL node (may be shared, it is never written).
+    - pool : Node storage used before the heap, or NULL.
+
+    Behavior:
+    ---------
+    - Performs no allocation, so the tree cannot fail to initialize.
+    - The tree must be released with `RBTreeFreeNodes()` on its root, not
+      with `RBTreeDestroy()`.
+*/
+void RBTreeInitInline(RBTree *tree, RBNode *nil, NodePool *pool) {
+    nil->color = BLACK;
+    nil->run = nil->attached = false;
+    nil->left = nil->right = nil->parent = NULL;
+    nil->pos = nil->delta = nil->lazyShift = nil->timestamp = 0;
+    nil->sums = (Aggregates){0, 0, 0};
+    tree->NIL = nil;
+    tree->root = nil;
+    tree->pool = pool;
+    tree->max = NULL;
+    tree->totals = (Aggregates){0, 0, 0};
+}
+
+/*
+    Tells whether a node lives in the pool of a tree (first nodes or block).
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - node : Node to check.
+
+    Return:
+    -------
+    - true if the node was taken from the pool and must not be freed.
+*/
+static bool isPoolNode(const RBTree *tree, const RBNode *node) {
+    if (!tree->pool) return false;
+    uintptr_t address = (uintptr_t)node;
+    uintptr_t first = (uintptr_t)tree->pool->nodes;
+    uintptr_t last = (uintptr_t)(tree->pool->nodes + MAGIC_SMALL_EDITS);
+    if (address >= first && address < last) return true;
+
+    first = (uintptr_t)tree->pool->block;
+    last = (uintptr_t)(tree->pool->block + tree->pool->blockSize);
+    return address >= first && address < last;
+}
+
+/*
+    Aggregates.
+
+    Like lazyShift, the sums of a node cover the node and its left subtree,
+    so an insertion updates only the nodes it turns left at and appends at
+    the end of the tree update none. Rank and select descend one path adding
+    the sums of the nodes it turns right at. The tree keeps the totals of
+    every node. A left rotation adds the sums of the node that sinks into
+    the one that rises; a right rotation takes those of the node that rises
+    out of the one that sinks.
+*/
+static Aggregates nodeAggregates(int delta) {
+    Aggregates a = { 1, delta > 0 ? delta : 0, delta < 0 ? -(long long)delta : 0 };
+    return a;
+}
+
+static void addAggregates(Aggregates *sum, const Aggregates *a) {
+    sum->count += a->count;
+    sum->added += a->added;
+    sum->removed += a->removed;
+}
+
+static void subtractAggregates(Aggregates *sum, const Aggregates *a) {
+    sum->count -= a->count;
+    sum->added -= a->added;
+    sum->removed -= a->removed;
+}
+
+// Sets up a node as `createNode()` returns it
+static void initNode(RBTree *tree, RBNode *node, int pos, int delta, int timestamp) {
+    node->pos = pos;
+    node->delta = delta;
+    node->lazyShift = delta; // Initially, lazyShift equals delta.
+    node->timestamp = timestamp;
+    node->left = node->right = node->parent = tree->NIL;
+    node->color = RED; // Nodes are inserted as red.
+    node->run = node->attached = false;
+    node->refs = 1;
+    node->sums = nodeAggregates(delta);
+}
+
 /*
     Creates a new node for the Red-Black Tree.
     
@@ -71,20 +230,348 @@ RBTree *RBTreeInit(void) {
     --------
     - A pointer to the newly created RBNode.
     - NULL if memory allocation fails.
+
+    Behavior:
+    ---------
+    - Nodes are taken from the tree's pool while it has room, then from the
+      heap.
 */
 RBNode *createNode(RBTree *tree, int pos, int delta, int timestamp) {
-    RBNode *node = (RBNode*)malloc(sizeof(RBNode));
-    if (!node) return NULL;
+    RBNode *node;
+    NodePool *pool = tree->pool;
+    if (pool && pool->used < MAGIC_SMALL_EDITS) {
+        node = &pool->nodes[pool->used++];
+    } else {
+        node = (RBNode*)malloc(sizeof(RBNode));
+        if (!node) return NULL;
+    }
+    initNode(tree, node, pos, delta, timestamp);
+    return node;
+}
 
-    node->pos = pos;
-    node->delta = delta;
-    node->lazyShift = delta; // Initially, lazyShift equals delta.
-    node->timestamp = timestamp;
-    node->left = node->right = node->parent = tree->NIL;
-    node->color = RED; // Nodes are inserted as red.
+// Frees a node unless it was taken from the pool of its tree
+static void freeNode(RBTree *tree, RBNode *node) {
+    if (!isPoolNode(tree, node))
+        free(node);
+}
+
+/*
+    Runs.
+
+    Edits recorded one after another at evenly spaced ascending positions,
+    all adding or all removing the same number of bytes, are appended at the
+    end of the tree or of one of its subtrees. The left subtrees they leave
+    behind are perfect and black below their root, and each of their nodes
+    follows from the root: positions step by the stride and timestamps by
+    one in key order, and lazyShift and sums cover identical edits.
+
+    A run node stands for such a subtree. It keeps the fields of the root of
+    the subtree, the stride, and no children. A rotation that gives a node
+    two such subtrees of the same size, continuing its edits on both sides,
+    folds them into the node (`collapseRun()`), so edits appended in order
+    take O(log n) nodes and a tree can hold any number of runs between other
+    edits.
 
+    A second progression whose edits each fall just after a leaf of the run,
+    in the same order (a remove after each add of a run, one leaf out of
+    two), lands as red right children of those leaves without any rotation.
+    The run node keeps it as attached edits (`attachToRun()`), and becomes a
+    RunNode for that.
+
+    An insertion whose path enters a run node otherwise splits it into its
+    root and two run nodes (`splitRun()`), materializing that path only.
+    Readers carry on below a run node from its fields (`runChild()`).
+
+    The trees keep exactly the shape, colors and lazyShift plain insertions
+    give them, so every answer is unchanged.
+*/
+
+// Edits attached after the first leaves of a run node, one per leaf
+typedef struct RunAttachments {
+    int half;      // Edits of the run on each side of its root
+    int count;     // Leaves, from the first, followed by an attached edit
+    int offset;    // Distance from a leaf to its attached edit, below the stride
+    int delta;     // Delta of the attached edits
+    int timestamp; // Timestamp of the first attached edit
+} RunAttachments;
+
+// A run node with attached edits, allocated one by one
+typedef struct RunNode {
+    RBNode node;
+    RunAttachments attachments;
+} RunNode;
+
+// The attached edits of a run node (none for a plain one)
+static RunAttachments runAttachments(const RBNode *run) {
+    if (run->attached)
+        return ((const RunNode*)run)->attachments;
+    return (RunAttachments){ run->sums.count - 1, 0, 0, 0, 0 };
+}
+
+// A node below a run node, as a walk reaches it
+typedef struct RunCursor {
+    int pos;         // Position of the node's edit
+    int timestamp;   // Timestamp of the node's edit
+    int half;        // Edits of the run on each side of the node, -1 below the leaves
+    int index;       // Rank of the node among the edits of the run
+    bool attachment; // Whether the node is an attached edit
+} RunCursor;
+
+// The root of the subtree a run node stands for
+static RunCursor runRoot(const RBNode *run) {
+    int half = runAttachments(run).half;
+    return (RunCursor){ run->pos, run->timestamp, half, half, false };
+}
+
+// Moves a cursor to the left or right child of its node
+static void runChild(const RBNode *run, RunCursor *cursor, bool right) {
+    if (cursor->half == 0) {
+        RunAttachments a = runAttachments(run);
+        if (right && !cursor->attachment && cursor->index / 2 < a.count) {
+            cursor->pos += a.offset;
+            cursor->timestamp = a.timestamp + cursor->index / 2;
+            cursor->attachment = true;
+        } else {
+            cursor->half = -1;
+        }
+        return;
+    }
+    int step = (cursor->half + 1) / 2;
+    cursor->pos = (int)(cursor->pos + (long long)(right ? step : -step) * run->stride);
+    cursor->timestamp += right ? step : -step;
+    cursor->index += right ? step : -step;
+    cursor->half = (cursor->half - 1) / 2;
+}
+
+// lazyShift of a node with half edits on its left, wrapping like the int sums of the trees
+static int runShift(int delta, int half) {
+    return (int)((unsigned)delta * (unsigned)(half + 1));
+}
+
+// Sums of a node with half edits on its left
+static Aggregates runSums(int delta, int half) {
+    Aggregates sums = nodeAggregates(delta);
+    sums.count = half + 1;
+    sums.added *= half + 1;
+    sums.removed *= half + 1;
+    return sums;
+}
+
+// Number of attached edits on the left of the node at a cursor, a run node's included
+static int runAttachedLeft(RunAttachments a, int index, int half) {
+    int first = (index - half) / 2; // Leaves of the subtree start on an even rank
+    int left = a.count - first;
+    if (left > (half + 1) / 2) left = (half + 1) / 2;
+    return left > 0 ? left : 0;
+}
+
+// Delta of the edit at a cursor
+static int runDelta(const RBNode *run, const RunCursor *cursor) {
+    return cursor->attachment ? runAttachments(run).delta : run->delta;
+}
+
+// lazyShift of the node at a cursor
+static int runNodeShift(const RBNode *run, const RunCursor *cursor) {
+    RunAttachments a = runAttachments(run);
+    if (cursor->attachment)
+        return a.delta;
+    int attached = runAttachedLeft(a, cursor->index, cursor->half);
+    return (int)((unsigned)runShift(run->delta, cursor->half) + (unsigned)a.delta * (unsigned)attached);
+}
+
+// Sums of the node at a cursor
+static Aggregates runNodeSums(const RBNode *run, const RunCursor *cursor) {
+    RunAttachments a = runAttachments(run);
+    if (cursor->attachment)
+        return nodeAggregates(a.delta);
+    Aggregates sums = runSums(run->delta, cursor->half);
+    int attached = runAttachedLeft(a, cursor->index, cursor->half);
+    if (attached) {
+        Aggregates more = runSums(a.delta, attached - 1);
+        addAggregates(&sums, &more);
+    }
+    return sums;
+}
+
+/*
+    Creates the node standing for the subtree below a run node at a cursor:
+    a single edit, a run node, or a run node with attached edits, and for a
+    leaf followed by an attached edit, the leaf with that edit as its red
+    right child.
+
+    Return:
+    -------
+    - The node, black, or NULL if memory runs out.
+*/
+static RBNode *runSubtree(RBTree *tree, const RBNode *run, RunCursor cursor) {
+    RunAttachments a = runAttachments(run);
+    int first = (cursor.index - cursor.half) / 2;
+    int count = a.count - first; // Attached edits of the subtree, out of half + 1 leaves
+    if (count > cursor.half + 1) count = cursor.half + 1;
+    if (count < 0) count = 0;
+
+    RBNode *node;
+    if (cursor.half > 0 && count > 0) {
+        RunNode *runNode = (RunNode*)malloc(sizeof(RunNode));
+        if (!runNode) return NULL;
+        node = &runNode->node;
+        initNode(tree, node, cursor.pos, run->delta, cursor.timestamp);
+        node->attached = true;
+        runNode->attachments = (RunAttachments){ cursor.half, count, a.offset, a.delta, a.timestamp + first };
+    } else {
+        node = createNode(tree, cursor.pos, run->delta, cursor.timestamp);
+        if (!node) return NULL;
+    }
+    node->lazyShift = runNodeShift(run, &cursor);
+    node->sums = runNodeSums(run, &cursor);
+    node->color = BLACK;
+    if (cursor.half > 0) {
+        node->run = true;
+        node->stride = run->stride;
+    } else if (count > 0) {
+        runChild(run, &cursor, true);
+        RBNode *edit = createNode(tree, cursor.pos, a.delta, cursor.timestamp);
+        if (!edit) {
+            freeNode(tree, node);
+            return NULL;
+        }
+        edit->parent = node;
+        node->right = edit;
+    }
     return node;
 }
+/*
+    Turns a run node into the root of its subtree, with two black children
+    standing for the edits on either side (see `runSubtree()`).
+
+    Return:
+    -------
+    - false if memory runs out, leaving the run node as it was.
+*/
+static bool splitRun(RBTree *tree, RBNode *run) {
+    RBNode *children[2];
+    for (int side = 0; side < 2; side++) {
+        RunCursor cursor = runRoot(run);
+        runChild(run, &cursor, side);
+        children[side] = runSubtree(tree, run, cursor);
+        if (!children[side]) {
+            if (side) {
+                if (children[0]->right != tree->NIL)
+                    freeNode(tree, children[0]->right); // Attached edit of a leaf
+                freeNode(tree, children[0]);
+            }
+            return false;
+        }
+        children[side]->parent = run;
+    }
+    run->run = run->attached = false;
+    run->refs = 1;
+    run->left = children[0];
+    run->right = children[1];
+    return true;
+}
+
+/*
+    Records an edit below a run node as one of its attached edits, when it
+    is the next one: right after the first leaf without one, at the same
+    offset as the others, with the same delta and the following timestamp.
+    Plain insertion would link it there as a red child of a black leaf, so
+    nothing else changes in the tree.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - run : The run node the insertion path entered.
+    - z : The node being inserted, freed once recorded.
+    - rightmost : Whether the path only turned right above the run node.
+
+    Return:
+    -------
+    - true if the edit was recorded, false to split the run node instead.
+*/
+static bool attachToRun(RBTree *tree, RBNode *run, RBNode *z, bool rightmost) {
+    RunAttachments a = runAttachments(run);
+    if (a.count > a.half || run->stride <= 0)
+        return false;
+    long long leaf = (long long)run->pos + (2LL * a.count - a.half) * run->stride;
+    long long offset = (long long)z->pos - leaf;
+    if (a.count == 0) {
+        if (offset < 0 || offset >= run->stride)
+            return false;
+        a.offset = (int)offset;
+        a.delta = z->delta;
+        a.timestamp = z->timestamp;
+    } else if (offset != a.offset || z->delta != a.delta || (long long)a.timestamp + a.count != z->timestamp) {
+        return false;
+    }
+
+    if (!run->attached) {
+        RunNode *runNode = (RunNode*)malloc(sizeof(RunNode));
+        if (!runNode)
+            return false;
+        runNode->node = *run;
+        runNode->node.attached = true;
+        RBNode *parent = run->parent;
+        if (parent == tree->NIL) {
+            tree->root = &runNode->node;
+        } else if (parent->left == run) {
+            parent->left = &runNode->node;
+        } else {
+            parent->right = &runNode->node;
+        }
+        freeNode(tree, run);
+        run = &runNode->node;
+    }
+    a.count++;
+    ((RunNode*)run)->attachments = a;
+    if (z->pos < run->pos) {
+        run->lazyShift += z->delta;
+        addAggregates(&run->sums, &z->sums);
+    }
+    addAggregates(&tree->totals, &z->sums);
+    if (rightmost)
+        tree->max = NULL; // The edit has no node of its own
+    freeNode(tree, z);
+    return true;
+}
+
+// Whether a node has no children and no attached edits: a single edit or a plain run node
+static bool isRunLeaf(const RBTree *tree, const RBNode *node) {
+    return node != tree->NIL && node->left == tree->NIL && node->right == tree->NIL && !node->attached;
+}
+
+/*
+    Folds the children of a node into it when they are black run nodes or
+    single edits of the same size that continue its edits on both sides,
+    with the lazyShift the subtree would have. Called on the node a rotation
+    moves down, the only one that gains a new subtree.
+*/
+static void collapseRun(RBTree *tree, RBNode *node) {
+    RBNode *left = node->left, *right = node->right;
+    if (node->attached || !isRunLeaf(tree, left) || !isRunLeaf(tree, right) || left->color != BLACK || right->color != BLACK)
+        return;
+    int half = left->sums.count - 1;
+    if (right->sums.count - 1 != half || left->delta != node->delta || right->delta != node->delta)
+        return;
+    long long stride = (long long)node->pos - left->pos - (half ? (long long)half * left->stride : 0);
+    if (stride < 0 || stride > INT_MAX || (half && (left->stride != stride || right->stride != stride)))
+        return;
+    if ((long long)right->pos - (long long)half * stride != node->pos + stride)
+        return;
+    if ((long long)left->timestamp + half + 1 != node->timestamp || (long long)right->timestamp - half - 1 != node->timestamp)
+        return;
+    int shift = runShift(node->delta, half);
+    if (left->lazyShift != shift || right->lazyShift != shift || node->lazyShift != runShift(node->delta, 2 * half + 1))
+        return;
+
+    if (tree->max == right)
+        tree->max = NULL;
+    freeNode(tree, left);
+    freeNode(tree, right);
+    node->left = node->right = tree->NIL;
+    node->run = true;
+    node->stride = (int)stride;
+}
 
 /*
     Performs a left rotation on the given node in the Red-Black Tree.
@@ -120,6 +607,7 @@ void leftRotate(RBTree *tree, RBNode *x) {
 
     // Update lazyShift propagation
     y->lazyShift += x->lazyShift; //parent
+    addAggregates(&y->sums, &x->sums);
 }
 
 /*
@@ -156,6 +644,7 @@ void rightRotate(RBTree *tree, RBNode *y) {
 
     // Update lazyShift based on subtree values
     y->lazyShift = y->delta + (y->left != tree->NIL ? y->left->lazyShift : 0); //parent
+    subtractAggregates(&y->sums, &x->sums);
 }
 
 
@@ -185,6 +674,8 @@ void rightRotate(RBTree *tree, RBNode *y) {
        - Perform a right rotation on the grandparent.
     
     The same logic applies symmetrically when z’s parent is a right child.
+    The node each rotation moves down may then fold into a run node (see
+    Runs).
 */
 void fixInsert(RBTree *tree, RBNode *z) {
     while (z->parent->color == RED) {
@@ -201,11 +692,14 @@ void fixInsert(RBTree *tree, RBNode *z) {
                     // Case 2: z is a right child -> Rotate left
                     z = z->parent;
                     leftRotate(tree, z);
+                    collapseRun(tree, z);
                 }
                 // Case 3: z is a left child -> Recolor and rotate right
+                RBNode *g = z->parent->parent;
                 z->parent->color = BLACK;
-                z->parent->parent->color = RED;
-                rightRotate(tree, z->parent->parent);
+                g->color = RED;
+                rightRotate(tree, g);
+                collapseRun(tree, g);
             }
         } else {
             // Mirror case: Parent is a right child
@@ -221,11 +715,14 @@ void fixInsert(RBTree *tree, RBNode *z) {
                     // Case 2: z is a left child -> Rotate right
                     z = z->parent;
                     rightRotate(tree, z);
+                    collapseRun(tree, z);
                 }
                 // Case 3: z is a right child -> Recolor and rotate left
+                RBNode *g = z->parent->parent;
                 z->parent->color = BLACK;
-                z->parent->parent->color = RED;
-                leftRotate(tree, z->parent->parent);
+                g->color = RED;
+                leftRotate(tree, g);
+                collapseRun(tree, g);
             }
         }
     }
@@ -233,18 +730,16 @@ void fixInsert(RBTree *tree, RBNode *z) {
 }
 
 /*
-    Inserts a new node into the Red-Black Tree while maintaining balance.
+    Inserts an initialized node into the Red-Black Tree while maintaining balance.
 
     Arguments:
     ----------
     - tree : Pointer to the Red-Black Tree.
-    - pos : Position value for the new node.
-    - delta : Shift value associated with this node.
-    - timestamp : Timestamp to track insertion order.
+    - z : Node set up as by `createNode()` (red, lazyShift equal to delta,
+          children and parent on the sentinel).
 
     Effects:
     --------
-    - Creates a new node with the given values.
     - Finds the correct position in the tree while updating lazyShift values.
     - Inserts the node and adjusts tree structure using `fixInsert()`.
 
@@ -254,24 +749,57 @@ void fixInsert(RBTree *tree, RBNode *z) {
     - Updates lazyShift values of ancestor nodes when traversing left.
     - Inserts the node as a red node, then calls `fixInsert()` to maintain
       the Red-Black Tree properties.
-*/
-void RBTreeInsert(RBTree *tree, int pos, int delta, int timestamp) {
-    RBNode *z = createNode(tree, pos, delta, timestamp);
-    if (!z) return;
+    - A key at or after every other key would only turn right, updating
+      nothing on the way, and land under the rightmost node: it is linked
+      there directly when the rightmost node is known. Edits made in
+      stream order then cost amortized O(1) instead of a walk from the
+      root, and the tree takes exactly the same shape.
+    - An edit that continues the attached edits of a run node on the path
+      is recorded there and z is freed; other run nodes on the path are
+      split as it reaches them (see Runs).
 
+    Return:
+    -------
+    - false if memory runs out splitting a run node. The tree is left as
+      it was and z is not linked.
+*/
+bool RBTreeInsertNode(RBTree *tree, RBNode *z) {
     RBNode *y = tree->NIL;
     RBNode *x = tree->root;
+    bool rightmost = true;
+
+    if (tree->max && z->pos >= tree->max->pos) {
+        y = tree->max;
+        x = tree->NIL;
+    }
 
     // Find the correct insertion point
     while (x != tree->NIL) {
+        if (x->run && attachToRun(tree, x, z, rightmost))
+            return true;
+        if (x->run && !splitRun(tree, x)) {
+            // Undo the updates of the nodes above
+            for (RBNode *a = x->parent; a != tree->NIL; a = a->parent) {
+                if (z->pos < a->pos) {
+                    a->lazyShift -= z->delta;
+                    subtractAggregates(&a->sums, &z->sums);
+                }
+            }
+            return false;
+        }
         y = x;
         if (z->pos < x->pos) {
             x->lazyShift += z->delta; // Propagate shift adjustments
+            addAggregates(&x->sums, &z->sums);
             x = x->left;
+            rightmost = false;
         } else {
             x = x->right;
         }
     }
+    if (rightmost)
+        tree->max = z;
+    addAggregates(&tree->totals, &z->sums);
 
     // Insert node in the tree
     z->parent = y;
@@ -285,8 +813,65 @@ void RBTreeInsert(RBTree *tree, int pos, int delta, int timestamp) {
 
     // Fix Red-Black Tree properties
     fixInsert(tree, z);
+    return true;
+}
+
+
+/*
+    Inserts a new node into the Red-Black Tree while maintaining balance.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - pos : Position value for the new node.
+    - delta : Shift value associated with this node.
+    - timestamp : Timestamp to track insertion order.
+
+    Effects:
+    --------
+    - Creates a new node with the given values.
+    - Inserts it with `RBTreeInsertNode()`.
+*/
+void RBTreeInsert(RBTree *tree, int pos, int delta, int timestamp) {
+    RBNode *z = createNode(tree, pos, delta, timestamp);
+    if (!z) return;
+
+    if (!RBTreeInsertNode(tree, z))
+        freeNode(tree, z);
+}
+
+// Lowers *bound to limit if limit is closer
+static void tightenBound(long long *bound, long long limit) {
+    if (limit < *bound)
+        *bound = limit;
 }
 
+/*
+    Continues the search of `findDeleteNodeRun()` below a run node the walk
+    ended at, from its root.
+*/
+static bool runFindDelete(const RBNode *run, int pos, int *timestamp, long long *bound) {
+    RunCursor current = runRoot(run);
+    while (current.half >= 0) {
+        int delta = runDelta(run, &current);
+        if (pos >= current.pos && pos < current.pos - delta) {
+            tightenBound(bound, (long long)current.pos - delta);
+            *timestamp = current.timestamp;
+            return true;
+        }
+        if (pos < current.pos) {
+            tightenBound(bound, current.pos);
+            runChild(run, &current, false);
+        } else if (pos > current.pos) {
+            runChild(run, &current, true);
+        } else {
+            tightenBound(bound, (long long)pos + 1);
+            *timestamp = current.timestamp;
+            return true;
+        }
+    }
+    return false;
+}
 
 /*
     Finds a node in the Red-Black Tree that represents a deletion range 
@@ -296,40 +881,90 @@ void RBTreeInsert(RBTree *tree, int pos, int delta, int timestamp) {
     ----------
     - tree : Pointer to the Red-Black Tree.
     - pos : The position to check for deletion.
+    - timestamp : Receives the timestamp of the edit found.
 
     Return:
     -------
-    - A pointer to the node if the position falls within a deleted range.
-    - NULL if no such node exists.
+    - true if the position falls within a deleted range.
+    - false if no such node exists.
 
     Behavior:
     ---------
     - Traverses the tree to find a node where `pos` falls within the range
       `[current->pos, current->pos - current->delta)`, indicating deletion.
-    - If found, returns the node representing the deleted range.
+    - If found, reports the timestamp of the node representing the deleted
+      range; a node below a run node has none of its own.
     - Otherwise, continues searching the left or right subtree based on `pos`.
 */
-RBNode* findDeleteNode(RBTree *tree, int pos) {
+bool findDeleteNode(RBTree *tree, int pos, int *timestamp) {
     RBNode *current = tree->root;
+    RBNode *last = NULL;
 
     while (current != tree->NIL) {
         // Check if the position falls within the deleted range
         if (pos >= current->pos && pos < current->pos - current->delta) {
-            return current;
+            *timestamp = current->timestamp;
+            return true;
         }
 
         // Traverse the tree based on position
+        last = current;
         if (pos < current->pos) {
             current = current->left;
         } else if (pos > current->pos) {
             current = current->right;
         } else {
-            return current; // Exact match found
+            *timestamp = current->timestamp;
+            return true; // Exact match found
         }
     }
-    return NULL; // Position is not deleted
+    if (last && last->run) {
+        long long bound = INT_MAX;
+        return runFindDelete(last, pos, timestamp, &bound);
+    }
+    return false; // Position is not deleted
 }
 
+/*
+    Continues a descent of `RBTreeFindMappingRun()` below a run node the
+    walk ended at. The step at the run node is made again from its root;
+    *candidate then points at edit when the candidate lies below it.
+*/
+static void runFindMapping(const RBNode *run, MAGICDirection direction, int pos, int *shift, RBNode **candidate,
+                           RBNode *edit, long long *bound) {
+    int s = *shift;
+    if (*candidate == run)
+        s -= run->lazyShift;
+    RunCursor current = runRoot(run);
+
+    while (current.half >= 0) {
+        bool right;
+        if (!direction) { // STREAM_IN_OUT
+            right = pos + s >= current.pos;
+            if (!right)
+                tightenBound(bound, (long long)current.pos - s);
+        } else { // STREAM_OUT_IN
+            int adjustedPos = current.pos + s;
+            right = pos >= adjustedPos;
+            if (!right) {
+                tightenBound(bound, adjustedPos);
+                if (current.pos > pos) {
+                    tightenBound(bound, current.pos);
+                    runChild(run, &current, false);
+                    continue;
+                }
+            }
+        }
+        if (right || direction) {
+            edit->pos = current.pos;
+            edit->timestamp = current.timestamp;
+            *candidate = edit;
+            s += runNodeShift(run, &current);
+        }
+        runChild(run, &current, right);
+    }
+    *shift = s;
+}
 
 /*
     Finds the position of an element in a Red-Black Tree after applying
@@ -360,15 +995,21 @@ RBNode* findDeleteNode(RBTree *tree, int pos) {
     - If the position is found in the deletion tree and is marked as deleted 
       (with a timestamp greater than the transformation), the function returns -1.
     - The function uses `findDeleteNode` to verify if the position has been deleted.
+    - A descent that ends at a run node goes on below it with `runFindMapping()`.
 */
 int RBTreeFindMapping(RBTree *sTree,RBTree *dTree,  int pos, MAGICDirection direction) {
     int shift = 0;
     RBNode *current = sTree->root;
     RBNode *candidate = NULL;
+    RBNode *last = NULL;
+    RBNode edit; // Candidate below a run node
+    long long bound = INT_MAX;
+    int deleted;
 
     if (!direction) { // STREAM_IN_OUT: Finding the current position
         while (current != sTree->NIL) {
             int adjustedPos = pos + shift;
+            last = current;
             if (adjustedPos < current->pos) {
                 current = current->left;
             } else {
@@ -377,13 +1018,14 @@ int RBTreeFindMapping(RBTree *sTree,RBTree *dTree,  int pos, MAGICDirection dire
                 current = current->right;
             }
         }
+        if (last && last->run)
+            runFindMapping(last, direction, pos, &shift, &candidate, &edit, &bound);
         if (candidate) {
             int newPos = pos + shift;
             
             // Check if the position has been deleted
             if(shift > 0){
-                RBNode *deleteNode = findDeleteNode(dTree, newPos);
-                if (deleteNode && deleteNode->timestamp >= candidate->timestamp) {
+                if (findDeleteNode(dTree, newPos, &deleted) && deleted >= candidate->timestamp) {
                     return -1; // Position is deleted
                 }
             }
@@ -399,6 +1041,7 @@ int RBTreeFindMapping(RBTree *sTree,RBTree *dTree,  int pos, MAGICDirection dire
 
         while (current != sTree->NIL) {
             int adjustedPos = current->pos + shift;
+            last = current;
 
             if (pos < adjustedPos) {
                 if (current->pos <= pos) {
@@ -412,20 +1055,23 @@ int RBTreeFindMapping(RBTree *sTree,RBTree *dTree,  int pos, MAGICDirection dire
                 current = current->right;
             }
         }
+        if (last && last->run)
+            runFindMapping(last, direction, pos, &shift, &candidate, &edit, &bound);
 
         if (candidate && pos >= candidate->pos && pos < candidate->pos + shift) {
             return -1; // Position was added and doesn't have an original position
         }
 
         if (candidate) {
-            int originalPos = pos - shift;
+            long long originalPos = (long long)pos - shift;
+            if (originalPos > INT_MAX)
+                return -1; // Past the positions an int can hold
 
              // Check if the original position has been deleted
-            RBNode *deleteNode = findDeleteNode(dTree, originalPos);
-            if (deleteNode && deleteNode->timestamp > candidate->timestamp) {
+            if (findDeleteNode(dTree, (int)originalPos, &deleted) && deleted > candidate->timestamp) {
                 return -1; // Original position is deleted
             }
-            return (originalPos >= 0) ? originalPos : -1;
+            return (originalPos >= 0) ? (int)originalPos : -1;
         } else {
             return pos; // Position is not found
         }
@@ -433,183 +1079,3757 @@ int RBTreeFindMapping(RBTree *sTree,RBTree *dTree,  int pos, MAGICDirection dire
 }
 
 /*
-    Recursively frees all nodes in the Red-Black Tree.
+    Same search as `findDeleteNode()`, also lowering *bound to the first
+    position above pos for which the search would take another path or
+    return another node.
+*/
+static bool findDeleteNodeRun(RBTree *tree, int pos, int *timestamp, long long *bound) {
+    RBNode *current = tree->root;
+    RBNode *last = NULL;
 
-    Arguments:
-    ----------
-    - tree : Pointer to the Red-Black Tree.
-    - node : Current node being processed for freeing. This is typically
-             the root node initially passed to start the recursion.
+    while (current != tree->NIL) {
+        if (pos >= current->pos && pos < current->pos - current->delta) {
+            tightenBound(bound, (long long)current->pos - current->delta);
+            *timestamp = current->timestamp;
+            return true;
+        }
 
-    Behavior:
-    ---------
-    - The function performs a post-order traversal (left, right, node) and
-      frees each node in the tree.
-    - It ensures that no node, including the NIL sentinel node, is left allocated.
-*/
-void RBTreeFreeNodes(RBTree *tree, RBNode *node) {
-    if (node != tree->NIL) {
-        RBTreeFreeNodes(tree, node->left); // Recursively free left subtree
-        RBTreeFreeNodes(tree, node->right); // Recursively free right subtree
-        free(node); // Free the current node
+        last = current;
+        if (pos < current->pos) {
+            tightenBound(bound, current->pos);
+            current = current->left;
+        } else if (pos > current->pos) {
+            current = current->right;
+        } else {
+            tightenBound(bound, (long long)pos + 1);
+            *timestamp = current->timestamp;
+            return true;
+        }
     }
+    return last && last->run && runFindDelete(last, pos, timestamp, bound);
 }
 
 /*
-    Destroys the entire Red-Black Tree, freeing all allocated memory.
+    Maps a position like `RBTreeFindMapping()` and reports how far the answer
+    extends.
 
     Arguments:
     ----------
-    - tree : Pointer to the Red-Black Tree to be destroyed.
+    - sTree, dTree, pos, direction : As for `RBTreeFindMapping()`.
+    - run : Receives the number of positions, starting at pos and at least 1,
+            whose mapping continues the returned one: pos + k maps to
+            result + k, or to -1 if the result is -1. Runs stop at INT_MAX.
+
+    Return:
+    -------
+    - The same value as `RBTreeFindMapping()`.
 
     Behavior:
     ---------
-    - The function first frees all the nodes in the tree using the 
-      `RBTreeFreeNodes` function, then it frees the NIL sentinel node
-      and finally the tree structure itself.
-    - If the tree pointer is NULL, it does nothing.
+    - Follows the same path as `RBTreeFindMapping()`. Every comparison made on
+      the way only changes outcome at a known position above pos; the run ends
+      at the lowest of them, so every position of the run takes the same path,
+      reaches the same nodes and adds the same shift.
 */
-void RBTreeDestroy(RBTree *tree) {
-    if (!tree) return; // If the tree is NULL, do nothing
-
-    RBTreeFreeNodes(tree, tree->root); // Free all nodes in the tree
-    free(tree->NIL); // Free the sentinel NIL node
-    free(tree); // Free the tree structure itself
-}
-
-/*
-    Represents a MAGIC structure that maintains two Red-Black Trees and a timestamp.
-
-    Members:
-    --------
-    - shiftTree : Pointer to the Red-Black Tree that stores the shift operations.
-    - deleteTree : Pointer to the Red-Black Tree that stores deleted nodes.
-    - timestamp : The current timestamp associated with the MAGIC instance.
+int RBTreeFindMappingRun(RBTree *sTree, RBTree *dTree, int pos, MAGICDirection direction, int *run) {
+    long long bound = INT_MAX;
+    int shift = 0;
+    int result;
+    RBNode *current = sTree->root;
+    RBNode *candidate = NULL;
+    RBNode *last = NULL;
+    RBNode edit; // Candidate below a run node
+    int deleted;
 
-    Description:
+    if (!direction) { // STREAM_IN_OUT
+        while (current != sTree->NIL) {
+            last = current;
+            if (pos + shift < current->pos) {
+                tightenBound(&bound, (long long)current->pos - shift);
+                current = current->left;
+            } else {
+                candidate = current;
+                shift += current->lazyShift;
+                current = current->right;
+            }
+        }
+        if (last && last->run)
+            runFindMapping(last, direction, pos, &shift, &candidate, &edit, &bound);
+        result = pos;
+        if (candidate) {
+            int newPos = pos + shift;
+            bool found = false;
+            if (shift > 0) {
+                long long deleteBound = INT_MAX;
+                found = findDeleteNodeRun(dTree, newPos, &deleted, &deleteBound);
+                tightenBound(&bound, deleteBound - shift);
+            }
+            if (found && deleted >= candidate->timestamp) {
+                result = -1;
+            } else if (newPos >= candidate->pos) {
+                result = newPos;
+            } else {
+                tightenBound(&bound, (long long)candidate->pos - shift);
+                result = -1;
+            }
+        }
+    } else { // STREAM_OUT_IN
+        while (current != sTree->NIL) {
+            int adjustedPos = current->pos + shift;
+            last = current;
+            if (pos < adjustedPos) {
+                tightenBound(&bound, adjustedPos);
+                if (current->pos <= pos) {
+                    candidate = current;
+                    shift += current->lazyShift;
+                } else {
+                    tightenBound(&bound, current->pos);
+                }
+                current = current->left;
+            } else {
+                candidate = current;
+                shift += current->lazyShift;
+                current = current->right;
+            }
+        }
+        if (last && last->run)
+            runFindMapping(last, direction, pos, &shift, &candidate, &edit, &bound);
+        result = pos;
+        if (candidate) {
+            if (pos < candidate->pos) {
+                tightenBound(&bound, candidate->pos);
+            }
+            if (pos >= candidate->pos && pos < candidate->pos + shift) {
+                tightenBound(&bound, (long long)candidate->pos + shift);
+                result = -1;
+            } else if ((long long)pos - shift > INT_MAX) {
+                result = -1; // Past the positions an int can hold
+            } else {
+                int originalPos = (int)((long long)pos - shift);
+                long long deleteBound = INT_MAX;
+                bool found = findDeleteNodeRun(dTree, originalPos, &deleted, &deleteBound);
+                tightenBound(&bound, deleteBound + shift);
+                if (found && deleted > candidate->timestamp) {
+                    result = -1;
+                } else if (originalPos >= 0) {
+                    result = originalPos;
+                } else {
+                    tightenBound(&bound, shift);
+                    result = -1;
+                }
+            }
+        }
+    }
+
+    *run = bound > pos ? (int)(bound - pos) : 1;
+    return result;
+}
+
+/*
+    Number of lookups `RBTreeFindMappingMany()` keeps in flight. Each one
+    waits for its next node while the others take a step, so the group must
+    cover a cache miss to memory; beyond 16 the states no longer fit in
+    registers and L1 without gaining anything (see test_magic_bench.c).
+*/
+#ifndef MAGIC_MAP_GROUP
+#define MAGIC_MAP_GROUP 16
+#endif
+
+/*
+    Smallest shift tree whose batches are interleaved. Smaller trees mostly
+    stay in cache, where switching between lookups costs more than the
+    misses it hides: 3000 nodes map about twice as fast one at a time, both
+    break even near 20000 nodes and 100000 nodes map 3 times faster
+    interleaved.
+*/
+#ifndef MAGIC_MAP_INTERLEAVE_MIN
+#define MAGIC_MAP_INTERLEAVE_MIN 16384
+#endif
+
+// State of one lookup of a batch: descending the shift tree, then the delete tree
+typedef struct MapLookup {
+    RBNode *current;   // Next node to visit, already prefetched
+    RBNode *candidate; // Last node the shift descent took the shift of
+    int pos;           // Position being mapped
+    int shift;         // Shift accumulated so far
+    int target;        // Position searched in the delete tree
+    bool deleting;     // Whether the shift descent is over
+    size_t index;      // Index of the result
+} MapLookup;
+
+/*
+    Ends the shift descent of a lookup: either writes the result, or starts
+    the delete tree search that `RBTreeFindMapping()` would make.
+
+    Return:
+    -------
+    - true if the result is written.
+*/
+static bool mapLookupShiftDone(MapLookup *l, RBTree *dTree, MAGICDirection direction, int *results) {
+    RBNode *candidate = l->candidate;
+    if (!candidate) {
+        results[l->index] = l->pos;
+        return true;
+    }
+    if (!direction) {
+        l->target = l->pos + l->shift;
+        if (l->shift <= 0) {
+            results[l->index] = (l->target >= candidate->pos) ? l->target : -1;
+            return true;
+        }
+    } else {
+        if (l->pos >= candidate->pos && l->pos < candidate->pos + l->shift) {
+            results[l->index] = -1;
+            return true;
+        }
+        long long target = (long long)l->pos - l->shift;
+        if (target > INT_MAX) {
+            results[l->index] = -1; // Past the positions an int can hold
+            return true;
+        }
+        l->target = (int)target;
+    }
+    l->deleting = true;
+    l->current = dTree->root;
+    return false;
+}
+
+// Ends a lookup with the delete node its search found, or NULL
+static void mapLookupDeleteDone(MapLookup *l, MAGICDirection direction, RBNode *deleteNode, int *results) {
+    int result;
+    if (!direction) {
+        bool deleted = deleteNode && deleteNode->timestamp >= l->candidate->timestamp;
+        result = (!deleted && l->target >= l->candidate->pos) ? l->target : -1;
+    } else {
+        bool deleted = deleteNode && deleteNode->timestamp > l->candidate->timestamp;
+        result = (!deleted && l->target >= 0) ? l->target : -1;
+    }
+    results[l->index] = result;
+}
+
+/*
+    Visits one node of a lookup, the same step `RBTreeFindMapping()` and
+    `findDeleteNode()` take. A lookup that reaches the bottom of a run node
+    is finished by `RBTreeFindMapping()`, whose path is in cache by then.
+
+    Return:
+    -------
+    - true if the lookup is over and its result written.
+*/
+static bool mapLookupStep(MapLookup *l, RBTree *sTree, RBTree *dTree, MAGICDirection direction, int *results) {
+    RBNode *current = l->current;
+
+    if (l->deleting) {
+        if (current == dTree->NIL) {
+            mapLookupDeleteDone(l, direction, NULL, results);
+            return true;
+        }
+        int key = l->target;
+        if ((key >= current->pos && key < current->pos - current->delta) || key == current->pos) {
+            mapLookupDeleteDone(l, direction, current, results);
+            return true;
+        }
+        l->current = key < current->pos ? current->left : current->right;
+        if (l->current == dTree->NIL && current->run) {
+            results[l->index] = RBTreeFindMapping(sTree, dTree, l->pos, direction);
+            return true;
+        }
+        return false;
+    }
+
+    if (current == sTree->NIL)
+        return mapLookupShiftDone(l, dTree, direction, results);
+    if (!direction) { // STREAM_IN_OUT
+        if (l->pos + l->shift < current->pos) {
+            l->current = current->left;
+        } else {
+            l->candidate = current;
+            l->shift += current->lazyShift;
+            l->current = current->right;
+        }
+    } else { // STREAM_OUT_IN
+        if (l->pos < current->pos + l->shift) {
+            if (current->pos <= l->pos) {
+                l->candidate = current;
+                l->shift += current->lazyShift;
+            }
+            l->current = current->left;
+        } else {
+            l->candidate = current;
+            l->shift += current->lazyShift;
+            l->current = current->right;
+        }
+    }
+    if (l->current == sTree->NIL && current->run) {
+        results[l->index] = RBTreeFindMapping(sTree, dTree, l->pos, direction);
+        return true;
+    }
+    return false;
+}
+
+/*
+    Maps an array of positions like `RBTreeFindMapping()`, several lookups at
+    a time.
+
+    Arguments:
+    ----------
+    - sTree, dTree, direction : As for `RBTreeFindMapping()`.
+    - positions : The positions to map, all non-negative.
+    - results : Receives the mapped positions (may alias positions).
+    - count : Number of positions.
+
+    Behavior:
+    ---------
+    - Keeps MAGIC_MAP_GROUP lookups in flight and steps them in turn, one
+      node each. After a step, the node the lookup needs next is prefetched
+      and only read on its next turn, so the cache misses of the whole group
+      overlap instead of each descent stalling on every level. A finished
+      lookup hands its slot to the next position of the array.
+    - Positions in random order gain the most, on trees larger than the
+      cache; sorted positions hit the cache anyway and gain little. Trees
+      below MAGIC_MAP_INTERLEAVE_MIN nodes are searched one lookup at a time.
+*/
+void RBTreeFindMappingMany(RBTree *sTree, RBTree *dTree, MAGICDirection direction, const int *positions,
+                           int *results, size_t count) {
+    MapLookup group[MAGIC_MAP_GROUP];
+    size_t next = 0;
+    int active = 0;
+
+    if (sTree->totals.count < MAGIC_MAP_INTERLEAVE_MIN) {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = RBTreeFindMapping(sTree, dTree, positions[i], direction);
+        }
+        return;
+    }
+
+    while (active < MAGIC_MAP_GROUP && next < count) {
+        group[active++] = (MapLookup){ sTree->root, NULL, positions[next], 0, 0, false, next };
+        next++;
+    }
+    while (active > 0) {
+        for (int g = 0; g < active; ) {
+            MapLookup *l = &group[g];
+            if (!mapLookupStep(l, sTree, dTree, direction, results)) {
+                __builtin_prefetch(l->current);
+                g++;
+            } else if (next < count) {
+                *l = (MapLookup){ sTree->root, NULL, positions[next], 0, 0, false, next };
+                next++;
+                g++;
+            } else {
+                *l = group[--active];
+            }
+        }
+    }
+}
+
+/*
+    Recursively frees all nodes in the Red-Black Tree.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - node : Current node being processed for freeing. This is typically
+             the root node initially passed to start the recursion.
+
+    Behavior:
+    ---------
+    - The function performs a post-order traversal (left, right, node) and
+      frees each node in the tree.
+    - Nodes taken from the pool are skipped, they are released with the
+      structure that owns the pool.
+*/
+void RBTreeFreeNodes(RBTree *tree, RBNode *node) {
+    if (node != tree->NIL) {
+        RBTreeFreeNodes(tree, node->left); // Recursively free left subtree
+        RBTreeFreeNodes(tree, node->right); // Recursively free right subtree
+        if (!isPoolNode(tree, node)) {
+            free(node); // Free the current node
+        }
+    }
+}
+
+/*
+    Destroys the entire Red-Black Tree, freeing all allocated memory.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree to be destroyed.
+
+    Behavior:
+    ---------
+    - The function first frees all the nodes in the tree using the 
+      `RBTreeFreeNodes` function, then it frees the NIL sentinel node
+      and finally the tree structure itself.
+    - If the tree pointer is NULL, it does nothing.
+*/
+void RBTreeDestroy(RBTree *tree) {
+    if (!tree) return; // If the tree is NULL, do nothing
+
+    RBTreeFreeNodes(tree, tree->root); // Free all nodes in the tree
+    free(tree->NIL); // Free the sentinel NIL node
+    free(tree); // Free the tree structure itself
+}
+
+/*
+    Counts the nodes of a Red-Black Tree.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - node : Root of the subtree to count.
+
+    Return:
+    -------
+    - The number of nodes in the subtree.
+*/
+int RBTreeCount(RBTree *tree, RBNode *node) {
+    if (node == tree->NIL) return 0;
+    return 1 + RBTreeCount(tree, node->left) + RBTreeCount(tree, node->right);
+}
+
+/*
+    Computes the depth of a Red-Black Tree.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - node : Root of the subtree to measure.
+
+    Return:
+    -------
+    - The number of nodes on the longest root-to-leaf path (0 if empty),
+      counting those below run nodes.
+*/
+int RBTreeDepth(RBTree *tree, RBNode *node) {
+    if (node == tree->NIL) return 0;
+    if (node->run) {
+        RunAttachments a = runAttachments(node);
+        int depth = a.count > 0; // Attached edits hang below the leaves
+        for (int half = a.half; half >= 0; half = half ? (half - 1) / 2 : -1) {
+            depth++;
+        }
+        return depth;
+    }
+    int left = RBTreeDepth(tree, node->left);
+    int right = RBTreeDepth(tree, node->right);
+    return 1 + (left > right ? left : right);
+}
+
+/*
+    Copies a subtree of a Red-Black Tree into another tree, keeping its shape.
+
+    Arguments:
+    ----------
+    - dst : Destination tree (nodes are allocated with `createNode()`, run
+            nodes with attached edits one by one).
+    - src : Source tree.
+    - node : Root of the source subtree.
+    - parent : Parent of the copy in the destination tree.
+    - ok : Set to false if an allocation failed.
+
+    Return:
+    -------
+    - The root of the copy. Subtrees that could not be allocated are left
+      empty, so the copy is always safe to free with `RBTreeFreeNodes()`.
+*/
+RBNode *RBTreeCopy(RBTree *dst, RBTree *src, RBNode *node, RBNode *parent, bool *ok) {
+    if (node == src->NIL) return dst->NIL;
+
+    RBNode *copy;
+    if (node->attached) {
+        RunNode *runNode = (RunNode*)malloc(sizeof(RunNode));
+        copy = runNode ? &runNode->node : NULL;
+        if (runNode) {
+            initNode(dst, copy, node->pos, node->delta, node->timestamp);
+            runNode->attachments = ((const RunNode*)node)->attachments;
+            copy->attached = true;
+        }
+    } else {
+        copy = createNode(dst, node->pos, node->delta, node->timestamp);
+    }
+    if (!copy) {
+        *ok = false;
+        return dst->NIL;
+    }
+    copy->lazyShift = node->lazyShift;
+    copy->color = node->color;
+    copy->sums = node->sums;
+    if (node->run) {
+        copy->run = true;
+        copy->stride = node->stride;
+    }
+    copy->parent = parent;
+    copy->left = RBTreeCopy(dst, src, node->left, copy, ok);
+    copy->right = RBTreeCopy(dst, src, node->right, copy, ok);
+    return copy;
+}
+
+static void layoutBottoms(RBTree *tree, RBNode *node, int depth, int height, RBNode *block, size_t *next);
+
+/*
+    Copies the nodes less than height levels below a node into a block, in
+    van Emde Boas order: the top half of the levels first, then each subtree
+    hanging from it, each laid out the same way.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - node : Root of the subtree to lay out.
+    - height : Number of levels to lay out.
+    - block, next : Destination block and index of its next free slot.
+
+    Behavior:
+    ---------
+    - The parent pointer of each copied node is set to its copy, which
+      `RBTreeRelayout()` uses to link the copies. Ancestors are copied
+      before their descendants.
+*/
+static void layoutSubtree(RBTree *tree, RBNode *node, int height, RBNode *block, size_t *next) {
+    if (node == tree->NIL) return;
+    if (node->attached) {
+        node->parent = node; // A RunNode stays where it is
+        return;
+    }
+    if (height == 1) {
+        block[*next] = *node;
+        node->parent = &block[(*next)++];
+        return;
+    }
+    int top = (height + 1) / 2;
+    layoutSubtree(tree, node, top, block, next);
+    layoutBottoms(tree, node, top, height - top, block, next);
+}
+
+// Lays out, from left to right, the subtrees rooted depth levels below a node
+static void layoutBottoms(RBTree *tree, RBNode *node, int depth, int height, RBNode *block, size_t *next) {
+    if (node == tree->NIL) return;
+    if (depth == 0) {
+        layoutSubtree(tree, node, height, block, next);
+        return;
+    }
+    layoutBottoms(tree, node->left, depth - 1, height, block, next);
+    layoutBottoms(tree, node->right, depth - 1, height, block, next);
+}
+
+/*
+    Moves the nodes of a Red-Black Tree into a block, keeping its shape.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the Red-Black Tree.
+    - block : Destination, with room for every node of the tree from next.
+    - next : Index of the first free slot of block, advanced past the copies.
+
+    Return:
+    -------
+    - The former root. The former nodes are no longer part of the tree and
+      only their left and right pointers are intact, so that the caller can
+      free them with `freeRelaidNodes()`.
+
+    Behavior:
+    ---------
+    - The nodes are laid out in van Emde Boas order, so a descent reads
+      O(log n / log B) cache lines of B nodes instead of one per level.
+      Positions, deltas, lazyShift, timestamps and colors are copied as is:
+      the tree maps exactly as before.
+    - Run nodes with attached edits are larger than the slots of the block
+      and stay where they are.
+*/
+RBNode *RBTreeRelayout(RBTree *tree, RBNode *block, size_t *next) {
+    RBNode *root = tree->root;
+    size_t first = *next;
+    layoutSubtree(tree, root, RBTreeDepth(tree, root), block, next);
+
+    // Each former node now points at its copy through its parent pointer
+    for (size_t i = first; i < *next; i++) {
+        RBNode *copy = &block[i];
+        if (copy->parent != tree->NIL) copy->parent = copy->parent->parent;
+        if (copy->left != tree->NIL) copy->left = copy->left->parent;
+        if (copy->right != tree->NIL) copy->right = copy->right->parent;
+    }
+    for (size_t i = first; i < *next; i++) {
+        RBNode *copy = &block[i];
+        if (copy->left->attached) copy->left->parent = copy;
+        if (copy->right->attached) copy->right->parent = copy;
+    }
+    if (root != tree->NIL) tree->root = root->parent;
+    if (root->attached) root->parent = tree->NIL;
+    if (tree->max) tree->max = tree->max->parent;
+    return root;
+}
+
+// Frees the former nodes of a tree moved by `RBTreeRelayout()`, but the ones that stayed
+static void freeRelaidNodes(RBTree *tree, RBNode *node) {
+    if (node == tree->NIL || node->attached) return;
+    freeRelaidNodes(tree, node->left);
+    freeRelaidNodes(tree, node->right);
+    freeNode(tree, node);
+}
+
+/*
+    Persistent Red-Black Trees.
+
+    Description:
     ------------
-    The MAGIC structure is used to manage shift and delete operations within
-    a sequence of data transformations.
+    These trees share nodes between versions (checkpoints and clones). Nodes
+    have no parent pointer; `refs` counts the versions and nodes pointing at
+    them. A node with a single reference belongs to the tree being modified
+    and is updated in place, a shared node is copied first (path copying).
+    Insertion follows `RBTreeInsert()` and `fixInsert()` step by step, so a
+    persistent tree has exactly the shape of the mutable one and the mapping
+    functions (`RBTreeFindMapping()`, `findDeleteNode()`) are reused as is.
+    All persistent trees share the sentinel below, which is never written.
+*/
+static RBNode persistentNil = { 0, 0, 0, 0, NULL, NULL, NULL, BLACK, false, false, { 0 }, { 0, 0, 0 } };
+
+// Maximum depth of a Red-Black Tree holding up to INT_MAX nodes (2*log2(n+1))
+#define PTREE_MAX_DEPTH 64
+
+/*
+    Initializes an empty persistent tree.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the tree storage to initialize.
+*/
+void PTreeInit(RBTree *tree) {
+    tree->NIL = &persistentNil;
+    tree->root = &persistentNil;
+    tree->pool = NULL;
+    tree->max = NULL;
+    tree->totals = (Aggregates){0, 0, 0};
+}
+
+/*
+    Adds a reference to a subtree shared by a new version.
+
+    Arguments:
+    ----------
+    - node : Root of the shared subtree.
+*/
+static void PTreeRetain(RBNode *node) {
+    if (node != &persistentNil) node->refs++;
+}
+
+/*
+    Drops a reference to a subtree, freeing the nodes no version uses anymore.
+
+    Arguments:
+    ----------
+    - node : Root of the subtree to release.
+*/
+void PTreeRelease(RBNode *node) {
+    if (node == &persistentNil || --node->refs > 0) return;
+
+    PTreeRelease(node->left);
+    PTreeRelease(node->right);
+    free(node);
+}
+
+/*
+    Returns a node that can be modified without affecting other versions.
+
+    Arguments:
+    ----------
+    - node : A node reachable from an exclusively owned parent (or root).
+
+    Return:
+    -------
+    - The node itself if it is not shared, otherwise a private copy that
+      replaces it (the caller must link it in place of the original).
+    - NULL if memory allocation fails; nothing is modified in that case.
+*/
+static RBNode *PTreeOwn(RBNode *node) {
+    if (node->refs == 1) return node;
+
+    RBNode *copy = (RBNode*)malloc(sizeof(RBNode));
+    if (!copy) return NULL;
+
+    *copy = *node;
+    copy->refs = 1;
+    PTreeRetain(copy->left);
+    PTreeRetain(copy->right);
+    node->refs--;
+    return copy;
+}
+
+/*
+    Replaces a child link, or the root when the parent is the sentinel.
+*/
+static void PTreeReplaceChild(RBTree *tree, RBNode *parent, RBNode *oldChild, RBNode *newChild) {
+    if (parent == tree->NIL) {
+        tree->root = newChild;
+    } else if (parent->left == oldChild) {
+        parent->left = newChild;
+    } else {
+        parent->right = newChild;
+    }
+}
+
+/*
+    Left rotation without parent pointers, same lazyShift update as `leftRotate()`.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the persistent tree.
+    - parent : Parent of x (the sentinel if x is the root).
+    - x : Owned node to rotate; its right child must be owned too.
+
+    Return:
+    -------
+    - The node that took the place of x.
+*/
+static RBNode *PTreeLeftRotate(RBTree *tree, RBNode *parent, RBNode *x) {
+    RBNode *y = x->right;
+    x->right = y->left;
+    y->left = x;
+    PTreeReplaceChild(tree, parent, x, y);
+
+    y->lazyShift += x->lazyShift;
+    addAggregates(&y->sums, &x->sums);
+    return y;
+}
+
+/*
+    Right rotation without parent pointers, same lazyShift update as `rightRotate()`.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the persistent tree.
+    - parent : Parent of y (the sentinel if y is the root).
+    - y : Owned node to rotate; its left child must be owned too.
+
+    Return:
+    -------
+    - The node that took the place of y.
+*/
+static RBNode *PTreeRightRotate(RBTree *tree, RBNode *parent, RBNode *y) {
+    RBNode *x = y->left;
+    y->left = x->right;
+    x->right = y;
+    PTreeReplaceChild(tree, parent, y, x);
+
+    y->lazyShift = y->delta + (y->left != tree->NIL ? y->left->lazyShift : 0);
+    subtractAggregates(&y->sums, &x->sums);
+    return x;
+}
+
+/*
+    An insertion into a persistent tree whose allocations are done.
+
+    Members:
+    --------
+    - z : The new node.
+    - path : Nodes from the root to the parent of z, all owned.
+    - depth : Number of nodes in path.
+*/
+typedef struct PTreeInsertion {
+    RBNode *z;
+    RBNode *path[PTREE_MAX_DEPTH + 1];
+    int depth;
+} PTreeInsertion;
+
+/*
+    Makes every allocation an insertion into a persistent tree needs.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the persistent tree.
+    - pos, delta, timestamp : The node to insert.
+    - insertion : Receives the new node and the insertion path.
+
+    Return:
+    -------
+    - false if memory allocation fails. The tree then maps as before: nodes
+      already copied replace their originals with the same contents.
+
+    Behavior:
+    ---------
+    - Copies the shared nodes of the insertion path, then the red uncles
+      that `PTreeCommitInsert()` will recolor. Which uncles those are
+      follows from the colors of the path and of the uncles themselves,
+      none of which changes before it is read.
+*/
+static bool PTreePrepareInsert(RBTree *tree, int pos, int delta, int timestamp, PTreeInsertion *insertion) {
+    RBNode **path = insertion->path;
+    int depth = 0;
+
+    RBNode *z = createNode(tree, pos, delta, timestamp);
+    if (!z) return false;
+
+    // Copy the shared part of the insertion path
+    RBNode *parent = tree->NIL;
+    RBNode *x = tree->root;
+    while (x != tree->NIL && depth < PTREE_MAX_DEPTH) {
+        RBNode *owned = PTreeOwn(x);
+        if (!owned) {
+            free(z);
+            return false;
+        }
+        PTreeReplaceChild(tree, parent, x, owned);
+        path[depth++] = owned;
+        parent = owned;
+        x = (pos < owned->pos) ? owned->left : owned->right;
+    }
+
+    // Copy the uncles fixInsert() recolors, walking up as it does
+    for (int i = depth; i >= 2 && path[i - 1]->color == RED; i -= 2) {
+        RBNode *p = path[i - 1];
+        RBNode *g = path[i - 2];
+        RBNode *y = (p == g->left) ? g->right : g->left;
+        if (y->color != RED) break;
+        RBNode *owned = PTreeOwn(y);
+        if (!owned) {
+            free(z);
+            return false;
+        }
+        PTreeReplaceChild(tree, g, y, owned);
+    }
+
+    insertion->z = z;
+    insertion->depth = depth;
+    return true;
+}
+
+/*
+    Links a prepared node into a persistent tree and rebalances it.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the persistent tree, unchanged since the insertion
+             was prepared.
+    - insertion : Prepared by `PTreePrepareInsert()`.
+
+    Behavior:
+    ---------
+    - Applies the lazyShift updates of `RBTreeInsert()` and the cases of
+      `fixInsert()`, keeping the path in an array instead of parent pointers.
+      Every node it modifies is owned already, so it cannot fail.
+*/
+static void PTreeCommitInsert(RBTree *tree, PTreeInsertion *insertion) {
+    RBNode **path = insertion->path;
+    RBNode *z = insertion->z;
+    int depth = insertion->depth;
+    int pos = z->pos;
+    RBNode *parent = depth > 0 ? path[depth - 1] : tree->NIL;
+
+    // Propagate shift adjustments and link the new node
+    for (int i = 0; i < depth; i++) {
+        if (pos < path[i]->pos) {
+            path[i]->lazyShift += z->delta;
+            addAggregates(&path[i]->sums, &z->sums);
+        }
+    }
+    addAggregates(&tree->totals, &z->sums);
+    if (depth == 0) {
+        tree->root = z;
+    } else if (pos < parent->pos) {
+        parent->left = z;
+    } else {
+        parent->right = z;
+    }
+    path[depth] = z;
+
+    // Fix Red-Black Tree properties, following fixInsert()
+    int i = depth; // Index of z in the path
+    while (i > 0 && path[i - 1]->color == RED) {
+        RBNode *p = path[i - 1];
+        RBNode *g = path[i - 2]; // p is red, so it is not the root
+        RBNode *gParent = (i >= 3) ? path[i - 3] : tree->NIL;
+
+        if (p == g->left) {
+            RBNode *y = g->right; // Uncle node
+            if (y->color == RED) {
+                // Case 1: Uncle is red -> Recolor
+                p->color = BLACK;
+                y->color = BLACK;
+                g->color = RED;
+                i -= 2; // Move up the tree
+            } else {
+                if (path[i] == p->right) {
+                    // Case 2: z is a right child -> Rotate left
+                    p = PTreeLeftRotate(tree, g, p);
+                }
+                // Case 3: Recolor and rotate right
+                p->color = BLACK;
+                g->color = RED;
+                PTreeRightRotate(tree, gParent, g);
+                break;
+            }
+        } else {
+            RBNode *y = g->left; // Uncle node
+            if (y->color == RED) {
+                // Case 1: Uncle is red -> Recolor
+                p->color = BLACK;
+                y->color = BLACK;
+                g->color = RED;
+                i -= 2; // Move up the tree
+            } else {
+                if (path[i] == p->left) {
+                    // Case 2: z is a left child -> Rotate right
+                    p = PTreeRightRotate(tree, g, p);
+                }
+                // Case 3: Recolor and rotate left
+                p->color = BLACK;
+                g->color = RED;
+                PTreeLeftRotate(tree, gParent, g);
+                break;
+            }
+        }
+    }
+    tree->root->color = BLACK; // Ensure the root remains black
+}
+
+/*
+    Inserts a new node into a persistent Red-Black Tree.
+
+    Arguments:
+    ----------
+    - tree : Pointer to the persistent tree.
+    - pos : Position value for the new node.
+    - delta : Shift value associated with this node.
+    - timestamp : Timestamp to track insertion order.
+
+    Return:
+    -------
+    - false if memory allocation fails, in which case the tree maps exactly
+      as before and is still balanced.
+
+    Behavior:
+    ---------
+    - Copies O(log n) nodes when the tree is shared with another version and
+      none otherwise, all before the tree is modified.
+*/
+bool PTreeInsert(RBTree *tree, int pos, int delta, int timestamp) {
+    PTreeInsertion insertion;
+    if (!PTreePrepareInsert(tree, pos, delta, timestamp, &insertion))
+        return false;
+    PTreeCommitInsert(tree, &insertion);
+    return true;
+}
+
+/*
+    Describes an index engine behind the public MAGIC API.
+
+    Members:
+    --------
+    - name : Short name used by tests and benchmarks to select the engine.
+    - init : Sets up the engine state of a freshly allocated MAGIC. Returns
+             false on allocation failure, in which case nothing is left to free.
+    - insert : Records an edit. A negative delta is a removal of -delta bytes.
+    - map : Maps a non-negative position in the given direction.
+    - mapRun : Same as map, also giving the length of the run of positions
+               that map contiguously (see `RBTreeFindMappingRun()`).
+    - destroy : Releases the engine state (not the MAGIC itself).
+    - stats : Fills the node, depth and memory fields of a MAGICStats.
+    - snapshot : Stores the current trees into a checkpoint.
+    - restore : Replaces the trees of a MAGIC by those of a checkpoint or of
+                another instance of the same engine, saved at the given
+                version. Returns false on allocation failure, leaving the
+                instance unchanged.
+    - release : Frees the trees stored in a checkpoint.
+    - enableHistory : Starts keeping every later version (NULL if unsupported).
+    - mapAt : Maps a position against a past version (NULL if unsupported).
+    - optimize : Moves the nodes into one block laid out for lookups. Returns
+                 false on allocation failure (NULL if unsupported).
+
+    Description:
+    ------------
+    Every engine must return exactly the same mappings as the Red-Black Tree
+    engine for the same sequence of edits; test_final.c and magic_test_plan.c
+    are run against each of them.
+*/
+typedef struct MagicEngine {
+    const char *name;
+    bool (*init)(MAGIC m);
+    void (*insert)(MAGIC m, int pos, int delta, int timestamp);
+    int (*map)(MAGIC m, MAGICDirection direction, int pos);
+    int (*mapRun)(MAGIC m, MAGICDirection direction, int pos, int *run);
+    void (*mapMany)(MAGIC m, MAGICDirection direction, const int *positions, int *results, size_t count);
+    void (*destroy)(MAGIC m);
+    void (*stats)(MAGIC m, MAGICStats *stats);
+    bool (*snapshot)(MAGIC m, MAGICCheckpoint cp);
+    bool (*restore)(MAGIC m, RBTree *shiftTree, RBTree *deleteTree, int version);
+    void (*release)(MAGICCheckpoint cp);
+    bool (*enableHistory)(MAGIC m);
+    int (*mapAt)(MAGIC m, int version, MAGICDirection direction, int pos);
+    bool (*optimize)(MAGIC m);
+    int smallNodes; // Nodes stored at the end of struct magic for the first edits
+} MagicEngine;
+
+/*
+    The last edit recorded and the progression it continues: edits that
+    continue it take the timestamps following the last one (see
+    Progressions).
+
+    Members:
+    --------
+    - pos, delta, timestamp : The last edit.
+    - stride : Distance from the edit before it, once count is 2.
+    - count : Edits of the progression, counted up to 2; 0 before any edit.
+*/
+typedef struct MagicProgression {
+    int pos;
+    int delta;
+    int timestamp;
+    int stride;
+    int count;
+} MagicProgression;
+
+/*
+    Represents a saved state of a MAGIC instance.
+
+    Members:
+    --------
+    - engine : Engine of the instance the checkpoint was taken from.
+    - trees : Shift and delete trees at the time of the checkpoint.
+    - nil : Sentinel of the trees for engines that copy them.
+    - timestamp : Number of edits applied at the time of the checkpoint.
+    - progression : Last edits at the time of the checkpoint.
+*/
+struct magicCheckpoint{
+    const MagicEngine *engine;
+    RBTree trees[2];
+    RBNode nil;
+    int timestamp;
+    MagicProgression progression;
+};
+
+/*
+    Represents a MAGIC structure that maintains two Red-Black Trees and a timestamp.
+
+    Members:
+    --------
+    - shiftTree : Pointer to the Red-Black Tree that stores the shift operations.
+    - deleteTree : Pointer to the Red-Black Tree that stores deleted nodes.
+    - timestamp : The current timestamp of the instance (number of edits applied).
+    - engine : The index engine selected at initialization.
+    - engineState : Private state of engines that do not use the trees below.
+    - trees, nil, pool, small : Storage backing both trees.
+    - latency : Latency histograms, NULL unless recording.
+    - progression : The last edit and the progression it continues.
+
+    Description:
+    ------------
+    The MAGIC structure is used to manage shift and delete operations within
+    a sequence of data transformations.
+
+    Both trees, their sentinel and, for the pooled engine, the first
+    MAGIC_SMALL_EDITS nodes live in the structure itself, so a connection
+    with few edits costs a single allocation. The trees keep the exact shape
+    they would have on the heap: mapping results depend on that shape, so
+    the small case cannot switch to a flat array without changing answers.
+*/
+struct magic{
+    RBTree *shiftTree; // Tree to track position shifts (used for mapping).
+    RBTree *deleteTree; // Tree to track deleted positions.
+    int timestamp; // Current timestamp of the MAGIC instance.
+    const MagicEngine *engine; // Index engine behind the public API.
+    void *engineState; // Private state of the engine, if any.
+    RBTree trees[2]; // Storage for shiftTree and deleteTree.
+    RBNode nil; // Sentinel shared by both trees.
+    NodePool pool; // First nodes, shared by both trees.
+    MAGICLatency *latency; // Latency histograms, NULL unless recording.
+    MagicProgression progression; // Last edit and the progression it continues.
+    RBNode small[]; // First nodes of the pooled engine, empty for the others.
+};
+
+
+/*
+    A global variable used to track the system-wide timestamp across MAGIC instances.
+
+    Description:
+    ------------
+    This global timestamp is used to provide a versioning mechanism for tracking
+    changes in the MAGIC system. It is atomic because distinct instances may be
+    edited from distinct threads.
+*/
+static _Atomic long global_timestamp = 0;
+
+/*
+    Increments the global timestamp.
+
+    Arguments:
+    ----------
+    None.
+
+    Return:
+    -------
+    - The new value of the global timestamp.
+
+    Behavior:
+    ---------
+    - Increases the global timestamp by 1.
+    - This function ensures that each transformation operation is associated with
+      a unique timestamp, supporting versioning and mapping in the MAGIC system.
+*/
+long incrementTimestamp(void) {
+    return atomic_fetch_add(&global_timestamp, 1) + 1;
+}
+
+/*
+    Red-Black Tree engine: both trees and their first nodes are stored
+    inline.
+*/
+static bool rbEngineInit(MAGIC m) {
+    m->pool.nodes = m->small;
+    m->pool.used = 0;
+    m->pool.block = NULL;
+    m->pool.blockSize = 0;
+    RBTreeInitInline(&m->trees[0], &m->nil, &m->pool);
+    RBTreeInitInline(&m->trees[1], &m->nil, &m->pool);
+    m->shiftTree = &m->trees[0];
+    m->deleteTree = &m->trees[1];
+    return true;
+}
+
+static void rbEngineInsert(MAGIC m, int pos, int delta, int timestamp) {
+    if (delta < 0) {
+        RBTreeInsert(m->deleteTree, pos, delta, timestamp);
+    }
+    RBTreeInsert(m->shiftTree, pos, delta, timestamp);
+}
+
+static int rbEngineMap(MAGIC m, MAGICDirection direction, int pos) {
+    return RBTreeFindMapping(m->shiftTree, m->deleteTree, pos, direction);
+}
+
+static int rbEngineMapRun(MAGIC m, MAGICDirection direction, int pos, int *run) {
+    return RBTreeFindMappingRun(m->shiftTree, m->deleteTree, pos, direction, run);
+}
+
+static void rbEngineMapMany(MAGIC m, MAGICDirection direction, const int *positions, int *results, size_t count) {
+    RBTreeFindMappingMany(m->shiftTree, m->deleteTree, direction, positions, results, count);
+}
+
+static void rbEngineDestroy(MAGIC m) {
+    RBTreeFreeNodes(m->shiftTree, m->shiftTree->root);
+    RBTreeFreeNodes(m->deleteTree, m->deleteTree->root);
+    if (m->shiftTree->pool) {
+        free(m->pool.block);
+        m->pool.used = 0;
+        m->pool.block = NULL;
+        m->pool.blockSize = 0;
+    }
+}
+
+// Bytes of the nodes of a subtree allocated one by one
+static size_t RBTreeHeapBytes(RBTree *tree, RBNode *node) {
+    if (node == tree->NIL) return 0;
+    size_t bytes = isPoolNode(tree, node) ? 0 : node->attached ? sizeof(RunNode) : sizeof(RBNode);
+    return bytes + RBTreeHeapBytes(tree, node->left) + RBTreeHeapBytes(tree, node->right);
+}
+
+static void rbEngineStats(MAGIC m, MAGICStats *stats) {
+    int shiftNodes = RBTreeCount(m->shiftTree, m->shiftTree->root);
+    int deleteNodes = RBTreeCount(m->deleteTree, m->deleteTree->root);
+    // Runs release nodes of the pool and block, which stay allocated
+    size_t heapBytes = RBTreeHeapBytes(m->shiftTree, m->shiftTree->root)
+                     + RBTreeHeapBytes(m->deleteTree, m->deleteTree->root);
+
+    stats->nodes = shiftNodes + deleteNodes;
+    stats->depth = RBTreeDepth(m->shiftTree, m->shiftTree->root);
+    stats->bytes = sizeof(struct magic) + heapBytes + (MAGIC_SMALL_EDITS + m->pool.blockSize) * sizeof(RBNode);
+}
+
+/*
+    Checkpoints of the mutable engines are full copies of both trees, so they
+    cost O(n); use the persistent engine for O(1) checkpoints.
+*/
+static bool rbEngineSnapshot(MAGIC m, MAGICCheckpoint cp) {
+    bool ok = true;
+    RBTreeInitInline(&cp->trees[0], &cp->nil, NULL);
+    RBTreeInitInline(&cp->trees[1], &cp->nil, NULL);
+    cp->trees[0].root = RBTreeCopy(&cp->trees[0], m->shiftTree, m->shiftTree->root, cp->trees[0].NIL, &ok);
+    cp->trees[1].root = RBTreeCopy(&cp->trees[1], m->deleteTree, m->deleteTree->root, cp->trees[1].NIL, &ok);
+    cp->trees[0].totals = m->shiftTree->totals;
+    cp->trees[1].totals = m->deleteTree->totals;
+    if (!ok) {
+        RBTreeFreeNodes(&cp->trees[0], cp->trees[0].root);
+        RBTreeFreeNodes(&cp->trees[1], cp->trees[1].root);
+    }
+    return ok;
+}
+
+static bool rbEngineRestore(MAGIC m, RBTree *shiftTree, RBTree *deleteTree, int version) {
+    (void)version;
+    RBTree copies[2];
+    RBNode nil;
+    bool ok = true;
+
+    // Copy to the heap first so that a failure leaves m untouched
+    RBTreeInitInline(&copies[0], &nil, NULL);
+    RBTreeInitInline(&copies[1], &nil, NULL);
+    copies[0].root = RBTreeCopy(&copies[0], shiftTree, shiftTree->root, &nil, &ok);
+    copies[1].root = RBTreeCopy(&copies[1], deleteTree, deleteTree->root, &nil, &ok);
+    if (ok) {
+        // Then copy into m, whose pool nodes are free again
+        rbEngineDestroy(m);
+        m->pool.used = 0;
+        m->shiftTree->max = m->deleteTree->max = NULL;
+        m->shiftTree->root = RBTreeCopy(m->shiftTree, &copies[0], copies[0].root, m->shiftTree->NIL, &ok);
+        m->deleteTree->root = RBTreeCopy(m->deleteTree, &copies[1], copies[1].root, m->deleteTree->NIL, &ok);
+        m->shiftTree->totals = shiftTree->totals;
+        m->deleteTree->totals = deleteTree->totals;
+    }
+    RBTreeFreeNodes(&copies[0], copies[0].root);
+    RBTreeFreeNodes(&copies[1], copies[1].root);
+    return ok;
+}
+
+static void rbEngineRelease(MAGICCheckpoint cp) {
+    RBTreeFreeNodes(&cp->trees[0], cp->trees[0].root);
+    RBTreeFreeNodes(&cp->trees[1], cp->trees[1].root);
+}
+
+/*
+    Moves every node of both trees into one block, the shift tree first. The
+    pool nodes are free again afterwards and the former block is released.
+*/
+static bool rbEngineOptimize(MAGIC m) {
+    size_t count = (size_t)RBTreeCount(m->shiftTree, m->shiftTree->root)
+                 + (size_t)RBTreeCount(m->deleteTree, m->deleteTree->root);
+    if (count == 0) return true;
+    RBNode *block = (RBNode*)malloc(count * sizeof(RBNode));
+    if (!block) return false;
+
+    size_t next = 0;
+    RBNode *shiftRoot = RBTreeRelayout(m->shiftTree, block, &next);
+    RBNode *deleteRoot = RBTreeRelayout(m->deleteTree, block, &next);
+    // The pool still covers the former pool and block nodes, which are kept
+    freeRelaidNodes(m->shiftTree, shiftRoot);
+    freeRelaidNodes(m->deleteTree, deleteRoot);
+    free(m->pool.block);
+    m->pool.block = block;
+    m->pool.blockSize = count;
+    m->pool.used = 0;
+    return true;
+}
+
+/*
+    Heap Red-Black Tree engine: the original layout, every tree and node is
+    allocated separately. Kept as a reference point for the pooled engine.
+*/
+static bool rbHeapEngineInit(MAGIC m) {
+    m->shiftTree = RBTreeInit();
+    m->deleteTree = RBTreeInit();
+    if (!m->shiftTree || !m->deleteTree) {
+        RBTreeDestroy(m->shiftTree);
+        RBTreeDestroy(m->deleteTree);
+        return false;
+    }
+    return true;
+}
+
+static void rbHeapEngineDestroy(MAGIC m) {
+    RBTreeDestroy(m->shiftTree);
+    RBTreeDestroy(m->deleteTree);
+}
+
+static void rbHeapEngineStats(MAGIC m, MAGICStats *stats) {
+    int shiftNodes = RBTreeCount(m->shiftTree, m->shiftTree->root);
+    int deleteNodes = RBTreeCount(m->deleteTree, m->deleteTree->root);
+
+    stats->nodes = shiftNodes + deleteNodes;
+    stats->depth = RBTreeDepth(m->shiftTree, m->shiftTree->root);
+    stats->bytes = sizeof(struct magic) + 2 * (sizeof(RBTree) + sizeof(RBNode))
+                 + RBTreeHeapBytes(m->shiftTree, m->shiftTree->root)
+                 + RBTreeHeapBytes(m->deleteTree, m->deleteTree->root);
+}
+
+/*
+    Represents the versions kept by a persistent MAGIC with history enabled.
+
+    Members:
+    --------
+    - roots : Shift and delete roots of each version, interleaved. Each
+              stored root holds a reference on its tree.
+    - first : Version stored at roots[0] and roots[1].
+    - count : Number of versions stored.
+    - capacity : Number of versions the array can hold.
+
+    Description:
+    ------------
+    Versions are numbered by the number of edits applied to the instance.
+    Since every version keeps its tree alive, each edit copies its insertion
+    path (O(log n) nodes) and a past version is queried exactly like the
+    current one.
+*/
+typedef struct MagicHistory {
+    RBNode **roots;
+    int first;
+    int count;
+    int capacity;
+} MagicHistory;
+
+/*
+    Appends a version to the history.
+
+    Arguments:
+    ----------
+    - history : The history.
+    - shiftRoot, deleteRoot : Roots of the version to keep.
+
+    Return:
+    -------
+    - false if memory allocation fails (the version is then not kept).
+*/
+static bool historyPush(MagicHistory *history, RBNode *shiftRoot, RBNode *deleteRoot) {
+    if (history->count == history->capacity) {
+        int capacity = history->capacity ? 2 * history->capacity : 64;
+        RBNode **roots = (RBNode**)realloc(history->roots, 2 * (size_t)capacity * sizeof(RBNode*));
+        if (!roots) return false;
+        history->roots = roots;
+        history->capacity = capacity;
+    }
+    PTreeRetain(shiftRoot);
+    PTreeRetain(deleteRoot);
+    history->roots[2 * history->count] = shiftRoot;
+    history->roots[2 * history->count + 1] = deleteRoot;
+    history->count++;
+    return true;
+}
+
+/*
+    Drops the most recent versions of the history.
+
+    Arguments:
+    ----------
+    - history : The history.
+    - count : Number of versions to keep.
+*/
+static void historyTruncate(MagicHistory *history, int count) {
+    while (history->count > count) {
+        history->count--;
+        PTreeRelease(history->roots[2 * history->count]);
+        PTreeRelease(history->roots[2 * history->count + 1]);
+    }
+}
+
+/*
+    Persistent Red-Black Tree engine: versions share their nodes, so
+    checkpoints and clones cost O(1) and each later edit copies O(log n) nodes.
+    engineState holds the MagicHistory once history is enabled.
+*/
+static bool persistentEngineInit(MAGIC m) {
+    PTreeInit(&m->trees[0]);
+    PTreeInit(&m->trees[1]);
+    m->shiftTree = &m->trees[0];
+    m->deleteTree = &m->trees[1];
+    return true;
+}
+
+// Inserts in both trees or, when memory is exhausted, in neither
+static void persistentEngineInsert(MAGIC m, int pos, int delta, int timestamp) {
+    PTreeInsertion removal, shift;
+    if (delta < 0 && !PTreePrepareInsert(m->deleteTree, pos, delta, timestamp, &removal))
+        return;
+    if (!PTreePrepareInsert(m->shiftTree, pos, delta, timestamp, &shift)) {
+        if (delta < 0)
+            free(removal.z);
+        return;
+    }
+    if (delta < 0)
+        PTreeCommitInsert(m->deleteTree, &removal);
+    PTreeCommitInsert(m->shiftTree, &shift);
+
+    MagicHistory *history = (MagicHistory*)m->engineState;
+    if (history) {
+        historyPush(history, m->shiftTree->root, m->deleteTree->root);
+    }
+}
+
+static void persistentEngineDestroy(MAGIC m) {
+    PTreeRelease(m->shiftTree->root);
+    PTreeRelease(m->deleteTree->root);
+
+    MagicHistory *history = (MagicHistory*)m->engineState;
+    if (history) {
+        historyTruncate(history, 0);
+        free(history->roots);
+        free(history);
+    }
+}
+
+static void persistentEngineStats(MAGIC m, MAGICStats *stats) {
+    stats->nodes = RBTreeCount(m->shiftTree, m->shiftTree->root)
+                 + RBTreeCount(m->deleteTree, m->deleteTree->root);
+    stats->depth = RBTreeDepth(m->shiftTree, m->shiftTree->root);
+    stats->bytes = sizeof(struct magic) + (size_t)stats->nodes * sizeof(RBNode);
+}
+
+static bool persistentEngineSnapshot(MAGIC m, MAGICCheckpoint cp) {
+    cp->trees[0] = *m->shiftTree;
+    cp->trees[1] = *m->deleteTree;
+    PTreeRetain(cp->trees[0].root);
+    PTreeRetain(cp->trees[1].root);
+    return true;
+}
+
+static bool persistentEngineRestore(MAGIC m, RBTree *shiftTree, RBTree *deleteTree, int version) {
+    MagicHistory *history = (MagicHistory*)m->engineState;
+    if (history) {
+        // Keep the versions leading to the restored one if it is in the
+        // history, otherwise the history restarts from it
+        int index = version - history->first;
+        if (index >= 0 && index < history->count
+                && history->roots[2 * index] == shiftTree->root
+                && history->roots[2 * index + 1] == deleteTree->root) {
+            historyTruncate(history, index + 1);
+        } else {
+            historyTruncate(history, 0);
+            history->first = version;
+            historyPush(history, shiftTree->root, deleteTree->root);
+        }
+    }
+
+    PTreeRetain(shiftTree->root);
+    PTreeRetain(deleteTree->root);
+    PTreeRelease(m->shiftTree->root);
+    PTreeRelease(m->deleteTree->root);
+    m->shiftTree->root = shiftTree->root;
+    m->deleteTree->root = deleteTree->root;
+    m->shiftTree->totals = shiftTree->totals;
+    m->deleteTree->totals = deleteTree->totals;
+    return true;
+}
+
+static void persistentEngineRelease(MAGICCheckpoint cp) {
+    PTreeRelease(cp->trees[0].root);
+    PTreeRelease(cp->trees[1].root);
+}
+
+static bool persistentEngineEnableHistory(MAGIC m) {
+    if (m->engineState) return true;
+
+    MagicHistory *history = (MagicHistory*)calloc(1, sizeof(MagicHistory));
+    if (!history) return false;
+    history->first = m->timestamp;
+    if (!historyPush(history, m->shiftTree->root, m->deleteTree->root)) {
+        free(history);
+        return false;
+    }
+    m->engineState = history;
+    return true;
+}
+
+static int persistentEngineMapAt(MAGIC m, int version, MAGICDirection direction, int pos) {
+    MagicHistory *history = (MagicHistory*)m->engineState;
+    if (!history) return -1;
+
+    int index = version - history->first;
+    if (index < 0 || index >= history->count) return -1;
+
+    RBTree shiftTree, deleteTree;
+    PTreeInit(&shiftTree);
+    PTreeInit(&deleteTree);
+    shiftTree.root = history->roots[2 * index];
+    deleteTree.root = history->roots[2 * index + 1];
+    return RBTreeFindMapping(&shiftTree, &deleteTree, pos, direction);
+}
+
+// Engine table, indexed by MAGICEngineKind
+static const MagicEngine engines[MAGIC_ENGINE_COUNT] = {
+    [MAGIC_ENGINE_RBTREE] = {
+        "rbtree", rbEngineInit, rbEngineInsert, rbEngineMap, rbEngineMapRun, rbEngineMapMany,
+        rbEngineDestroy, rbEngineStats,
+        rbEngineSnapshot, rbEngineRestore, rbEngineRelease,
+        NULL, NULL, rbEngineOptimize, MAGIC_SMALL_EDITS
+    },
+    [MAGIC_ENGINE_RBTREE_HEAP] = {
+        "rbtree-heap", rbHeapEngineInit, rbEngineInsert, rbEngineMap, rbEngineMapRun, rbEngineMapMany,
+        rbHeapEngineDestroy, rbHeapEngineStats,
+        rbEngineSnapshot, rbEngineRestore, rbEngineRelease,
+        NULL, NULL, NULL, 0
+    },
+    [MAGIC_ENGINE_PERSISTENT] = {
+        "persistent", persistentEngineInit, persistentEngineInsert, rbEngineMap, rbEngineMapRun, rbEngineMapMany,
+        persistentEngineDestroy, persistentEngineStats,
+        persistentEngineSnapshot, persistentEngineRestore, persistentEngineRelease,
+        persistentEngineEnableHistory, persistentEngineMapAt, NULL, 0
+    },
+};
+
+/*
+    Initializes a MAGIC structure backed by the given index engine.
+
+    Arguments:
+    ---------
+    - kind : The engine to use.
+
+    Return:
+    -------
+    - A pointer to the initialized MAGIC structure or NULL on failure
+      (including an unknown engine kind).
+*/
+MAGIC MAGICinitWithEngine(MAGICEngineKind kind){
+    if ((int)kind < 0 || kind >= MAGIC_ENGINE_COUNT)
+        return NULL;
+
+    const MagicEngine *engine = &engines[kind];
+    MAGIC m = (MAGIC)malloc(sizeof(struct magic) + (size_t)engine->smallNodes * sizeof(RBNode));
+    if (!m)
+        return NULL;
+    m->engine = engine;
+    m->engineState = NULL;
+    m->timestamp = 0;
+    m->latency = NULL;
+    m->progression = (MagicProgression){ .count = 0 };
+    if (!m->engine->init(m)){
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+/*
+    Initializes a MAGIC structure with two Red-Black Trees (shift and delete trees) and an initial timestamp.
+
+    Arguments:
+    ---------
+    None.
+
+    Return:
+    -------
+    - A pointer to the initialized MAGIC structure or NULL on failure.
+*/
+MAGIC MAGICinit(void){
+    return MAGICinitWithEngine(MAGIC_ENGINE_RBTREE);
+}
+
+/*
+    Returns the name of an engine.
+
+    Arguments:
+    ----------
+    - kind : The engine kind.
+
+    Return:
+    -------
+    - The engine name, or NULL for an unknown kind.
+*/
+const char *MAGICengineName(MAGICEngineKind kind){
+    if ((int)kind < 0 || kind >= MAGIC_ENGINE_COUNT)
+        return NULL;
+    return engines[kind].name;
+}
+
+/*
+    Latency recording behind MAGICrecordLatency.
+
+    Durations are read with clock_gettime(CLOCK_MONOTONIC) by default. Built
+    with -DMAGIC_LATENCY_TSC on x86, the time stamp counter is read instead
+    and converted with a rate measured once against the monotonic clock,
+    which halves the cost per operation on most machines but assumes an
+    invariant TSC.
+*/
+#if defined(MAGIC_LATENCY_TSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+
+static double tscPerNs = 1.0;
+static pthread_once_t tscOnce = PTHREAD_ONCE_INIT;
+
+static uint64_t clockNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void tscCalibrate(void) {
+    struct timespec pause = {0, 10000000};
+    uint64_t ns = clockNs(), ticks = __rdtsc();
+    nanosleep(&pause, NULL);
+    ns = clockNs() - ns;
+    ticks = __rdtsc() - ticks;
+    if (ns > 0 && ticks > 0)
+        tscPerNs = (double)ticks / (double)ns;
+}
+
+static void latencyClockInit(void) {
+    pthread_once(&tscOnce, tscCalibrate);
+}
+
+static uint64_t latencyClock(void) {
+    return __rdtsc();
+}
+
+static uint64_t latencyNs(uint64_t start, uint64_t end) {
+    return (uint64_t)((double)(end - start) / tscPerNs);
+}
+#else
+static void latencyClockInit(void) {
+}
+
+static uint64_t latencyClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t latencyNs(uint64_t start, uint64_t end) {
+    return end - start;
+}
+#endif
+
+/*
+    Bucket layout: values below 64 ns have a bucket each, then every power of
+    two is split into 32 buckets, so a bucket is at most 1/32 wide relative
+    to its values, up to 2^40 ns. Longer durations land in the last bucket.
+*/
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_LINEAR (2 * LATENCY_SUB_BUCKETS)
+
+static int latencyBucket(uint64_t ns) {
+    if (ns < LATENCY_LINEAR)
+        return (int)ns;
+    int bits = 63 - __builtin_clzll(ns);
+    if (bits >= 40)
+        return MAGIC_LATENCY_BUCKETS - 1;
+    int shift = bits - 5;
+    return LATENCY_LINEAR + (bits - 6) * LATENCY_SUB_BUCKETS + (int)(ns >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+// Highest value counted in a bucket
+static uint64_t latencyBucketValue(int bucket) {
+    if (bucket < LATENCY_LINEAR)
+        return (uint64_t)bucket;
+    int bits = 6 + (bucket - LATENCY_LINEAR) / LATENCY_SUB_BUCKETS;
+    uint64_t sub = LATENCY_SUB_BUCKETS + (uint64_t)((bucket - LATENCY_LINEAR) % LATENCY_SUB_BUCKETS);
+    return ((sub + 1) << (bits - 5)) - 1;
+}
+
+static void latencyRecord(MAGICLatency *latency, MAGICOperation op, uint64_t start) {
+    uint64_t ns = latencyNs(start, latencyClock());
+    latency->counts[op][latencyBucket(ns)]++;
+    latency->total[op]++;
+    latency->sum[op] += ns;
+    if (ns > latency->max[op])
+        latency->max[op] = ns;
+}
+
+// Square root by Newton's method, which spares the library a libm dependency
+static double latencySqrt(double x) {
+    if (x <= 0)
+        return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r)
+            break;
+        r = next;
+    }
+    return r;
+}
+
+/*
+    Static tracepoints (USDT) of provider "magic", for bpftrace, perf and
+    SystemTap on live processes:
+
+        bpftrace -e 'usdt:./prog:magic:map { @depth = hist(arg4); }'
+
+    Each probe is a nop described by an ELF note in the format of
+    SystemTap's <sys/sdt.h>, written out here so that the library needs
+    no extra header to build. Arguments are passed as 8-byte signed values:
+
+        add, remove : pos, length, edits, depth
+        map         : direction, pos, result, edits, depth
+        destroy     : edits, depth
+
+    The tracer increments a probe's semaphore while attached, and the
+    arguments are computed only then: the depth walks the shift tree, O(n)
+    per event. A detached probe costs a load and a predicted branch. Build
+    with -DMAGIC_NO_PROBES to leave them out.
+*/
+#if !defined(MAGIC_NO_PROBES) && defined(__ELF__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#ifdef __x86_64__
+#define PROBE_CONSTRAINT "nor"
+#else
+#define PROBE_CONSTRAINT "r"
+#endif
+
+#define PROBE_SEMAPHORE(name) \
+    __attribute__((used, section(".probes"), visibility("hidden"))) volatile unsigned short magic_##name##_semaphore
+
+#define PROBE_ENABLED(name) __builtin_expect(magic_##name##_semaphore != 0, 0)
+
+#define PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte magic_" #name "_semaphore\n" \
+    ".asciz \"magic\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define PROBE_ARG(i) "-8@%[a" #i "]"
+#define PROBE_OPERAND(i, x) [a##i] PROBE_CONSTRAINT((long long)(x))
+
+#define PROBE2(name, x0, x1) \
+    __asm__ __volatile__(PROBE_NOTE(name, PROBE_ARG(0) " " PROBE_ARG(1)) \
+                         :: PROBE_OPERAND(0, x0), PROBE_OPERAND(1, x1))
+#define PROBE4(name, x0, x1, x2, x3) \
+    __asm__ __volatile__(PROBE_NOTE(name, PROBE_ARG(0) " " PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3)) \
+                         :: PROBE_OPERAND(0, x0), PROBE_OPERAND(1, x1), PROBE_OPERAND(2, x2), \
+                            PROBE_OPERAND(3, x3))
+#define PROBE5(name, x0, x1, x2, x3, x4) \
+    __asm__ __volatile__(PROBE_NOTE(name, PROBE_ARG(0) " " PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3) " " \
+                                          PROBE_ARG(4)) \
+                         :: PROBE_OPERAND(0, x0), PROBE_OPERAND(1, x1), PROBE_OPERAND(2, x2), \
+                            PROBE_OPERAND(3, x3), PROBE_OPERAND(4, x4))
+
+// Depth of the shift tree, reported by the probes
+static int probeDepth(MAGIC m) {
+    return RBTreeDepth(m->shiftTree, m->shiftTree->root);
+}
+
+#else
+
+#define PROBE_SEMAPHORE(name) extern int magicProbesDisabled
+#define PROBE_ENABLED(name) 0
+#define PROBE2(name, x0, x1) ((void)0)
+#define PROBE4(name, x0, x1, x2, x3) ((void)0)
+#define PROBE5(name, x0, x1, x2, x3, x4) ((void)0)
+
+#endif
+
+PROBE_SEMAPHORE(add);
+PROBE_SEMAPHORE(remove);
+PROBE_SEMAPHORE(map);
+PROBE_SEMAPHORE(destroy);
+
+/*
+    Progressions.
+
+    Edits at evenly spaced ascending positions, all inserting or all removing
+    the same number of bytes (a field rewritten in every fixed-size record, a
+    marker added every n bytes), fold into run nodes as the trees grow, as
+    long as their timestamps follow each other (see Runs). Timestamps come
+    from a counter shared by every instance, so an edit that continues the
+    progression of the last ones takes the timestamp after theirs instead:
+    still higher than the timestamps of the earlier edits and lower than
+    those of the later ones, which is all mapping compares.
+*/
+
+// Timestamp of an edit: the one after the last edit's if it continues their progression
+static int progressionTimestamp(MagicProgression *p, int pos, int delta, int timestamp) {
+    long long stride = (long long)pos - p->pos;
+    bool continues = p->count > 0 && delta == p->delta && stride >= 0 && stride <= INT_MAX
+                  && (p->count == 1 || stride == p->stride);
+    if (continues) {
+        p->stride = (int)stride;
+        p->count = 2;
+        timestamp = p->timestamp + 1;
+    } else {
+        p->count = 1;
+    }
+    p->pos = pos;
+    p->delta = delta;
+    p->timestamp = timestamp;
+    return timestamp;
+}
+
+/*
+    Removes a sequence from the MAGIC structure by updating both shift and delete trees.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - pos : The starting position of the sequence to remove.
+    - length : The length of the sequence to remove.
+*/
+void MAGICremove(MAGIC m, int pos, int length) {
+    if (!m || length <= 0) return;
+    uint64_t start = m->latency ? latencyClock() : 0;
+
+    long timestamp = incrementTimestamp();
+    m->timestamp++;
+
+    m->engine->insert(m, pos, -length, progressionTimestamp(&m->progression, pos, -length, (int)timestamp));
+    if (m->latency)
+        latencyRecord(m->latency, MAGIC_OP_REMOVE, start);
+    if (PROBE_ENABLED(remove))
+        PROBE4(remove, pos, length, m->timestamp, probeDepth(m));
+}
+
+/*
+    Adds a sequence to the MAGIC structure by updating the shift tree.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - pos : The starting position of the sequence to add.
+    - length : The length of the sequence to add.
+*/
+void MAGICadd(MAGIC m, int pos, int length) {
+    if (!m || length <= 0) return;
+    if(pos < 0) return;
+    uint64_t start = m->latency ? latencyClock() : 0;
+
+    long timestamp = incrementTimestamp();
+    m->timestamp++;
+
+    m->engine->insert(m, pos, length, progressionTimestamp(&m->progression, pos, length, (int)timestamp));
+    if (m->latency)
+        latencyRecord(m->latency, MAGIC_OP_ADD, start);
+    if (PROBE_ENABLED(add))
+        PROBE4(add, pos, length, m->timestamp, probeDepth(m));
+}
+
+
+/*
+    Body of `MAGICmap()`, recording the latency in the given histograms
+    (NULL for none) so that parallel callers can each use their own.
+*/
+static int mapRecorded(MAGIC m, MAGICLatency *latency, MAGICDirection direction, int pos) {
+    if (!m || pos < 0)
+        return -1;
+
+    uint64_t start = latency ? latencyClock() : 0;
+
+    int shiftedPos = m->engine->map(m, direction, pos);
+    if (latency)
+        latencyRecord(latency, direction ? MAGIC_OP_MAP_OUT_IN : MAGIC_OP_MAP_IN_OUT, start);
+    if (PROBE_ENABLED(map))
+        PROBE5(map, direction, pos, shiftedPos, m->timestamp, probeDepth(m));
+    
+    return shiftedPos;
+}
+
+/*
+    Maps a position in the source stream to the destination stream, considering shifts and deletions.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - direction : The mapping direction.
+    - pos : The position to map.
+
+    Return:
+    -------
+    - Mapped position or -1 if no mapping is found.
+*/
+int MAGICmap(MAGIC m, MAGICDirection direction, int pos){
+    return mapRecorded(m, m ? m->latency : NULL, direction, pos);
+}
+
+// Whether positions are in ascending order
+static bool isAscending(const int *positions, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        if (positions[i] < positions[i - 1])
+            return false;
+    }
+    return true;
+}
+
+/*
+    Body of `MAGICmapMany()`, recording latencies in the given histograms
+    (NULL for none). Ascending positions walk neighbouring paths that stay
+    in cache, where one lookup at a time is faster than interleaving them.
+*/
+static void mapBatch(MAGIC m, MAGICLatency *latency, MAGICDirection direction, const int *positions, int *results,
+                     size_t count) {
+    if (!m || latency || PROBE_ENABLED(map) || isAscending(positions, count)) {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = mapRecorded(m, latency, direction, positions[i]);
+        }
+        return;
+    }
+
+    // Negative positions map to -1 without a lookup; the others are batched
+    size_t first = 0;
+    for (size_t i = 0; i <= count; i++) {
+        if (i < count && positions[i] >= 0)
+            continue;
+        m->engine->mapMany(m, direction, positions + first, results + first, i - first);
+        if (i < count)
+            results[i] = -1;
+        first = i + 1;
+    }
+}
+
+/*
+    Maps a position and reports how many of the following positions map
+    contiguously.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - direction : The mapping direction.
+    - pos : The position to map.
+    - run : Receives the length of the run starting at pos, at least 1.
+
+    Return:
+    -------
+    - The same value as `MAGICmap(m, direction, pos)`. For every k below *run,
+      `MAGICmap(m, direction, pos + k)` is the result plus k, or -1 if the
+      result is -1.
+
+    Behavior:
+    ---------
+    - Costs one lookup, so walking a stream run by run costs one lookup per
+      edit boundary instead of one per byte.
+*/
+int MAGICmapRun(MAGIC m, MAGICDirection direction, int pos, int *run){
+    if (!run)
+        return MAGICmap(m, direction, pos);
+    if (!m || pos < 0) {
+        *run = 1;
+        return -1;
+    }
+
+    return m->engine->mapRun(m, direction, pos, run);
+}
+
+/*
+    Returns the current version of a MAGIC instance.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+
+    Return:
+    -------
+    - The number of edits applied so far (after rollbacks, the number of
+      edits leading to the current state), or -1 if m is NULL.
+*/
+int MAGICversion(MAGIC m){
+    if (!m)
+        return -1;
+    return m->timestamp;
+}
+
+/*
+    Starts keeping every version of a MAGIC instance for `MAGICmapAt()`.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+
+    Return:
+    -------
+    - 0 on success, -1 if the engine cannot keep versions (only the
+      persistent engine can) or memory is exhausted.
+
+    Behavior:
+    ---------
+    - Versions from the current one onwards are kept until the instance is
+      destroyed. Each later edit then copies O(log n) nodes.
+    - A rollback to a checkpoint of the same lineage drops the versions
+      after it; a rollback elsewhere restarts the history.
+*/
+int MAGICenableHistory(MAGIC m){
+    if (!m || !m->engine->enableHistory)
+        return -1;
+    return m->engine->enableHistory(m) ? 0 : -1;
+}
+
+/*
+    Maps a position as it was mapped right after a given version.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - version : Number of edits applied at the time of the query.
+    - direction : The mapping direction.
+    - pos : The position to map.
+
+    Return:
+    -------
+    - The mapped position at that version, or -1 if no mapping is found or
+      the version is not available.
+
+    Behavior:
+    ---------
+    - O(log n), the same cost as `MAGICmap()`.
+    - The current version is always available; older ones require
+      `MAGICenableHistory()` to have been called before they were reached.
+*/
+int MAGICmapAt(MAGIC m, int version, MAGICDirection direction, int pos){
+    if (!m || pos < 0)
+        return -1;
+    if (version == m->timestamp)
+        return MAGICmap(m, direction, pos);
+    if (!m->engine->mapAt)
+        return -1;
+    return m->engine->mapAt(m, version, direction, pos);
+}
+
+/*
+    Maps an array of positions.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - direction : The mapping direction.
+    - positions : The positions to map.
+    - results : Receives the mapped positions (may alias positions).
+    - count : Number of positions.
+
+    Behavior:
+    ---------
+    - results[i] is exactly `MAGICmap(m, direction, positions[i])`.
+    - Positions out of order are looked up interleaved by the engine
+      (`RBTreeFindMappingMany()`), which hides their cache misses. Ascending
+      positions are mapped one by one, as are all positions while latencies
+      are recorded or the map probe is enabled, so that each lookup is seen.
+*/
+void MAGICmapMany(MAGIC m, MAGICDirection direction, const int *positions, int *results, size_t count){
+    if (!positions || !results)
+        return;
+
+    mapBatch(m, m ? m->latency : NULL, direction, positions, results, count);
+}
+
+/*
+    Runs tasks on their own threads, the calling thread taking the first one.
+
+    Arguments:
+    ----------
+    - worker : Thread entry point, called with a pointer to one task.
+    - tasks : Array of tasks.
+    - taskSize : Size of one task in bytes.
+    - count : Number of tasks.
+
+    Return:
+    -------
+    - The number of threads that ran tasks (at least 1). Tasks whose thread
+      could not be started are run by the calling thread.
+*/
+static int runParallel(void *(*worker)(void*), void *tasks, size_t taskSize, int count) {
+    char *task = (char*)tasks;
+    pthread_t *ids = (pthread_t*)malloc((size_t)count * sizeof(pthread_t));
+    bool *started = (bool*)calloc((size_t)count, sizeof(bool));
+    int used = 1;
+
+    if (ids && started) {
+        for (int t = 1; t < count; t++) {
+            if (pthread_create(&ids[t], NULL, worker, task + (size_t)t * taskSize) == 0) {
+                started[t] = true;
+                used++;
+            }
+        }
+    }
+
+    worker(task);
+    for (int t = 1; t < count; t++) {
+        if (started && started[t]) {
+            pthread_join(ids[t], NULL);
+        } else {
+            worker(task + (size_t)t * taskSize);
+        }
+    }
+
+    free(ids);
+    free(started);
+    return used;
+}
+
+/*
+    Returns the number of threads to use for a requested count (0 = all CPUs).
+*/
+static int threadCount(int threads) {
+    if (threads > 0) return threads;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+/*
+    Describes the share of a parallel batch handled by one thread.
+*/
+typedef struct MapManyTask {
+    MAGIC m;
+    MAGICDirection direction;
+    const int *positions;
+    int *results;
+    size_t count;
+    MAGICLatency *latency; // Histograms of this thread, or NULL when not recording
+} MapManyTask;
+
+/*
+    Thread entry point of `MAGICmapManyParallel()`.
+*/
+static void *mapManyWorker(void *arg) {
+    MapManyTask *task = (MapManyTask*)arg;
+    mapBatch(task->m, task->latency, task->direction, task->positions, task->results, task->count);
+    return NULL;
+}
+
+// Number of positions out of order partitioned at a time
+#define MAP_PARTITION_CHUNK (1 << 22)
+
+// Positions sampled per thread to choose the ranges of values
+#define MAP_PARTITION_SAMPLES 64
+
+/*
+    A batch of positions out of order, grouped by range of values so that
+    each thread maps the positions of one range.
+
+    Members:
+    --------
+    - threads : Number of ranges, one per thread.
+    - splitters : threads - 1 ascending bounds; range r holds the positions
+                  from splitters[r - 1] (included) to splitters[r].
+    - positions, results, count : The chunk being mapped.
+    - counts : counts[t * threads + r] is the number of positions of slice t
+               of the chunk in range r, then where the next one goes.
+    - gathered, index : Positions grouped by range, mapped in place, and
+                        their index in the chunk.
+    - rangeStart : Offset of each range in gathered, threads + 1 entries.
+*/
+typedef struct MapPartition {
+    int threads;
+    const int *splitters;
+    const int *positions;
+    int *results;
+    size_t count;
+    size_t *counts;
+    int *gathered;
+    uint32_t *index;
+    size_t *rangeStart;
+} MapPartition;
+
+// Steps of a partitioned batch, each run on every thread
+typedef enum { PARTITION_COUNT, PARTITION_SCATTER, PARTITION_MAP } PartitionStep;
+
+typedef struct PartitionTask {
+    MapPartition *partition;
+    PartitionStep step;
+    int thread;
+    MAGIC m;
+    MAGICDirection direction;
+    MAGICLatency *latency; // Histograms of this thread, or NULL when not recording
+} PartitionTask;
+
+// Returns the range of a position
+static int partitionRange(const MapPartition *partition, int pos) {
+    int low = 0, high = partition->threads - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (pos < partition->splitters[middle]) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+/*
+    Thread entry point of a partitioned batch. Thread t counts, then
+    scatters, the positions of slice t of the chunk; it then maps those of
+    range t and puts each result back in place.
+*/
+static void *partitionWorker(void *arg) {
+    PartitionTask *task = (PartitionTask*)arg;
+    MapPartition *partition = task->partition;
+    int threads = partition->threads;
+    size_t first = partition->count * (size_t)task->thread / (size_t)threads;
+    size_t last = partition->count * (size_t)(task->thread + 1) / (size_t)threads;
+    size_t *counts = partition->counts + (size_t)task->thread * (size_t)threads;
+
+    if (task->step == PARTITION_COUNT) {
+        for (size_t i = first; i < last; i++) {
+            counts[partitionRange(partition, partition->positions[i])]++;
+        }
+    } else if (task->step == PARTITION_SCATTER) {
+        for (size_t i = first; i < last; i++) {
+            size_t slot = counts[partitionRange(partition, partition->positions[i])]++;
+            partition->gathered[slot] = partition->positions[i];
+            partition->index[slot] = (uint32_t)i;
+        }
+    } else {
+        size_t start = partition->rangeStart[task->thread];
+        size_t end = partition->rangeStart[task->thread + 1];
+        int *gathered = partition->gathered;
+        mapBatch(task->m, task->latency, task->direction, gathered + start, gathered + start, end - start);
+        for (size_t k = start; k < end; k++) {
+            partition->results[partition->index[k]] = gathered[k];
+        }
+    }
+    return NULL;
+}
+
+static int compareInts(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Maps positions out of order on several threads, each mapping one range
+    of values.
+
+    Arguments:
+    ----------
+    - tasks : One task per thread, with m, direction and latency set.
+    - threads : Number of threads, at least 2.
+    - positions, results, count : The batch, count >= threads * MAP_PARTITION_SAMPLES.
+
+    Return:
+    -------
+    - The number of threads that took part in the work, or 0 if memory is
+      exhausted, in which case nothing was mapped.
+
+    Behavior:
+    ---------
+    - Sorted samples of the batch give threads ranges holding about as many
+      positions each. Then, a chunk of the batch at a time, every thread
+      counts the positions of its slice in each range, and prefix sums give
+      each (range, slice) pair its place, so that the threads group the
+      positions by range without locking. Each thread then maps one range,
+      walking only its part of the trees.
+    - Results are written only once every position of the chunk was read,
+      so results may alias positions.
+*/
+static int mapPartitioned(PartitionTask *tasks, int threads, const int *positions, int *results, size_t count) {
+    size_t samples = (size_t)threads * MAP_PARTITION_SAMPLES;
+    size_t chunk = count < MAP_PARTITION_CHUNK ? count : MAP_PARTITION_CHUNK;
+    int *sample = (int*)malloc(samples * sizeof(int));
+    int *splitters = (int*)malloc((size_t)(threads - 1) * sizeof(int));
+    size_t *counts = (size_t*)malloc((size_t)threads * (size_t)threads * sizeof(size_t));
+    size_t *rangeStart = (size_t*)malloc(((size_t)threads + 1) * sizeof(size_t));
+    int *gathered = (int*)malloc(chunk * sizeof(int));
+    uint32_t *index = (uint32_t*)malloc(chunk * sizeof(uint32_t));
+    int used = 0;
+
+    if (sample && splitters && counts && rangeStart && gathered && index) {
+        for (size_t j = 0; j < samples; j++) {
+            sample[j] = positions[j * (count / samples)];
+        }
+        qsort(sample, samples, sizeof(int), compareInts);
+        for (int r = 1; r < threads; r++) {
+            splitters[r - 1] = sample[(size_t)r * MAP_PARTITION_SAMPLES];
+        }
+
+        MapPartition partition = { threads, splitters, NULL, NULL, 0, counts, gathered, index, rangeStart };
+        for (int t = 0; t < threads; t++) {
+            tasks[t].partition = &partition;
+            tasks[t].thread = t;
+        }
+        for (size_t first = 0; first < count; first += chunk) {
+            partition.positions = positions + first;
+            partition.results = results + first;
+            partition.count = count - first < chunk ? count - first : chunk;
+
+            memset(counts, 0, (size_t)threads * (size_t)threads * sizeof(size_t));
+            for (int t = 0; t < threads; t++) tasks[t].step = PARTITION_COUNT;
+            runParallel(partitionWorker, tasks, sizeof(PartitionTask), threads);
+
+            // Ranges follow each other, and in each range the slices
+            size_t slot = 0;
+            for (int r = 0; r < threads; r++) {
+                rangeStart[r] = slot;
+                for (int t = 0; t < threads; t++) {
+                    size_t n = counts[(size_t)t * (size_t)threads + (size_t)r];
+                    counts[(size_t)t * (size_t)threads + (size_t)r] = slot;
+                    slot += n;
+                }
+            }
+            rangeStart[threads] = slot;
+
+            for (int t = 0; t < threads; t++) tasks[t].step = PARTITION_SCATTER;
+            runParallel(partitionWorker, tasks, sizeof(PartitionTask), threads);
+            for (int t = 0; t < threads; t++) tasks[t].step = PARTITION_MAP;
+            int mapped = runParallel(partitionWorker, tasks, sizeof(PartitionTask), threads);
+            if (mapped > used) used = mapped;
+        }
+    }
+
+    free(sample);
+    free(splitters);
+    free(counts);
+    free(rangeStart);
+    free(gathered);
+    free(index);
+    return used;
+}
+
+/*
+    Maps an array of positions on several threads.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure. It must not be modified during the call.
+    - direction : The mapping direction.
+    - positions : The positions to map.
+    - results : Receives the mapped positions (may alias positions).
+    - count : Number of positions.
+    - threads : Number of threads to use, or 0 for one per online CPU.
+
+    Return:
+    -------
+    - The number of threads that took part in the work (at least 1).
+
+    Behavior:
+    ---------
+    - Each thread maps the positions of one range of values, so that it
+      walks its own part of the trees and keeps it in its own cache. Sorted
+      positions are cut into one contiguous slice per thread, which is such
+      a range. Positions out of order are first grouped by range, see
+      `mapPartitioned()`, falling back to slices if memory is short.
+    - The calling thread takes the first share. The index is only read, so
+      no locking is needed. If a thread cannot be started, its share is
+      mapped by the caller.
+    - Results are identical to `MAGICmapMany()`.
+*/
+int MAGICmapManyParallel(MAGIC m, MAGICDirection direction, const int *positions, int *results,
+                         size_t count, int threads){
+    threads = threadCount(threads);
+    if ((size_t)threads > count) {
+        threads = count > 0 ? (int)count : 1;
+    }
+    if (threads == 1 || !positions || !results) {
+        MAGICmapMany(m, direction, positions, results, count);
+        return 1;
+    }
+
+    // Threads other than the caller record latency on their own and are merged at the end
+    MapManyTask *tasks = (MapManyTask*)malloc((size_t)threads * sizeof(MapManyTask));
+    MAGICLatency *latencies = NULL;
+    if (tasks && m && m->latency)
+        latencies = (MAGICLatency*)calloc((size_t)threads - 1, sizeof(MAGICLatency));
+    if (!tasks || (m && m->latency && !latencies)) {
+        free(tasks);
+        MAGICmapMany(m, direction, positions, results, count);
+        return 1;
+    }
+
+    int used = 0;
+    if (count >= (size_t)threads * MAP_PARTITION_SAMPLES && !isAscending(positions, count)) {
+        PartitionTask *partitionTasks = (PartitionTask*)malloc((size_t)threads * sizeof(PartitionTask));
+        if (partitionTasks) {
+            for (int t = 0; t < threads; t++) {
+                MAGICLatency *latency = latencies ? (t == 0 ? m->latency : &latencies[t - 1]) : NULL;
+                partitionTasks[t] = (PartitionTask){ NULL, PARTITION_COUNT, t, m, direction, latency };
+            }
+            used = mapPartitioned(partitionTasks, threads, positions, results, count);
+            free(partitionTasks);
+        }
+    }
+    if (used == 0) {
+        for (int t = 0; t < threads; t++) {
+            size_t first = count * (size_t)t / (size_t)threads;
+            size_t last = count * (size_t)(t + 1) / (size_t)threads;
+            MAGICLatency *latency = latencies ? (t == 0 ? m->latency : &latencies[t - 1]) : NULL;
+            tasks[t] = (MapManyTask){ m, direction, positions + first, results + first, last - first, latency };
+        }
+        used = runParallel(mapManyWorker, tasks, sizeof(MapManyTask), threads);
+    }
+
+    if (latencies) {
+        for (int t = 1; t < threads; t++) {
+            MAGIClatencyMerge(m->latency, &latencies[t - 1]);
+        }
+    }
+    free(latencies);
+    free(tasks);
+    return used;
+}
+
+// Descent of `prefetchEditPaths()` toward where an edit will be inserted
+typedef struct EditPath {
+    RBNode *current; // Next node to visit, already prefetched
+    int pos;         // Position of the edit
+} EditPath;
+
+/*
+    Brings into cache the nodes that inserting the given edits in tree would
+    visit, the way `RBTreeFindMappingMany()` steps its lookups: count (at
+    most MAGIC_MAP_GROUP) descents at once, each prefetching its next node,
+    so their cache misses overlap. Only removals are inserted in the delete
+    tree. The tree is only read.
+*/
+static void prefetchEditPaths(RBTree *tree, const MAGICEdit *edits, size_t count, bool removals) {
+    EditPath group[MAGIC_MAP_GROUP];
+    int active = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!removals || edits[i].kind == MAGIC_EDIT_REMOVE)
+            group[active++] = (EditPath){ tree->root, edits[i].pos };
+    }
+    while (active > 0) {
+        for (int g = 0; g < active; ) {
+            RBNode *current = group[g].current;
+            if (current == tree->NIL) {
+                group[g] = group[--active];
+                continue;
+            }
+            group[g].current = group[g].pos < current->pos ? current->left : current->right;
+            __builtin_prefetch(group[g].current);
+            g++;
+        }
+    }
+}
+
+/*
+    Applies a list of edits in order.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - edits : The edits to apply.
+    - count : Number of edits.
+
+    Behavior:
+    ---------
+    - Equivalent to calling `MAGICadd()` or `MAGICremove()` for each edit.
+    - Mappings depend on the shape insertion order gives the trees, so the
+      edits are inserted one by one in order, but knowing them ahead helps:
+      on trees of MAGIC_MAP_INTERLEAVE_MIN nodes or more, the paths of each
+      group of MAGIC_MAP_GROUP edits are prefetched together before the
+      group is inserted (see test_magic_bench.c).
+*/
+void MAGICapplyEdits(MAGIC m, const MAGICEdit *edits, size_t count){
+    if (!m || !edits)
+        return;
+
+    for (size_t i = 0; i < count; i += MAGIC_MAP_GROUP) {
+        size_t group = count - i < MAGIC_MAP_GROUP ? count - i : MAGIC_MAP_GROUP;
+        if (m->shiftTree->totals.count >= MAGIC_MAP_INTERLEAVE_MIN) {
+            prefetchEditPaths(m->shiftTree, edits + i, group, false);
+            prefetchEditPaths(m->deleteTree, edits + i, group, true);
+        }
+        for (size_t k = i; k < i + group; k++) {
+            if (edits[k].kind == MAGIC_EDIT_REMOVE) {
+                MAGICremove(m, edits[k].pos, edits[k].length);
+            } else {
+                MAGICadd(m, edits[k].pos, edits[k].length);
+            }
+        }
+    }
+}
+
+/*
+    Tells whether `MAGICadd()` or `MAGICremove()` would record an edit.
+*/
+static bool isValidEdit(const MAGICEdit *edit) {
+    if (edit->length <= 0) return false;
+    return edit->kind == MAGIC_EDIT_REMOVE || edit->pos >= 0;
+}
+
+// Sets up the node of an edit in its slot of the block of a build
+static void initBuildNode(RBNode *node, RBNode *nil, const MAGICEdit *edit, int timestamp) {
+    node->pos = edit->pos;
+    node->delta = edit->kind == MAGIC_EDIT_REMOVE ? -edit->length : edit->length;
+    node->lazyShift = node->delta;
+    node->timestamp = timestamp;
+    node->left = node->right = node->parent = nil;
+    node->color = RED;
+    node->run = node->attached = false;
+    node->refs = 1;
+    node->sums = nodeAggregates(node->delta);
+}
+
+/*
+    Builds a MAGIC instance from an edit log, with every node in one block.
+
+    Arguments:
+    ----------
+    - edits : The edits, in the order they were applied.
+    - count : Number of edits.
+
+    Return:
+    -------
+    - A new MAGIC instance (default engine) mapping exactly like one built
+      with `MAGICapplyEdits()`, or NULL on failure.
+
+    Behavior:
+    ---------
+    - Counts the recorded edits, allocates their nodes in one block and
+      inserts them in log order, prefetching the paths of each group of
+      edits like `MAGICapplyEdits()`. The build saves the per-node
+      allocations and the per-edit overhead of `MAGICadd()`. Runs of the log
+      still fold into run nodes, which frees their slots of the block only
+      with the instance.
+    - Mappings depend on the shape the trees take when edits are inserted in
+      log order, so the log cannot be sorted and the trees cannot be
+      assembled bottom-up or split between threads without changing results.
+*/
+MAGIC MAGICbuild(const MAGICEdit *edits, size_t count){
+    if (!edits && count > 0)
+        return NULL;
+
+    MAGIC m = MAGICinitWithEngine(MAGIC_ENGINE_RBTREE);
+    if (!m)
+        return NULL;
+
+    size_t valid = 0, removes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (isValidEdit(&edits[i])) {
+            valid++;
+            removes += edits[i].kind == MAGIC_EDIT_REMOVE;
+        }
+    }
+    if (valid == 0)
+        return m;
+
+    // Shift nodes, then delete nodes
+    m->pool.block = (RBNode*)malloc((valid + removes) * sizeof(RBNode));
+    if (!m->pool.block) {
+        MAGICdestroy(m);
+        return NULL;
+    }
+    m->pool.blockSize = valid + removes;
+    RBNode *shiftNode = m->pool.block;
+    RBNode *deleteNode = m->pool.block + valid;
+
+    long base = atomic_fetch_add(&global_timestamp, (long)valid);
+    for (size_t i = 0; i < count; i += MAGIC_MAP_GROUP) {
+        size_t group = count - i < MAGIC_MAP_GROUP ? count - i : MAGIC_MAP_GROUP;
+        if (m->shiftTree->totals.count >= MAGIC_MAP_INTERLEAVE_MIN) {
+            prefetchEditPaths(m->shiftTree, edits + i, group, false);
+            prefetchEditPaths(m->deleteTree, edits + i, group, true);
+        }
+        for (size_t k = i; k < i + group; k++) {
+            if (!isValidEdit(&edits[k])) continue;
+
+            int timestamp = (int)base + ++m->timestamp;
+            initBuildNode(shiftNode, m->shiftTree->NIL, &edits[k], timestamp);
+            bool inserted = RBTreeInsertNode(m->shiftTree, shiftNode++);
+            if (inserted && edits[k].kind == MAGIC_EDIT_REMOVE) {
+                initBuildNode(deleteNode, m->deleteTree->NIL, &edits[k], timestamp);
+                inserted = RBTreeInsertNode(m->deleteTree, deleteNode++);
+            }
+            if (!inserted) {
+                MAGICdestroy(m);
+                return NULL;
+            }
+        }
+    }
+    return m;
+}
+
+/*
+    Largest edit distance the diff searches exactly inside one region. Beyond
+    it the region is split at the furthest point reached so far, which bounds
+    the time per region at the cost of a possibly longer edit script. Chosen
+    with test_magic_bench.c: on 8 MB with 10000 scattered hunks, 4096 takes
+    3.4 s and 256 takes 0.33 s for the same number of edits.
+*/
+#ifndef MAGIC_DIFF_MAX_COST
+#define MAGIC_DIFF_MAX_COST 256
+#endif
+
+/*
+    State of one MAGICfromDiff run.
+
+    Fields:
+    -------
+    - a, b : The two versions.
+    - forward, backward : Furthest reaching x per diagonal, reused by every
+      bisection (2 * MAGIC_DIFF_MAX_COST + 3 entries each).
+    - edits, count, capacity : The edit script produced so far.
+    - ai, bi : End of the last common run emitted, in a and in b.
+*/
+typedef struct {
+    const unsigned char *a, *b;
+    int *forward, *backward;
+    MAGICEdit *edits;
+    size_t count, capacity;
+    int ai, bi;
+    bool failed;
+} Differ;
+
+/*
+    Returns the index of the lowest-addressed differing byte of two 8-byte
+    words loaded with memcpy, given their XOR (non-zero).
+*/
+static int firstDifferentByte(uint64_t diff) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(diff) >> 3;
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_clzll(diff) >> 3;
+#else
+    unsigned char x[8];
+    memcpy(x, &diff, sizeof(x));
+    int i = 0;
+    while (!x[i]) i++;
+    return i;
+#endif
+}
+
+// Same as firstDifferentByte for the highest-addressed differing byte
+static int lastDifferentByte(uint64_t diff) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return 7 - (__builtin_clzll(diff) >> 3);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return 7 - (__builtin_ctzll(diff) >> 3);
+#else
+    unsigned char x[8];
+    memcpy(x, &diff, sizeof(x));
+    int i = 7;
+    while (!x[i]) i--;
+    return i;
+#endif
+}
+
+// Length of the common prefix of a and b, compared 8 bytes at a time
+static int commonPrefix(const unsigned char *a, const unsigned char *b, int n) {
+    int i = 0;
+    while (i + 8 <= n) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            return i + firstDifferentByte(x ^ y);
+        i += 8;
+    }
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+// Length of the common suffix of a[0..n) and b[0..n), 8 bytes at a time
+static int commonSuffix(const unsigned char *a, const unsigned char *b, int n) {
+    int i = 0;
+    while (i + 8 <= n) {
+        uint64_t x, y;
+        memcpy(&x, a + n - i - 8, 8);
+        memcpy(&y, b + n - i - 8, 8);
+        if (x != y)
+            return i + 7 - lastDifferentByte(x ^ y);
+        i += 8;
+    }
+    while (i < n && a[n - i - 1] == b[n - i - 1])
+        i++;
+    return i;
+}
+
+static void diffPush(Differ *d, MAGICEditKind kind, int pos, int length) {
+    if (d->count == d->capacity) {
+        size_t capacity = d->capacity ? 2 * d->capacity : 64;
+        MAGICEdit *edits = (MAGICEdit*)realloc(d->edits, capacity * sizeof(MAGICEdit));
+        if (!edits) {
+            d->failed = true;
+            return;
+        }
+        d->edits = edits;
+        d->capacity = capacity;
+    }
+    d->edits[d->count].kind = kind;
+    d->edits[d->count].pos = pos;
+    d->edits[d->count].length = length;
+    d->count++;
+}
+
+/*
+    Records that a[x..x+length) equals b[y..y+length). Common runs arrive left
+    to right; the gap since the previous run becomes one hunk, recorded as a
+    removal then an addition at its position in b. Since every edit before it
+    has been recorded, that is the position in the stream being edited.
+*/
+static void diffCommon(Differ *d, int x, int y, int length) {
+    if (x > d->ai) {
+        diffPush(d, MAGIC_EDIT_REMOVE, d->bi, x - d->ai);
+    }
+    if (y > d->bi) {
+        diffPush(d, MAGIC_EDIT_ADD, d->bi, y - d->bi);
+    }
+    d->ai = x + length;
+    d->bi = y + length;
+}
+
+/*
+    Finds where to split a[x0..x1) and b[y0..y1), which have no common prefix
+    or suffix, with the middle snake of Myers' linear space algorithm.
+
+    Return:
+    -------
+    - True with the split point in *x, *y, or false when both sides share no
+      byte at all.
+
+    Behavior:
+    ---------
+    - After MAGIC_DIFF_MAX_COST steps, returns the furthest point reached by
+      the forward search instead.
+*/
+static bool diffBisect(Differ *d, int x0, int x1, int y0, int y1, int *x, int *y) {
+    const unsigned char *a = d->a + x0, *b = d->b + y0;
+    int n = x1 - x0, m = y1 - y0;
+    int maxD = (n + m + 1) / 2;
+    if (maxD > MAGIC_DIFF_MAX_COST)
+        maxD = MAGIC_DIFF_MAX_COST;
+    int offset = maxD + 1, size = 2 * maxD + 3;
+    int *vf = d->forward, *vb = d->backward;
+    int delta = n - m;
+    bool front = delta % 2 != 0;
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+    int bestX = 0, bestY = 0;
+
+    for (int i = 0; i < size; i++) {
+        vf[i] = vb[i] = -1;
+    }
+    vf[offset + 1] = vb[offset + 1] = 0;
+
+    for (int step = 0; step < maxD; step++) {
+        // Forward search
+        for (int k = -step + k1start; k <= step - k1end; k += 2) {
+            int k1 = offset + k;
+            int fx = (k == -step || (k != step && vf[k1 - 1] < vf[k1 + 1])) ? vf[k1 + 1] : vf[k1 - 1] + 1;
+            int fy = fx - k;
+            if (fx < n && fy < m) {
+                int run = commonPrefix(a + fx, b + fy, n - fx < m - fy ? n - fx : m - fy);
+                fx += run;
+                fy += run;
+            }
+            vf[k1] = fx;
+            if (fx > n) {
+                k1end += 2;
+            } else if (fy > m) {
+                k1start += 2;
+            } else {
+                if (fx + fy > bestX + bestY) {
+                    bestX = fx;
+                    bestY = fy;
+                }
+                if (front) {
+                    int k2 = offset + delta - k;
+                    if (k2 >= 0 && k2 < size && vb[k2] != -1 && fx >= n - vb[k2]) {
+                        *x = x0 + fx;
+                        *y = y0 + fy;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        // Backward search, on the reversed sequences
+        for (int k = -step + k2start; k <= step - k2end; k += 2) {
+            int k2 = offset + k;
+            int bx = (k == -step || (k != step && vb[k2 - 1] < vb[k2 + 1])) ? vb[k2 + 1] : vb[k2 - 1] + 1;
+            int by = bx - k;
+            if (bx < n && by < m) {
+                int limit = n - bx < m - by ? n - bx : m - by;
+                int run = commonSuffix(a + (n - bx) - limit, b + (m - by) - limit, limit);
+                bx += run;
+                by += run;
+            }
+            vb[k2] = bx;
+            if (bx > n) {
+                k2end += 2;
+            } else if (by > m) {
+                k2start += 2;
+            } else if (!front) {
+                int k1 = offset + delta - k;
+                if (k1 >= 0 && k1 < size && vf[k1] != -1) {
+                    int fx = vf[k1];
+                    int fy = fx - (k1 - offset);
+                    if (fx >= n - bx) {
+                        *x = x0 + fx;
+                        *y = y0 + fy;
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    if (maxD == (n + m + 1) / 2 || bestX + bestY == 0 || (bestX == n && bestY == m))
+        return false;
+    *x = x0 + bestX;
+    *y = y0 + bestY;
+    return true;
+}
+
+/*
+    Diffs a[x0..x1) against b[y0..y1), emitting common runs left to right.
+    Recurses on the left part of each split and loops on the right part; the
+    common suffixes stripped along the way are contiguous and emitted last.
+*/
+static void diffRegion(Differ *d, int x0, int x1, int y0, int y1) {
+    int tail = 0;
+    while (!d->failed) {
+        int prefix = commonPrefix(d->a + x0, d->b + y0, x1 - x0 < y1 - y0 ? x1 - x0 : y1 - y0);
+        if (prefix > 0) {
+            diffCommon(d, x0, y0, prefix);
+            x0 += prefix;
+            y0 += prefix;
+        }
+        int limit = x1 - x0 < y1 - y0 ? x1 - x0 : y1 - y0;
+        int suffix = commonSuffix(d->a + x1 - limit, d->b + y1 - limit, limit);
+        x1 -= suffix;
+        y1 -= suffix;
+        tail += suffix;
+
+        int x, y;
+        if (x0 == x1 || y0 == y1 || !diffBisect(d, x0, x1, y0, y1, &x, &y))
+            break;
+        diffRegion(d, x0, x, y0, y);
+        x0 = x;
+        y0 = y;
+    }
+    if (tail > 0) {
+        diffCommon(d, x1, y1, tail);
+    }
+}
+
+/*
+    Builds a MAGIC instance mapping one version of a buffer to another.
+
+    Arguments:
+    ----------
+    - a, alen : The original version.
+    - b, blen : The edited version.
+
+    Return:
+    -------
+    - A new MAGIC instance (default engine), or NULL on failure or when a
+      version is longer than INT_MAX bytes.
+
+    Behavior:
+    ---------
+    - Computes a byte-level edit script with Myers' O(ND) algorithm in linear
+      space. Common prefixes, suffixes and snakes are compared 8 bytes at a
+      time, so long identical stretches cost little more than a memcmp.
+    - Each differing hunk is recorded as a removal then an addition at its
+      position in the edited stream, hunks from left to right, and the script
+      goes through `MAGICbuild()`. The instance maps exactly like one fed the
+      same edits with `MAGICremove()` and `MAGICadd()`.
+    - Regions whose edit distance exceeds MAGIC_DIFF_MAX_COST are split at the
+      furthest point reached, so the script may not be minimal there.
+*/
+MAGIC MAGICfromDiff(const void *a, size_t alen, const void *b, size_t blen){
+    static const unsigned char empty[1];
+
+    if ((!a && alen > 0) || (!b && blen > 0) || alen > INT_MAX || blen > INT_MAX)
+        return NULL;
+
+    Differ d = {0};
+    d.a = a ? (const unsigned char*)a : empty;
+    d.b = b ? (const unsigned char*)b : empty;
+    d.forward = (int*)malloc((2 * MAGIC_DIFF_MAX_COST + 3) * sizeof(int));
+    d.backward = (int*)malloc((2 * MAGIC_DIFF_MAX_COST + 3) * sizeof(int));
+
+    MAGIC m = NULL;
+    if (d.forward && d.backward) {
+        diffRegion(&d, 0, (int)alen, 0, (int)blen);
+        diffCommon(&d, (int)alen, (int)blen, 0);
+        if (!d.failed) {
+            m = MAGICbuild(d.edits, d.count);
+        }
+    }
+
+    free(d.forward);
+    free(d.backward);
+    free(d.edits);
+    return m;
+}
+
+/*
+    Returns the length of the output produced from an input stream.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - inlen : Length of the input stream.
+
+    Return:
+    -------
+    - inlen plus the bytes added minus the bytes removed by every edit, or 0
+      if that is negative.
+
+    Behavior:
+    ---------
+    - O(1): reads the totals kept by the shift tree.
+*/
+size_t MAGICoutputLength(MAGIC m, size_t inlen){
+    if (!m)
+        return inlen;
+
+    Aggregates totals = m->shiftTree->totals;
+    long long length = (long long)inlen + totals.added - totals.removed;
+    return length > 0 ? (size_t)length : 0;
+}
+
+/*
+    Counts the edits recorded before a position.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - pos : The position.
+    - totals : Receives the number of those edits and the bytes they add and
+               remove (may be NULL).
+
+    Return:
+    -------
+    - The number of edits recorded at positions lower than pos, or -1 if m is
+      NULL.
+
+    Behavior:
+    ---------
+    - Walks one path of the shift tree, adding the sums of the nodes it
+      turns right at, and carries on below a run node it ends at: O(log n).
+*/
+int MAGICeditsBefore(MAGIC m, int pos, MAGICEditTotals *totals){
+    if (!m)
+        return -1;
+
+    RBTree *tree = m->shiftTree;
+    Aggregates sum = {0, 0, 0};
+    RBNode *x = tree->root, *last = tree->NIL;
+    while (x != tree->NIL) {
+        last = x;
+        if (x->pos < pos) {
+            addAggregates(&sum, &x->sums);
+            x = x->right;
+        } else {
+            x = x->left;
+        }
+    }
+    if (last->run) {
+        RunCursor c = runRoot(last);
+        runChild(last, &c, last->pos < pos);
+        while (c.half >= 0) {
+            bool right = c.pos < pos;
+            if (right) {
+                Aggregates sums = runNodeSums(last, &c);
+                addAggregates(&sum, &sums);
+            }
+            runChild(last, &c, right);
+        }
+    }
+    if (totals) {
+        totals->edits = sum.count;
+        totals->added = sum.added;
+        totals->removed = sum.removed;
+    }
+    return sum.count;
+}
+
+/*
+    Finds the edit of a given rank.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - k : The rank, from 0, of the edit in position order. Edits at the same
+          position are ranked in the order they were recorded.
+    - edit : Receives the edit (may be NULL).
+
+    Return:
+    -------
+    - 0, or -1 if m is NULL or k is out of range.
+
+    Behavior:
+    ---------
+    - Descends the shift tree by the sizes of the left subtrees: O(log n).
+      Below a run node, the descent goes on from its fields.
+*/
+int MAGICselectEdit(MAGIC m, int k, MAGICEdit *edit){
+    if (!m)
+        return -1;
+
+    RBTree *tree = m->shiftTree;
+    if (k < 0 || k >= tree->totals.count)
+        return -1;
+
+    RBNode *x = tree->root;
+    while (k != x->sums.count - 1 && !x->run) {
+        if (k < x->sums.count - 1) {
+            x = x->left;
+        } else {
+            k -= x->sums.count;
+            x = x->right;
+        }
+    }
+    int pos = x->pos, delta = x->delta;
+    if (k != x->sums.count - 1) {
+        // Same descent below the run node
+        RunCursor c = runRoot(x);
+        for (int left = x->sums.count - 1; k != left; left = runNodeSums(x, &c).count - 1) {
+            bool right = k > left;
+            if (right)
+                k -= left + 1;
+            runChild(x, &c, right);
+        }
+        pos = c.pos;
+        delta = runDelta(x, &c);
+    }
+    if (edit) {
+        edit->kind = delta < 0 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD;
+        edit->pos = pos;
+        edit->length = delta < 0 ? -delta : delta;
+    }
+    return 0;
+}
+
+/*
+    Produces output positions [pos, pos + length) that have no input byte,
+    from the insert callback or as zeros.
+*/
+static void applyInsert(MAGICInsertCallback insert, void *ctx, int pos, unsigned char *dst, size_t length) {
+    if (insert) {
+        insert(ctx, pos, dst, length);
+    } else {
+        memset(dst, 0, length);
+    }
+}
+
+/*
+    Rewrites an input buffer through a MAGIC mapping.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - in, inlen : The input stream.
+    - insert : Fills output ranges that have no input byte (NULL for zeros).
+    - ctx : Passed to insert.
+    - out : Receives `MAGICoutputLength(m, inlen)` bytes.
+
+    Return:
+    -------
+    - The number of bytes written, or -1 on invalid arguments or when inlen
+      exceeds INT_MAX.
+
+    Behavior:
+    ---------
+    - Output byte j is input byte `MAGICmap(m, STREAM_OUT_IN, j)` when that
+      position exists in the input, and inserted content otherwise.
+    - Walks the output with `MAGICmapRun()`: each run of positions that map
+      contiguously is copied with one memcpy, and each run without input is
+      passed to the callback, so the cost is one lookup per run plus the copy.
+      An inserted range may reach the callback in several consecutive pieces.
+*/
+long long MAGICapply(MAGIC m, const void *in, size_t inlen, MAGICInsertCallback insert, void *ctx, void *out){
+    if (!m || (!in && inlen > 0) || inlen > INT_MAX)
+        return -1;
+
+    size_t outlen = MAGICoutputLength(m, inlen);
+    if (outlen > INT_MAX || (!out && outlen > 0))
+        return -1;
+
+    const unsigned char *src = (const unsigned char*)in;
+    unsigned char *dst = (unsigned char*)out;
+    size_t j = 0;
+    while (j < outlen) {
+        int run;
+        int i = m->engine->mapRun(m, STREAM_OUT_IN, (int)j, &run);
+        size_t length = (size_t)run < outlen - j ? (size_t)run : outlen - j;
+
+        if (i >= 0 && (size_t)i < inlen) {
+            if (length > inlen - (size_t)i)
+                length = inlen - (size_t)i;
+            memcpy(dst + j, src + i, length);
+        } else {
+            applyInsert(insert, ctx, (int)j, dst + j, length);
+        }
+        j += length;
+    }
+    return (long long)outlen;
+}
+
+/*
+    State of a `MAGICapplyStream()` run: a window on the input and a pending
+    output buffer of `chunk` bytes. When the window moves forward it keeps the
+    last `keep` bytes of the previous one, for mappings that refer slightly
+    back.
 */
-struct magic{
-    RBTree *shiftTree; // Tree to track position shifts (used for mapping).
-    RBTree *deleteTree; // Tree to track deleted positions.
-    int timestamp; // Current timestamp of the MAGIC instance.
-};
+typedef struct {
+    MAGICReadCallback read;
+    MAGICWriteCallback write;
+    void *ctx;
+    size_t chunk, keep;
+    unsigned char *window;  // Input bytes [windowStart, windowStart + windowLength)
+    long long windowStart;
+    size_t windowLength;
+    unsigned char *out;
+    size_t outUsed;
+    long long written;
+} ApplyStream;
+
+// Moves the window forward by up to one chunk of input
+static bool applyStreamAdvance(ApplyStream *s) {
+    size_t kept = s->windowLength < s->keep ? s->windowLength : s->keep;
+    memmove(s->window, s->window + s->windowLength - kept, kept);
+    s->windowStart += (long long)(s->windowLength - kept);
+    s->windowLength = kept;
+
+    size_t end = kept + s->chunk;
+    while (s->windowLength < end) {
+        long n = s->read(s->ctx, s->window + s->windowLength, end - s->windowLength);
+        if (n < 0)
+            return false;
+        if (n == 0)
+            break;
+        s->windowLength += (size_t)n;
+    }
+    return s->windowLength > kept;
+}
 
+static bool applyStreamFlush(ApplyStream *s) {
+    if (s->outUsed > 0 && s->write(s->ctx, s->out, s->outUsed) != 0)
+        return false;
+    s->written += (long long)s->outUsed;
+    s->outUsed = 0;
+    return true;
+}
 
 /*
-    A global variable used to track the system-wide timestamp across MAGIC instances.
+    Rewrites an input stream that does not fit in memory through a MAGIC
+    mapping, with memory bounded by about two chunks.
 
-    Description:
-    ------------
-    This global timestamp is used to provide a versioning mechanism for tracking
-    changes in the MAGIC system.
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - inlen : Total length of the input stream.
+    - read : Reads the next input bytes, as read(2): returns the number of
+             bytes read, 0 at the end of the input or -1 on error.
+    - write : Writes output bytes, returns 0 on success.
+    - insert : Fills output ranges that have no input byte (NULL for zeros).
+    - ctx : Passed to the three callbacks.
+    - chunk : Size of the input window and of the output buffer (0 for 1 MiB).
+
+    Return:
+    -------
+    - The number of bytes written, or -1 on error or if the input ends early.
+
+    Behavior:
+    ---------
+    - Writes exactly what `MAGICapply()` would write for the whole input.
+    - The output is produced in order. The input window only moves forward,
+      when an output run needs bytes past it; input that no output position
+      refers to is read and dropped. The window keeps the last chunk / 8 bytes
+      it moves past, since overlapping edits can make a few output bytes refer
+      back; mappings that refer back further make the call fail.
 */
-static long global_timestamp = 0;
+long long MAGICapplyStream(MAGIC m, size_t inlen, MAGICReadCallback read, MAGICWriteCallback write,
+                           MAGICInsertCallback insert, void *ctx, size_t chunk){
+    if (!m || !read || !write || inlen > INT_MAX)
+        return -1;
+
+    size_t outlen = MAGICoutputLength(m, inlen);
+    if (outlen > INT_MAX)
+        return -1;
+
+    ApplyStream s = {read, write, ctx, chunk ? chunk : (size_t)1 << 20, 0, NULL, 0, 0, NULL, 0, 0};
+    s.keep = s.chunk / 8 > 0 ? s.chunk / 8 : 1;
+    s.window = (unsigned char*)malloc(s.chunk + s.keep);
+    s.out = (unsigned char*)malloc(s.chunk);
+    long long j = 0;
+    bool ok = s.window && s.out;
+
+    while (ok && j < (long long)outlen) {
+        int run;
+        int i = m->engine->mapRun(m, STREAM_OUT_IN, (int)j, &run);
+        long long length = run < (long long)outlen - j ? run : (long long)outlen - j;
+        bool fromInput = i >= 0 && (size_t)i < inlen;
+
+        if (fromInput) {
+            if (i < s.windowStart) {
+                ok = false;
+                break;
+            }
+            long long windowEnd = s.windowStart + (long long)s.windowLength;
+            if (i >= windowEnd) {
+                ok = applyStreamAdvance(&s);
+                continue;
+            }
+            if (length > windowEnd - i)
+                length = windowEnd - i;
+        }
+
+        // Emit the run through the output buffer
+        while (ok && length > 0) {
+            size_t piece = s.chunk - s.outUsed;
+            if ((long long)piece > length)
+                piece = (size_t)length;
+            if (fromInput) {
+                memcpy(s.out + s.outUsed, s.window + (i - s.windowStart), piece);
+                i += (int)piece;
+            } else {
+                applyInsert(insert, ctx, (int)j, s.out + s.outUsed, piece);
+            }
+            s.outUsed += piece;
+            j += (long long)piece;
+            length -= (long long)piece;
+            if (s.outUsed == s.chunk)
+                ok = applyStreamFlush(&s);
+        }
+    }
+
+    ok = ok && applyStreamFlush(&s);
+    free(s.window);
+    free(s.out);
+    return ok ? s.written : -1;
+}
+
+// Appends [base, base + length) to an iovec list, extending the last entry when contiguous
+static int iovecAppend(struct iovec *iov, int count, int cap, const unsigned char *base, size_t length) {
+    if (count > 0 && (const unsigned char*)iov[count - 1].iov_base + iov[count - 1].iov_len == base) {
+        iov[count - 1].iov_len += length;
+        return count;
+    }
+    if (count == cap)
+        return -1;
+    iov[count].iov_base = (void*)base;
+    iov[count].iov_len = length;
+    return count + 1;
+}
 
 /*
-    Increments the global timestamp.
+    Describes the output of a MAGIC mapping as an iovec list, one input chunk
+    at a time, without copying any payload.
 
     Arguments:
     ----------
-    None.
+    - m : The MAGIC structure.
+    - cursor : Progress through the stream. `inputLength` is the total input
+               length and `chunkStart` the input position of `in`, both set
+               by the caller; `output` and `inserted` start at 0 and are
+               advanced by each call.
+    - in, inlen : The current input chunk.
+    - inserts, insertlen : Every inserted byte of the output, in output order.
+    - iov, cap : Receives up to cap entries.
+
+    Return:
+    -------
+    - The number of entries written, or -1 on invalid arguments, when an
+      output run needs input before the chunk, or when inserts is too short.
 
     Behavior:
     ---------
-    - Increases the global timestamp by 1.
-    - This function ensures that each transformation operation is associated with
-      a unique timestamp, supporting versioning and mapping in the MAGIC system.
+    - Describes the same bytes `MAGICapply()` writes, with inserted content
+      taken from inserts instead of a callback.
+    - Entries point into `in` and `inserts`, which must stay valid until the
+      entries are sent. Contiguous runs are merged into one entry.
+    - Stops when iov is full or when the next output run needs input past the
+      chunk. Call again with the same chunk in the first case and with the
+      next one in the second; the output is complete when `cursor->output`
+      reaches `MAGICoutputLength(m, cursor->inputLength)`.
+    - Chunks may overlap: repeating the tail of the previous chunk at the
+      start of the next one tolerates mappings that refer back, like the
+      window of `MAGICapplyStream()`.
+*/
+int MAGICtoIovec(MAGIC m, MAGICIovecCursor *cursor, const void *in, size_t inlen,
+                 const void *inserts, size_t insertlen, struct iovec *iov, int cap){
+    if (!m || !cursor || (!in && inlen > 0) || !iov || cap < 0 || cursor->inputLength > INT_MAX)
+        return -1;
+
+    size_t outlen = MAGICoutputLength(m, cursor->inputLength);
+    if (outlen > INT_MAX)
+        return -1;
+
+    const unsigned char *chunk = (const unsigned char*)in;
+    const unsigned char *added = (const unsigned char*)inserts;
+    size_t chunkEnd = cursor->chunkStart + inlen;
+    int count = 0;
+
+    while (cursor->output < outlen) {
+        int run;
+        int i = m->engine->mapRun(m, STREAM_OUT_IN, (int)cursor->output, &run);
+        size_t length = (size_t)run < outlen - cursor->output ? (size_t)run : outlen - cursor->output;
+        bool fromInput = i >= 0 && (size_t)i < cursor->inputLength;
+        const unsigned char *base;
+
+        if (fromInput) {
+            if ((size_t)i < cursor->chunkStart)
+                return -1;
+            if ((size_t)i >= chunkEnd)
+                break;
+            if (length > chunkEnd - (size_t)i)
+                length = chunkEnd - (size_t)i;
+            base = chunk + ((size_t)i - cursor->chunkStart);
+        } else {
+            if (cursor->inserted > insertlen || length > insertlen - cursor->inserted)
+                return -1;
+            base = added + cursor->inserted;
+        }
+
+        int next = iovecAppend(iov, count, cap, base, length);
+        if (next < 0)
+            break;
+        count = next;
+        cursor->output += length;
+        if (!fromInput)
+            cursor->inserted += length;
+    }
+    return count;
+}
+
+// Ways of copying file ranges, from the cheapest
+enum { REWRITE_COPY_FILE_RANGE, REWRITE_SENDFILE, REWRITE_READ_WRITE };
+
+// Largest range handed to the kernel at once, and bounce buffer of the fallback
+enum { REWRITE_PIECE = 1 << 30, REWRITE_BUFFER = 1 << 20 };
+
+/*
+    State of a `MAGICrewriteFile()` run. `method` starts at the cheapest way
+    of copying and moves down, for good, the first time the kernel refuses it
+    for these two files.
 */
-void incrementTimestamp(void) {
-    global_timestamp++;
+typedef struct {
+    int inFd, outFd;
+    int method;
+    unsigned char *buffer;  // Bounce buffer of REWRITE_READ_WRITE, allocated on first use
+} FileRewriter;
+
+static bool writeAll(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+// Copies input bytes [offset, offset + length) to the current offset of the output
+static bool rewriterCopy(FileRewriter *r, long long offset, long long length) {
+    while (length > 0) {
+        size_t piece = length < REWRITE_PIECE ? (size_t)length : REWRITE_PIECE;
+        ssize_t n;
+#ifdef __linux__
+        if (r->method == REWRITE_COPY_FILE_RANGE) {
+            off64_t from = offset;
+            n = copy_file_range(r->inFd, &from, r->outFd, NULL, piece, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                          || errno == EOPNOTSUPP || errno == EBADF)) {
+                r->method = REWRITE_SENDFILE;
+                continue;
+            }
+        } else if (r->method == REWRITE_SENDFILE) {
+            off_t from = (off_t)offset;
+            n = sendfile(r->outFd, r->inFd, &from, piece);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                r->method = REWRITE_READ_WRITE;
+                continue;
+            }
+        } else
+#endif
+        {
+            if (!r->buffer && !(r->buffer = (unsigned char*)malloc(REWRITE_BUFFER)))
+                return false;
+            n = pread(r->inFd, r->buffer, piece < REWRITE_BUFFER ? piece : REWRITE_BUFFER, (off_t)offset);
+            if (n > 0 && !writeAll(r->outFd, r->buffer, (size_t)n))
+                return false;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        offset += n;
+        length -= n;
+    }
+    return true;
 }
 
 /*
-    Initializes a MAGIC structure with two Red-Black Trees (shift and delete trees) and an initial timestamp.
+    Rewrites a file through a MAGIC mapping, copying unchanged ranges inside
+    the kernel.
 
     Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - in_fd : The input, a regular file read with pread-like calls (its
+              offset is not used).
+    - out_fd : The output, written at its current offset.
+    - inserts, insertlen : Every inserted byte of the output, in output order.
+
+    Return:
+    -------
+    - The number of bytes written, or -1 on invalid arguments, I/O errors, or
+      when inserts is too short.
+
+    Behavior:
     ---------
-    None.
+    - Writes the bytes `MAGICapply()` would write for the whole file, with
+      inserted content taken from inserts as in `MAGICtoIovec()`.
+    - Walks the output with `MAGICmapRun()`. Unchanged runs are copied with
+      copy_file_range; when the kernel refuses it (other file system, output
+      not a regular file) the run falls back to sendfile, then to a
+      pread/write loop. Only inserted bytes pass through user space.
+    - Edits must lie below INT_MAX, but the file may be longer: the input
+      past INT_MAX, and the run before it past the last edit, are copied
+      without mapping each position.
+*/
+long long MAGICrewriteFile(MAGIC m, int in_fd, int out_fd, const void *inserts, size_t insertlen){
+    struct stat st;
+    if (!m || in_fd < 0 || out_fd < 0 || fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    size_t inlen = (size_t)st.st_size;
+    size_t outlen = MAGICoutputLength(m, inlen);
+    const unsigned char *added = (const unsigned char*)inserts;
+    size_t inserted = 0, j = 0;
+    FileRewriter r = {in_fd, out_fd, REWRITE_COPY_FILE_RANGE, NULL};
+    bool ok = true;
+
+    // Edits lie below input position INT_MAX: from its output position on, the rest of the input follows
+    long long delta = (long long)outlen - (long long)inlen;
+    size_t tail = inlen <= INT_MAX ? outlen : INT_MAX + delta > 0 ? (size_t)(INT_MAX + delta) : 0;
+
+    while (ok && j < outlen) {
+        // Between INT_MAX and the tail, only inserted output is left
+        int run;
+        long long i = -1;
+        size_t length = (j < tail ? tail : outlen) - j;
+        if (j >= tail) {
+            i = (long long)j - delta;
+        } else if (j < INT_MAX) {
+            i = m->engine->mapRun(m, STREAM_OUT_IN, (int)j, &run);
+            if ((long long)j + run < INT_MAX && (size_t)run < length) // Else no edit past j
+                length = (size_t)run;
+        }
+
+        if (i >= 0 && (size_t)i < inlen) {
+            if (length > inlen - (size_t)i)
+                length = inlen - (size_t)i;
+            ok = rewriterCopy(&r, i, (long long)length);
+        } else {
+            ok = inserted <= insertlen && length <= insertlen - inserted
+                 && writeAll(out_fd, added + inserted, length);
+            inserted += length;
+        }
+        j += length;
+    }
+
+    free(r.buffer);
+    return ok ? (long long)outlen : -1;
+}
+
+/*
+    Starts or stops recording the latency of MAGICadd, MAGICremove and
+    MAGICmap on an instance.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+    - enable : Non-zero to start recording, zero to stop and drop the histograms.
 
     Return:
     -------
-    - A pointer to the initialized MAGIC structure or NULL on failure.
+    - 0 on success, -1 on failure.
+
+    Behavior:
+    ---------
+    - Enabling an instance that already records keeps its histograms.
+    - Calls refused for invalid arguments are not counted.
+    - Clones start without recording.
 */
-MAGIC MAGICinit(void){
-    MAGIC m = (MAGIC)malloc(sizeof(struct magic));
+int MAGICrecordLatency(MAGIC m, int enable){
     if (!m)
-        return NULL;
-    m->shiftTree = RBTreeInit();
-    m->deleteTree = RBTreeInit();
-    m->timestamp = 0;
-    if (!m->shiftTree || !m->deleteTree){
-        free(m);
-        return NULL;
+        return -1;
+    if (!enable) {
+        free(m->latency);
+        m->latency = NULL;
+        return 0;
     }
-    return m;
+    if (!m->latency) {
+        latencyClockInit();
+        m->latency = (MAGICLatency*)calloc(1, sizeof(MAGICLatency));
+        if (!m->latency)
+            return -1;
+    }
+    return 0;
 }
 
 /*
-    Removes a sequence from the MAGIC structure by updating both shift and delete trees.
+    Copies the latency histograms of an instance.
 
     Arguments:
     ----------
     - m : The MAGIC structure.
-    - pos : The starting position of the sequence to remove.
-    - length : The length of the sequence to remove.
+    - latency : Receives the histograms.
+
+    Return:
+    -------
+    - 0 on success, -1 if the instance does not record latency.
 */
-void MAGICremove(MAGIC m, int pos, int length) {
-    if (!m || length <= 0) return;
+int MAGIClatency(MAGIC m, MAGICLatency *latency){
+    if (!m || !latency || !m->latency)
+        return -1;
+    memcpy(latency, m->latency, sizeof(MAGICLatency));
+    return 0;
+}
+
+/*
+    Adds the counts of one set of histograms to another.
+
+    Arguments:
+    ----------
+    - into : The histograms to add to.
+    - from : The histograms to add.
+*/
+void MAGIClatencyMerge(MAGICLatency *into, const MAGICLatency *from){
+    if (!into || !from)
+        return;
+    for (int op = 0; op < MAGIC_OP_COUNT; op++) {
+        for (int b = 0; b < MAGIC_LATENCY_BUCKETS; b++) {
+            into->counts[op][b] += from->counts[op][b];
+        }
+        into->total[op] += from->total[op];
+        into->sum[op] += from->sum[op];
+        if (from->max[op] > into->max[op])
+            into->max[op] = from->max[op];
+    }
+}
 
-    incrementTimestamp();
+/*
+    Returns the latency under which a given share of the operations ran.
 
-    RBTreeInsert(m->deleteTree, pos, -length, global_timestamp);
+    Arguments:
+    ----------
+    - latency : The histograms.
+    - op : The operation.
+    - percentile : The share of operations, in [0, 100].
 
-    RBTreeInsert(m->shiftTree, pos, -length, global_timestamp);
+    Return:
+    -------
+    - The highest latency, in nanoseconds, of the bucket holding that
+      percentile, never above the largest recorded value; 0 when nothing was
+      recorded.
+*/
+unsigned long long MAGIClatencyPercentile(const MAGICLatency *latency, MAGICOperation op, double percentile){
+    if (!latency || (int)op < 0 || op >= MAGIC_OP_COUNT || latency->total[op] == 0)
+        return 0;
+    if (percentile < 0)
+        percentile = 0;
+    if (percentile > 100)
+        percentile = 100;
 
+    unsigned long long rank = (unsigned long long)(percentile / 100 * (double)latency->total[op] + 0.5);
+    if (rank < 1)
+        rank = 1;
+    unsigned long long seen = 0;
+    for (int b = 0; b < MAGIC_LATENCY_BUCKETS; b++) {
+        seen += latency->counts[op][b];
+        if (seen >= rank) {
+            uint64_t value = latencyBucketValue(b);
+            return value < latency->max[op] ? value : latency->max[op];
+        }
+    }
+    return latency->max[op];
 }
 
 /*
-    Adds a sequence to the MAGIC structure by updating the shift tree.
+    Writes one histogram as a percentile distribution.
+
+    Arguments:
+    ----------
+    - latency : The histograms.
+    - op : The operation.
+    - out : The stream to write to.
+
+    Return:
+    -------
+    - 0 on success, -1 on invalid arguments or write error.
+
+    Behavior:
+    ---------
+    - Same layout as HdrHistogram's outputPercentileDistribution, values in
+      nanoseconds: one line per non-empty bucket with its highest value, the
+      share of operations at or below it, the count so far and 1/(1-share),
+      then mean, standard deviation, maximum and count.
+*/
+int MAGIClatencyExport(const MAGICLatency *latency, MAGICOperation op, FILE *out){
+    if (!latency || !out || (int)op < 0 || op >= MAGIC_OP_COUNT)
+        return -1;
+
+    const unsigned long long *counts = latency->counts[op];
+    unsigned long long total = latency->total[op], seen = 0;
+    double mean = total ? (double)latency->sum[op] / (double)total : 0, variance = 0;
+
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for (int b = 0; b < MAGIC_LATENCY_BUCKETS; b++) {
+        if (!counts[b])
+            continue;
+        seen += counts[b];
+        uint64_t value = latencyBucketValue(b);
+        if (value > latency->max[op])
+            value = latency->max[op];
+        double share = (double)seen / (double)total, gap = (double)value - mean;
+        variance += gap * gap * (double)counts[b];
+        if (seen < total) {
+            fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", (double)value, share, seen, 1 / (1 - share));
+        } else {
+            fprintf(out, "%12.3f %14.12f %10llu\n", (double)value, share, seen);
+        }
+    }
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean, total ? latencySqrt(variance / (double)total) : 0);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", (double)latency->max[op], total);
+    fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n", MAGIC_LATENCY_BUCKETS, LATENCY_SUB_BUCKETS);
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+    Reports the size of the index behind a MAGIC instance.
 
     Arguments:
     ----------
     - m : The MAGIC structure.
-    - pos : The starting position of the sequence to add.
-    - length : The length of the sequence to add.
+    - stats : Filled with the statistics.
+
+    Behavior:
+    ---------
+    - Walks the whole index, so the cost is linear in the number of edits.
 */
-void MAGICadd(MAGIC m, int pos, int length) {
-    if (!m || length <= 0) return;
-    if(pos < 0) return;
+void MAGICstats(MAGIC m, MAGICStats *stats){
+    if (!m || !stats)
+        return;
+
+    stats->engine = m->engine->name;
+    stats->edits = m->timestamp;
+    m->engine->stats(m, stats);
+    if (m->latency)
+        stats->bytes += sizeof(MAGICLatency);
+}
 
-    incrementTimestamp();
+/*
+    Lays out the index of a MAGIC instance for faster lookups.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
 
-    RBTreeInsert(m->shiftTree, pos, length, global_timestamp);
+    Return:
+    -------
+    - 0 on success, -1 if the engine cannot move its nodes (only the default
+      engine can) or memory is exhausted, in which case m is left unchanged.
 
+    Behavior:
+    ---------
+    - Nodes allocated one by one as edits arrive end up scattered over the
+      heap, and each level of a descent misses the cache. This moves the
+      nodes of both trees into one block in van Emde Boas order, without
+      changing the shape of the trees: mappings stay the same.
+    - Runs in O(n) and briefly needs a second copy of the nodes. Later edits
+      allocate nodes as usual, so it can be called again in quiet moments.
+    - The heap engine keeps its per-node layout as a reference point, and
+      the nodes of the persistent engine are shared with its checkpoints,
+      clones and history.
+*/
+int MAGICoptimize(MAGIC m){
+    if (!m || !m->engine->optimize)
+        return -1;
+    return m->engine->optimize(m) ? 0 : -1;
 }
 
+/*
+    Saves the current state of a MAGIC instance.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure.
+
+    Return:
+    -------
+    - A checkpoint to pass to `MAGICrollback()`, or NULL on failure.
+
+    Behavior:
+    ---------
+    - O(1) with the persistent engine, a copy of the index otherwise.
+*/
+MAGICCheckpoint MAGICcheckpoint(MAGIC m){
+    if (!m)
+        return NULL;
+
+    MAGICCheckpoint cp = (MAGICCheckpoint)malloc(sizeof(struct magicCheckpoint));
+    if (!cp)
+        return NULL;
+    cp->engine = m->engine;
+    cp->timestamp = m->timestamp;
+    cp->progression = m->progression;
+    if (!m->engine->snapshot(m, cp)){
+        free(cp);
+        return NULL;
+    }
+    return cp;
+}
 
 /*
-    Maps a position in the source stream to the destination stream, considering shifts and deletions.
+    Restores a MAGIC instance to the state saved in a checkpoint.
 
     Arguments:
     ----------
     - m : The MAGIC structure.
-    - direction : The mapping direction.
-    - pos : The position to map.
+    - cp : A checkpoint taken on an instance of the same engine (m itself,
+           one of its clones, or any instance it was cloned from).
 
     Return:
     -------
-    - Mapped position or -1 if no mapping is found.
+    - 0 on success, -1 if the engines differ or memory is exhausted (m is
+      left unchanged in that case).
+
+    Behavior:
+    ---------
+    - The checkpoint stays valid and can be rolled back to again.
 */
-int MAGICmap(MAGIC m, MAGICDirection direction, int pos){
-    if (!m || pos < 0)
+int MAGICrollback(MAGIC m, MAGICCheckpoint cp){
+    if (!m || !cp || cp->engine != m->engine)
         return -1;
 
-    int shiftedPos = RBTreeFindMapping(m->shiftTree, m->deleteTree, pos,direction);
-    
-    return shiftedPos;
+    if (!m->engine->restore(m, &cp->trees[0], &cp->trees[1], cp->timestamp))
+        return -1;
+    m->progression = cp->progression;
+    m->timestamp = cp->timestamp;
+    return 0;
+}
+
+/*
+    Frees a checkpoint.
+
+    Arguments:
+    ----------
+    - cp : The checkpoint to free (NULL is allowed).
+*/
+void MAGICcheckpointFree(MAGICCheckpoint cp){
+    if (!cp)
+        return;
+
+    cp->engine->release(cp);
+    free(cp);
+}
+
+/*
+    Creates an independent copy of a MAGIC instance.
+
+    Arguments:
+    ----------
+    - m : The MAGIC structure to copy.
+
+    Return:
+    -------
+    - A new MAGIC instance with the same engine and edits, or NULL on failure.
+
+    Behavior:
+    ---------
+    - O(1) with the persistent engine, a copy of the index otherwise.
+    - The history of past versions is not copied.
+*/
+MAGIC MAGICclone(MAGIC m){
+    if (!m)
+        return NULL;
+
+    MAGIC copy = MAGICinitWithEngine((MAGICEngineKind)(m->engine - engines));
+    if (!copy)
+        return NULL;
+    if (!copy->engine->restore(copy, m->shiftTree, m->deleteTree, m->timestamp)){
+        MAGICdestroy(copy);
+        return NULL;
+    }
+    copy->progression = m->progression;
+    copy->timestamp = m->timestamp;
+    return copy;
 }
 
 /*
@@ -623,7 +4843,9 @@ void MAGICdestroy(MAGIC m){
     if (!m)
         return;
 
-    RBTreeDestroy(m->shiftTree);
-    RBTreeDestroy(m->deleteTree);
+    if (PROBE_ENABLED(destroy))
+        PROBE2(destroy, m->timestamp, probeDepth(m));
+    m->engine->destroy(m);
+    free(m->latency);
     free(m);
 }
@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <string.h>
 #include "magic.h"
 
+// Engine under test, selected by name on the command line
+static MAGICEngineKind engine = MAGIC_ENGINE_RBTREE;
+
 // Displays IN -> OUT mappings for a predefined list of positions
 void print_in_to_out(MAGIC m) {
     // Positions to check for mapping behavior
@@ -18,7 +22,7 @@ void print_in_to_out(MAGIC m) {
 
 // === Basic test case: initial mapping with no transformations ===
 void test_mapping(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     printf("==== Test 1: Initial mapping (no transformations) ====\n");
     print_in_to_out(m);
@@ -69,7 +73,7 @@ void test_mapping(void) {
 
 // Test multiple additions of bytes at various positions and lengths
 void test_additions(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     // Add bytes at different positions with varying lengths
     MAGICadd(m, 0, 5);
@@ -100,7 +104,7 @@ void test_additions(void) {
 
 // Test multiple removals of bytes at various positions and lengths
 void test_removals(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     // Remove bytes at different positions with varying lengths
     MAGICremove(m, 0, 2);
@@ -130,7 +134,7 @@ void test_removals(void) {
 
 // Test adding and then fully removing a segment
 void test_full_segment_removal(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     // Add a segment of 10 bytes at position 30
     MAGICadd(m, 30, 10);
@@ -149,7 +153,7 @@ void test_full_segment_removal(void) {
 
 // Test mixed additions and removals with non-overlapping ranges
 void test_mixed_operations_no_overlap(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     // Add bytes at various positions (no overlap with removals)
     MAGICadd(m, 0, 4);
@@ -175,7 +179,7 @@ void test_mixed_operations_no_overlap(void) {
 
 // Test mixed additions and removals with overlapping regions
 void test_mixed_operations_with_overlap(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     // Add bytes at various positions
     MAGICadd(m, 0, 5);
@@ -198,7 +202,7 @@ void test_mixed_operations_with_overlap(void) {
 
 // Test reverse mapping functionality (OUT -> IN)
 void test_reverse_mapping(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     // Add segments at different positions
     MAGICadd(m, 0, 5);
@@ -228,7 +232,7 @@ void test_reverse_mapping(void) {
 
 // Test edge cases including out-of-bounds and overlapping removals
 void test_edge_cases(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     printf("==== Test des Cas de Bord ====\n");
 
@@ -259,7 +263,7 @@ void test_edge_cases(void) {
 
 // Test large operations with many additions and removals
 void test_large_operations(void) {
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
     
     printf("\n==== Test des Opérations Larges ====\n");
 
@@ -288,7 +292,7 @@ void test_large_operations(void) {
 // Test invalid positions (negative and out-of-bounds)
 void test_invalid_positions(void) {
     printf("=== test_invalid_positions ===\n");
-    MAGIC m = MAGICinit();
+    MAGIC m = MAGICinitWithEngine(engine);
 
     MAGICadd(m, 0, 10);
 
@@ -300,8 +304,18 @@ void test_invalid_positions(void) {
     MAGICdestroy(m);
 }
 
-int main(void) {
-    
+int main(int argc, char **argv) {
+    // Optional engine name, so that the output of every engine can be diffed
+    if (argc > 1) {
+        for (engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+            if (strcmp(argv[1], MAGICengineName(engine)) == 0) break;
+        }
+        if (engine == MAGIC_ENGINE_COUNT) {
+            fprintf(stderr, "Unknown engine: %s\n", argv[1]);
+            return 1;
+        }
+    }
+
     // Basic functional tests
     printf("\n=== Testing Mapping ===\n");
     test_mapping();
@@ -348,4 +362,7 @@ int main(void) {
 To compile and run:
 gcc -Wall -pedantic -std=c11 -O3 -o test_final test_final.c magic.c
 ./test_final
+
+Every engine must print the same output:
+./test_final rbtree-heap | diff - <(./test_final)
 */
@@ -0,0 +1,1086 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "magic.h"
+#include "magic_streams.h"
+#include "magic_checksum.h"
+#include "magic_seq.h"
+
+/*
+ * Benchmark matrix for the MAGIC library.
+ *
+ * Each section measures one workload on every engine and prints one line per
+ * size so that engines and build flags can be compared side by side.
+ */
+
+// Returns a monotonic timestamp in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Returns the number of heap bytes currently in use (0 when unknown)
+static long heap_in_use(void) {
+#ifdef __GLIBC__
+    return (long)mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// Applies `edits` mixed additions and removals to m, spread over the stream
+static void apply_edits(MAGIC m, int edits) {
+    for (int i = 0; i < edits; i++) {
+        if (i % 3 == 2) {
+            MAGICremove(m, i * 37, 3);
+        } else {
+            MAGICadd(m, i * 41, 5);
+        }
+    }
+}
+
+// === Connection lifecycle: init, a few edits, a few lookups, destroy ===
+static void bench_connections(MAGICEngineKind engine) {
+    static const int sizes[] = {0, 1, 2, 4, 8, 12, 16, 24, 32, 64, 1024};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    printf("== Connection lifecycle (init + edits + 16 maps + destroy), %s ==\n",
+           MAGICengineName(engine));
+    printf("%8s %14s %16s\n", "edits", "ns/connection", "bytes/connection");
+    for (int s = 0; s < nsizes; s++) {
+        int edits = sizes[s];
+        int rounds = edits > 64 ? 1000 : 20000;
+        volatile int sink = 0;
+
+        // Best of 5, so that the sizes can be compared across engines
+        double elapsed = 0;
+        for (int repeat = 0; repeat < 5; repeat++) {
+            double start = now_ns();
+            for (int r = 0; r < rounds; r++) {
+                MAGIC m = MAGICinitWithEngine(engine);
+                apply_edits(m, edits);
+                for (int q = 0; q < 16; q++) {
+                    sink += MAGICmap(m, q & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, q * 53);
+                }
+                MAGICdestroy(m);
+            }
+            double ns = now_ns() - start;
+            if (repeat == 0 || ns < elapsed)
+                elapsed = ns;
+        }
+
+        // Memory held by a batch of live connections
+        enum { LIVE = 256 };
+        MAGIC live[LIVE];
+        long before = heap_in_use();
+        for (int i = 0; i < LIVE; i++) {
+            live[i] = MAGICinitWithEngine(engine);
+            apply_edits(live[i], edits);
+        }
+        long bytes = (heap_in_use() - before) / LIVE;
+        for (int i = 0; i < LIVE; i++) {
+            MAGICdestroy(live[i]);
+        }
+
+        printf("%8d %14.1f %16ld\n", edits, elapsed / rounds, bytes);
+        (void)sink;
+    }
+}
+
+// === Checkpoints: cost of taking K checkpoints during N edits, and memory kept ===
+static void bench_checkpoints(MAGICEngineKind engine) {
+    enum { EDITS = 20000 };
+    static const int counts[] = {0, 1, 8, 64};
+    int ncounts = sizeof(counts) / sizeof(counts[0]);
+
+    printf("== %d edits with K live checkpoints, %s ==\n", EDITS, MAGICengineName(engine));
+    printf("%8s %14s %16s %18s\n", "K", "ns/edit", "ns/checkpoint", "bytes/checkpoint");
+    for (int c = 0; c < ncounts; c++) {
+        int k = counts[c];
+        MAGICCheckpoint cps[64];
+        double checkpointNs = 0;
+
+        long before = heap_in_use();
+        double start = now_ns();
+        MAGIC m = MAGICinitWithEngine(engine);
+        int taken = 0;
+        for (int i = 0; i < EDITS; i++) {
+            int pos = (int)((i * 2654435761u) % 1000000);
+            if (i % 3 == 2) {
+                MAGICremove(m, pos, 3);
+            } else {
+                MAGICadd(m, pos, 5);
+            }
+            if (taken < k && (i + 1) % (EDITS / k) == 0) {
+                double t = now_ns();
+                cps[taken++] = MAGICcheckpoint(m);
+                checkpointNs += now_ns() - t;
+            }
+        }
+        double elapsed = now_ns() - start - checkpointNs;
+        long withCheckpoints = heap_in_use() - before;
+
+        for (int i = 0; i < taken; i++) {
+            MAGICcheckpointFree(cps[i]);
+        }
+        long alone = heap_in_use() - before;
+        MAGICdestroy(m);
+
+        printf("%8d %14.1f %16.1f %18ld\n", k, elapsed / EDITS,
+               taken ? checkpointNs / taken : 0.0,
+               taken ? (withCheckpoints - alone) / taken : 0L);
+    }
+}
+
+// === History: queries against past versions versus the current one ===
+static void bench_history(void) {
+    enum { EDITS = 100000, QUERIES = 1000000 };
+    volatile int sink = 0;
+
+    printf("== History of %d edits, persistent ==\n", EDITS);
+    long before = heap_in_use();
+    MAGIC m = MAGICinitWithEngine(MAGIC_ENGINE_PERSISTENT);
+    MAGICenableHistory(m);
+    double start = now_ns();
+    apply_edits(m, EDITS);
+    double editNs = (now_ns() - start) / EDITS;
+    long bytes = heap_in_use() - before;
+
+    start = now_ns();
+    for (int q = 0; q < QUERIES; q++) {
+        sink += MAGICmap(m, STREAM_IN_OUT, (int)((q * 7919u) % (EDITS * 40)));
+    }
+    double currentNs = (now_ns() - start) / QUERIES;
+
+    start = now_ns();
+    for (int q = 0; q < QUERIES; q++) {
+        int version = (int)((q * 2654435761u) % EDITS);
+        sink += MAGICmapAt(m, version, STREAM_IN_OUT, (int)((q * 7919u) % (EDITS * 40)));
+    }
+    double pastNs = (now_ns() - start) / QUERIES;
+
+    // The former workaround: replay the log up to the version
+    start = now_ns();
+    MAGIC replay = MAGICinit();
+    apply_edits(replay, EDITS / 2);
+    sink += MAGICmap(replay, STREAM_IN_OUT, 12345);
+    MAGICdestroy(replay);
+    double replayNs = now_ns() - start;
+
+    printf("%-28s %12.1f\n", "ns/edit with history", editNs);
+    printf("%-28s %12ld\n", "bytes with history", bytes);
+    printf("%-28s %12.1f\n", "ns/map current version", currentNs);
+    printf("%-28s %12.1f\n", "ns/map past version", pastNs);
+    printf("%-28s %12.1f\n", "ns/replay to mid version", replayNs);
+    MAGICdestroy(m);
+    (void)sink;
+}
+
+// === Parallel batch mapping: scaling curve over thread counts ===
+static void bench_parallel_map(void) {
+    enum { EDITS = 1000000, QUERIES = 10000000 };
+    static const int threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+    int ncounts = sizeof(threadCounts) / sizeof(threadCounts[0]);
+
+    MAGIC m = MAGICinit();
+    apply_edits(m, EDITS);
+    int *positions = malloc(QUERIES * sizeof(int));
+    int *results = malloc(QUERIES * sizeof(int));
+    if (!positions || !results) {
+        free(positions);
+        free(results);
+        MAGICdestroy(m);
+        return;
+    }
+    printf("== Parallel batch map, %d queries, %d edits ==\n", QUERIES, EDITS);
+    printf("%8s %8s %8s %14s %10s\n", "queries", "threads", "used", "ns/query", "speedup");
+    for (int sorted = 1; sorted >= 0; sorted--) {
+        unsigned x = 3;
+        for (int i = 0; i < QUERIES; i++) {
+            x = x * 1103515245u + 12345u;
+            positions[i] = sorted ? (int)((long)i * EDITS * 40 / QUERIES) : (int)(x % ((unsigned)EDITS * 40));
+        }
+        double single = 0;
+        for (int c = 0; c < ncounts; c++) {
+            double start = now_ns();
+            int used = MAGICmapManyParallel(m, STREAM_IN_OUT, positions, results, QUERIES, threadCounts[c]);
+            double elapsed = (now_ns() - start) / QUERIES;
+            if (c == 0) single = elapsed;
+            printf("%8s %8d %8d %14.2f %10.2f\n", sorted ? "sorted" : "random", threadCounts[c], used, elapsed,
+                   single / elapsed);
+        }
+    }
+
+    free(positions);
+    free(results);
+    MAGICdestroy(m);
+}
+
+// === Bulk build from an edit log versus applying it edit by edit ===
+static void bench_build(void) {
+    enum { EDITS = 2000000 };
+
+    MAGICEdit *edits = malloc(EDITS * sizeof(MAGICEdit));
+    if (!edits) return;
+    for (int i = 0; i < EDITS; i++) {
+        edits[i].kind = i % 3 == 2 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD;
+        edits[i].pos = (int)((i * 2654435761u) % 100000000);
+        edits[i].length = 1 + i % 7;
+    }
+
+    printf("== Build from a log of %d edits ==\n", EDITS);
+    double start = now_ns();
+    MAGIC m = MAGICinit();
+    for (int i = 0; i < EDITS; i++) {
+        if (edits[i].kind == MAGIC_EDIT_REMOVE) {
+            MAGICremove(m, edits[i].pos, edits[i].length);
+        } else {
+            MAGICadd(m, edits[i].pos, edits[i].length);
+        }
+    }
+    double single = now_ns() - start;
+    MAGICdestroy(m);
+    printf("%-20s %10.1f ms\n", "MAGICadd/remove", single / 1e6);
+
+    start = now_ns();
+    m = MAGICinit();
+    MAGICapplyEdits(m, edits, EDITS);
+    double elapsed = now_ns() - start;
+    MAGICdestroy(m);
+    printf("%-20s %10.1f ms (%.2fx)\n", "MAGICapplyEdits", elapsed / 1e6, single / elapsed);
+
+    start = now_ns();
+    m = MAGICbuild(edits, EDITS);
+    elapsed = now_ns() - start;
+    MAGICdestroy(m);
+    printf("%-20s %10.1f ms (%.2fx)\n", "MAGICbuild", elapsed / 1e6, single / elapsed);
+    free(edits);
+}
+
+// === Multi-stream reprocessing: throughput and load balance on a skewed log ===
+static void bench_streams(void) {
+    enum { RECORDS = 2000000, STREAMS = 100000 };
+    static const int threadCounts[] = {1, 2, 4, 8};
+    int ncounts = sizeof(threadCounts) / sizeof(threadCounts[0]);
+
+    MAGICStreamRecord *records = malloc(RECORDS * sizeof(MAGICStreamRecord));
+    if (!records) return;
+    for (int i = 0; i < RECORDS; i++) {
+        // A quarter of the records go to 8 heavy streams, the rest are spread thin
+        records[i].stream = i % 4 == 0 ? (unsigned long)(i / 4 % 8)
+                                       : 8 + (unsigned long)((i * 2654435761u) % STREAMS);
+        records[i].edit.kind = i % 3 == 2 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD;
+        records[i].edit.pos = (int)((i * 7919u) % 1000000);
+        records[i].edit.length = 1 + i % 7;
+    }
+
+    printf("== Reprocess %d records, 8 heavy streams and many light ones ==\n", RECORDS);
+    printf("%8s %14s %12s %10s %10s\n", "threads", "edits/s", "streams", "steals", "max/mean");
+    for (int c = 0; c < ncounts; c++) {
+        MAGICStreamReport report;
+        if (MAGICprocessStreams(records, RECORDS, threadCounts[c], NULL, NULL, &report) != 0) break;
+        printf("%8d %14.0f %12zu %10zu %10.2f\n", report.threads, report.editsPerSecond,
+               report.streams, report.steals,
+               report.meanBusySeconds > 0 ? report.maxBusySeconds / report.meanBusySeconds : 1.0);
+    }
+    free(records);
+}
+
+// === Mapping from two versions: diff throughput on multi-MB buffers ===
+static void bench_from_diff(void) {
+    enum { LEN = 8 << 20 };
+    static const int editCounts[] = {0, 1, 100, 1000, 10000};
+    int ncounts = sizeof(editCounts) / sizeof(editCounts[0]);
+
+    unsigned char *a = malloc(LEN), *b = malloc(LEN + LEN / 8);
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return;
+    }
+    unsigned x = 12345;
+    for (int i = 0; i < LEN; i++) {
+        x = x * 1103515245u + 12345u;
+        a[i] = (unsigned char)(x >> 24);
+    }
+
+    printf("== MAGICfromDiff on %d MB ==\n", LEN >> 20);
+    printf("%8s %12s %10s %10s\n", "hunks", "ms", "MB/s", "edits");
+    for (int c = 0; c < ncounts; c++) {
+        // Spread the hunks evenly: drop 3 bytes and insert 5 at each
+        int hunks = editCounts[c], blen = 0, ai = 0;
+        for (int h = 0; h < hunks; h++) {
+            int start = (int)((long)LEN * (2 * h + 1) / (2 * hunks));
+            while (ai < start) b[blen++] = a[ai++];
+            ai += 3;
+            for (int i = 0; i < 5; i++) b[blen++] = (unsigned char)(a[ai + i] ^ 0x5a);
+        }
+        while (ai < LEN) b[blen++] = a[ai++];
+
+        double start = now_ns();
+        MAGIC m = MAGICfromDiff(a, LEN, b, blen);
+        double elapsed = now_ns() - start;
+        printf("%8d %12.2f %10.0f %10d\n", hunks, elapsed / 1e6, LEN / (elapsed / 1e3), m ? MAGICversion(m) : -1);
+        MAGICdestroy(m);
+    }
+    free(a);
+    free(b);
+}
+
+// Input and output of the streaming rewrite, both in memory
+typedef struct {
+    const unsigned char *in;
+    size_t inlen, offset;
+    unsigned char *out;
+    size_t outlen;
+} BenchIo;
+
+static long bench_read(void *ctx, void *buf, size_t len) {
+    BenchIo *io = ctx;
+    size_t n = io->inlen - io->offset < len ? io->inlen - io->offset : len;
+    memcpy(buf, io->in + io->offset, n);
+    io->offset += n;
+    return (long)n;
+}
+
+static int bench_write(void *ctx, const void *buf, size_t len) {
+    BenchIo *io = ctx;
+    memcpy(io->out + io->outlen, buf, len);
+    io->outlen += len;
+    return 0;
+}
+
+// === Rewriting byte buffers: run copies against a per-byte MAGICmap loop ===
+static void bench_apply(void) {
+    enum { LEN = 64 << 20 };
+    static const int editCounts[] = {0, 10, 1000};
+    int ncounts = sizeof(editCounts) / sizeof(editCounts[0]);
+
+    unsigned char *in = malloc(LEN), *out = malloc(LEN + LEN / 8);
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return;
+    }
+    for (int i = 0; i < LEN; i++) in[i] = (unsigned char)i;
+
+    printf("== MAGICapply on %d MB (MB/s) ==\n", LEN >> 20);
+    printf("%8s %12s %12s %12s\n", "edits", "apply", "stream", "per-byte");
+    for (int c = 0; c < ncounts; c++) {
+        // Edits from left to right, as a rewriting proxy records them
+        MAGIC m = MAGICinit();
+        int edits = editCounts[c];
+        for (int e = 0; e < edits; e++) {
+            int pos = (int)((long)LEN * (2 * e + 1) / (2 * edits));
+            if (e % 2) {
+                MAGICremove(m, pos, 16);
+            } else {
+                MAGICadd(m, pos, 32);
+            }
+        }
+        size_t outlen = MAGICoutputLength(m, LEN);
+
+        double start = now_ns();
+        MAGICapply(m, in, LEN, NULL, NULL, out);
+        double apply = now_ns() - start;
+
+        BenchIo io = {in, LEN, 0, out, 0};
+        start = now_ns();
+        MAGICapplyStream(m, LEN, bench_read, bench_write, NULL, &io, 0);
+        double stream = now_ns() - start;
+
+        start = now_ns();
+        for (size_t j = 0; j < outlen; j++) {
+            int i = MAGICmap(m, STREAM_OUT_IN, (int)j);
+            out[j] = i >= 0 && i < LEN ? in[i] : 0;
+        }
+        double naive = now_ns() - start;
+
+        printf("%8d %12.0f %12.0f %12.0f\n", edits, outlen / (apply / 1e3), outlen / (stream / 1e3), outlen / (naive / 1e3));
+        MAGICdestroy(m);
+    }
+    free(in);
+    free(out);
+}
+
+// === Zero-copy output: iovec lists against copying into a send buffer ===
+static void bench_iovec(void) {
+    enum { LEN = 64 << 20, CHUNK = 64 << 10, IOV = 1024 };
+    static const int editCounts[] = {10, 100, 1000};
+    int ncounts = sizeof(editCounts) / sizeof(editCounts[0]);
+    static struct iovec iov[IOV];
+
+    unsigned char *in = malloc(LEN), *out = malloc(LEN + LEN / 8), *inserts = malloc(LEN / 8);
+    FILE *sink = fopen("/dev/null", "wb");
+    if (!in || !out || !inserts || !sink) {
+        free(in);
+        free(out);
+        free(inserts);
+        if (sink) fclose(sink);
+        return;
+    }
+    int fd = fileno(sink);
+    for (int i = 0; i < LEN; i++) in[i] = (unsigned char)i;
+    memset(inserts, 'x', LEN / 8);
+
+    printf("== Sending %d MB rewritten in %d KB chunks ==\n", LEN >> 20, CHUNK >> 10);
+    printf("%8s %12s %12s %12s %12s %12s\n", "edits", "copy MB/s", "copied/B", "iovec MB/s", "copied/B", "entries");
+    for (int c = 0; c < ncounts; c++) {
+        MAGIC m = MAGICinit();
+        int edits = editCounts[c];
+        for (int e = 0; e < edits; e++) {
+            int pos = (int)((long)LEN * (2 * e + 1) / (2 * edits));
+            if (e % 2) {
+                MAGICremove(m, pos, 16);
+            } else {
+                MAGICadd(m, pos, 32);
+            }
+        }
+        size_t outlen = MAGICoutputLength(m, LEN);
+
+        // Rewrite into a buffer, then send it
+        double start = now_ns();
+        MAGICapply(m, in, LEN, NULL, NULL, out);
+        for (size_t done = 0; done < outlen; ) {
+            ssize_t n = write(fd, out + done, outlen - done);
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        double copy = now_ns() - start;
+
+        // Send straight from the input chunks and the insert storage
+        MAGICIovecCursor cursor = {LEN, 0, 0, 0};
+        long entries = 0;
+        size_t copied = 0;
+        start = now_ns();
+        int count = 0;
+        for (size_t chunk = 0; chunk < LEN && count >= 0; chunk += CHUNK) {
+            // Keep the tail of the previous chunk, as MAGICapplyStream does
+            size_t keep = chunk > 0 ? CHUNK / 8 : 0;
+            cursor.chunkStart = chunk - keep;
+            do {
+                count = MAGICtoIovec(m, &cursor, in + chunk - keep, CHUNK + keep, inserts, LEN / 8, iov, IOV);
+                for (int k = 0; k < count; k++) {
+                    // Bytes that come from neither the input nor the insert storage were copied
+                    const unsigned char *base = iov[k].iov_base;
+                    if (!(base >= in && base < in + LEN) && !(base >= inserts && base < inserts + LEN / 8))
+                        copied += iov[k].iov_len;
+                }
+                if (count > 0 && writev(fd, iov, count) < 0) count = -1;
+                entries += count > 0 ? count : 0;
+            } while (count == IOV);
+        }
+        double vec = now_ns() - start;
+
+        // Every byte sent by the first path was copied into out
+        if (count < 0) {
+            printf("%8d %12.0f %12.2f %12s\n", edits, outlen / (copy / 1e3), 1.0, "refused");
+            MAGICdestroy(m);
+            continue;
+        }
+        printf("%8d %12.0f %12.2f %12.0f %12.2f %12ld\n", edits, outlen / (copy / 1e3), 1.0,
+               cursor.output / (vec / 1e3), cursor.output ? (double)copied / cursor.output : 0.0, entries);
+        MAGICdestroy(m);
+    }
+    fclose(sink);
+    free(in);
+    free(out);
+    free(inserts);
+}
+
+// Reads an input file for MAGICapplyStream
+static long bench_read_fd(void *ctx, void *buf, size_t len) {
+    int *fds = ctx;
+    return (long)read(fds[0], buf, len);
+}
+
+static int bench_write_fd(void *ctx, const void *buf, size_t len) {
+    int *fds = ctx;
+    return write(fds[1], buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+// Process CPU time, user and system, in seconds
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// === File rewriting: kernel-side copies against a read/write loop ===
+static void bench_rewrite_file(void) {
+    enum { BLOCK = 1 << 20, EDITS = 1000 };
+    const long long len = INT_MAX & ~(long long)(BLOCK - 1); // Largest MAGICapplyStream takes
+
+    FILE *input = tmpfile(), *output = tmpfile();
+    unsigned char *block = malloc(BLOCK);
+    if (!input || !output || !block) {
+        if (input) fclose(input);
+        if (output) fclose(output);
+        free(block);
+        return;
+    }
+    for (int i = 0; i < BLOCK; i++) block[i] = (unsigned char)i;
+    for (long long done = 0; done < len; done += BLOCK) {
+        if (fwrite(block, 1, BLOCK, input) != BLOCK) break;
+    }
+    fflush(input);
+
+    MAGIC m = MAGICinit();
+    for (int e = 0; e < EDITS; e++) {
+        int pos = (int)(len * (2 * e + 1) / (2 * EDITS));
+        if (e % 2) {
+            MAGICremove(m, pos, 16);
+        } else {
+            MAGICadd(m, pos, 32);
+        }
+    }
+
+    // Size the insert storage: output positions without an input byte
+    size_t outlen = MAGICoutputLength(m, (size_t)len), insertlen = 0;
+    for (size_t j = 0; j < outlen; ) {
+        int run;
+        int i = MAGICmapRun(m, STREAM_OUT_IN, (int)j, &run);
+        size_t length = (size_t)run < outlen - j ? (size_t)run : outlen - j;
+        if (i < 0 || i >= len) insertlen += length;
+        j += length;
+    }
+    unsigned char *inserts = calloc(insertlen + 1, 1);
+
+    printf("== Rewriting a %lld MB file with %d edits ==\n", len >> 20, EDITS);
+    printf("%-22s %10s %10s %10s\n", "method", "s", "MB/s", "cpu s");
+    for (int method = 0; method < 2 && inserts; method++) {
+        int fds[2] = {fileno(input), fileno(output)};
+        if (ftruncate(fds[1], 0) != 0 || lseek(fds[0], 0, SEEK_SET) != 0 || lseek(fds[1], 0, SEEK_SET) != 0)
+            break;
+
+        double cpu = cpu_seconds(), start = now_ns();
+        long long written = method == 0
+            ? MAGICrewriteFile(m, fds[0], fds[1], inserts, insertlen)
+            : MAGICapplyStream(m, (size_t)len, bench_read_fd, bench_write_fd, NULL, fds, 0);
+        double elapsed = (now_ns() - start) / 1e9;
+        cpu = cpu_seconds() - cpu;
+        printf("%-22s %10.2f %10.0f %10.2f%s\n", method == 0 ? "MAGICrewriteFile" : "read/write loop",
+               elapsed, written / 1e6 / elapsed, cpu, written < 0 ? " (failed)" : "");
+    }
+
+    MAGICdestroy(m);
+    fclose(input);
+    fclose(output);
+    free(block);
+    free(inserts);
+}
+
+// === Checksums after a rewrite: adjustment against full recomputation ===
+static void bench_checksum(void) {
+    enum { LEN = 64 << 20 };
+    static const char *names[] = {"overwrite 16 mid", "insert 3 at 100", "100 spread"};
+
+    unsigned char *in = malloc(LEN), *out = malloc(LEN + LEN / 8), *inserts = calloc(LEN / 8, 1);
+    if (!in || !out || !inserts) {
+        free(in);
+        free(out);
+        free(inserts);
+        return;
+    }
+    for (int i = 0; i < LEN; i++) in[i] = (unsigned char)(i * 2654435761u >> 24);
+
+    printf("== Checksum of a rewritten %d MB payload ==\n", LEN >> 20);
+    printf("%-16s %-9s %12s %12s %12s\n", "edits", "checksum", "full ms", "adjust ms", "bytes read");
+    for (int c = 0; c < 3; c++) {
+        MAGIC m = MAGICinit();
+        if (c == 0) {
+            MAGICadd(m, LEN / 2, 16);
+            MAGICremove(m, LEN / 2 + 16, 16);
+        } else if (c == 1) {
+            MAGICadd(m, 100, 3);
+        } else {
+            for (int e = 0; e < 100; e++) {
+                int pos = (int)((long)LEN * (2 * e + 1) / 200);
+                if (e % 2) {
+                    MAGICremove(m, pos, 16);
+                } else {
+                    MAGICadd(m, pos, 32);
+                }
+            }
+        }
+        size_t outlen = (size_t)MAGICapply(m, in, LEN, NULL, NULL, out);
+
+        for (int kind = 0; kind < 2; kind++) {
+            uint32_t checksum = MAGICchecksum(kind, in, LEN), adjusted;
+            double start = now_ns();
+            uint32_t full = MAGICchecksum(kind, out, outlen);
+            double fullTime = now_ns() - start;
+            start = now_ns();
+            long long read = MAGICadjustChecksum(m, kind, checksum, in, LEN, inserts, LEN / 8, &adjusted);
+            double adjustTime = now_ns() - start;
+            printf("%-16s %-9s %12.3f %12.3f %12lld%s\n", names[c], kind ? "crc32" : "internet",
+                   fullTime / 1e6, adjustTime / 1e6, read, adjusted == full ? "" : " (mismatch)");
+        }
+        MAGICdestroy(m);
+    }
+    free(in);
+    free(out);
+    free(inserts);
+}
+
+// === TCP sequence-space translation: lookups against edits in the window ===
+static void bench_seq(void) {
+    static const int windowEdits[] = {16, 1024, 65536};
+    enum { LOOKUPS = 4000000, GAP = 1000 };
+
+    printf("== Sequence-space lookups (wrapping ISN) ==\n");
+    printf("%10s %14s %14s %16s\n", "edits", "seq ns/op", "ack ns/op", "stream ns/edit");
+    for (int c = 0; c < 3; c++) {
+        int edits = windowEdits[c];
+        const uint32_t isn = 0xfff00000u;
+        MAGICSeq s = MAGICseqInit(isn, (uint32_t)edits * GAP + GAP);
+        for (int e = 0; e < edits; e++) {
+            MAGICseqAdd(s, isn + (uint32_t)e * GAP + GAP / 2, 1 + e % 7);
+        }
+
+        volatile uint32_t sink = 0;
+        uint32_t x = 1, span = (uint32_t)edits * GAP;
+        double start = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            x = x * 1103515245u + 12345u;
+            sink += MAGICseqMap(s, STREAM_IN_OUT, isn + x % span);
+        }
+        double seqTime = now_ns() - start;
+        start = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            x = x * 1103515245u + 12345u;
+            sink += MAGICseqMap(s, STREAM_OUT_IN, isn + x % span);
+        }
+        double ackTime = now_ns() - start;
+        MAGICseqDestroy(s);
+
+        // A long connection: one edit per segment, a window of `edits` segments, seq and ack per edit
+        s = MAGICseqInit(isn, (uint32_t)edits * GAP);
+        uint32_t seq = isn;
+        start = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            seq += GAP;
+            MAGICseqAdd(s, seq, 1 + i % 7);
+            sink += MAGICseqMap(s, STREAM_IN_OUT, seq + 1);
+            sink += MAGICseqMap(s, STREAM_OUT_IN, seq - GAP);
+        }
+        double streamTime = now_ns() - start;
+        printf("%10d %14.1f %14.1f %16.1f\n", edits, seqTime / LOOKUPS, ackTime / LOOKUPS, streamTime / LOOKUPS);
+        MAGICseqDestroy(s);
+    }
+}
+
+// === Latency recording: cost per operation and the tail it reveals ===
+// Build with -DMAGIC_LATENCY_TSC to compare the time stamp counter with clock_gettime
+static void bench_latency(void) {
+    static const int sizes[] = {100, 10000, 1000000};
+    enum { OPS = 1000000 };
+
+    printf("== Latency recording (%s) ==\n",
+#ifdef MAGIC_LATENCY_TSC
+           "tsc"
+#else
+           "clock_gettime"
+#endif
+    );
+    printf("%10s %12s %12s %12s %10s %10s %10s\n", "edits", "off ns/op", "on ns/op", "overhead", "map p50", "map p99", "map p99.9");
+    for (int c = 0; c < 3; c++) {
+        int edits = sizes[c];
+        double times[2];
+        MAGICLatency latency;
+        for (int on = 0; on < 2; on++) {
+            MAGIC m = MAGICinit();
+            apply_edits(m, edits);
+            if (on) MAGICrecordLatency(m, 1);
+            volatile int sink = 0;
+            unsigned x = 1, span = (unsigned)edits * 41;
+            double start = now_ns();
+            for (int i = 0; i < OPS; i++) {
+                x = x * 1103515245u + 12345u;
+                sink += MAGICmap(m, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, (int)(x % span));
+            }
+            times[on] = (now_ns() - start) / OPS;
+            if (on) MAGIClatency(m, &latency);
+            MAGICdestroy(m);
+        }
+        MAGIClatencyMerge(&latency, &latency); // Percentiles are unchanged by merging a copy
+        printf("%10d %12.1f %12.1f %12.1f %10llu %10llu %10llu\n", edits, times[0], times[1], times[1] - times[0],
+               MAGIClatencyPercentile(&latency, MAGIC_OP_MAP_IN_OUT, 50),
+               MAGIClatencyPercentile(&latency, MAGIC_OP_MAP_IN_OUT, 99),
+               MAGIClatencyPercentile(&latency, MAGIC_OP_MAP_IN_OUT, 99.9));
+    }
+}
+
+// === Detached USDT probes: build with and without -DMAGIC_NO_PROBES and compare ===
+static void bench_probes(void) {
+    enum { EDITS = 100000, MAP_EDITS = 1000, LOOKUPS = 4000000, CONNECTIONS = 1000000 };
+
+    printf("== Static probes (%s) ==\n",
+#ifdef MAGIC_NO_PROBES
+           "compiled out"
+#else
+           "detached"
+#endif
+    );
+    MAGIC m = MAGICinit();
+    double start = now_ns();
+    apply_edits(m, EDITS);
+    double editTime = (now_ns() - start) / EDITS;
+    MAGICdestroy(m);
+
+    // Lookups on a small instance, where the probe is a larger share of the call
+    m = MAGICinit();
+    apply_edits(m, MAP_EDITS);
+    volatile int sink = 0;
+    unsigned x = 1;
+    start = now_ns();
+    for (int i = 0; i < LOOKUPS; i++) {
+        x = x * 1103515245u + 12345u;
+        sink += MAGICmap(m, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, (int)(x % (MAP_EDITS * 41)));
+    }
+    double mapTime = (now_ns() - start) / LOOKUPS;
+    MAGICdestroy(m);
+
+    // Short connections: every public probe fires a few times per instance
+    start = now_ns();
+    for (int i = 0; i < CONNECTIONS; i++) {
+        m = MAGICinit();
+        MAGICadd(m, 10, 4);
+        MAGICremove(m, 40, 2);
+        sink += MAGICmap(m, STREAM_IN_OUT, 50);
+        MAGICdestroy(m);
+    }
+    double connectionTime = (now_ns() - start) / CONNECTIONS;
+    printf("%-24s %10.1f ns\n", "edit", editTime);
+    printf("%-24s %10.1f ns\n", "map", mapTime);
+    printf("%-24s %10.1f ns\n", "connection (4 probes)", connectionTime);
+}
+
+// === Edit bursts: a batch through MAGICapplyEdits against the same edits one by one ===
+static void bench_edit_bursts(void) {
+    static const int bursts[] = {100, 1000, 10000};
+    enum { BASE = 100000, ROUNDS = 20 };
+    static MAGICEdit edits[10000];
+
+    printf("== Edit bursts on %d edits ==\n", BASE);
+    printf("%8s %14s %14s\n", "burst", "one by one ns", "batch ns");
+    for (int c = 0; c < 3; c++) {
+        double ns[2];
+        for (int batch = 0; batch < 2; batch++) {
+            MAGIC m = MAGICinit();
+            apply_edits(m, BASE);
+            double elapsed = 0;
+            unsigned x = 7;
+            for (int r = 0; r < ROUNDS; r++) {
+                for (int i = 0; i < bursts[c]; i++) {
+                    x = x * 1103515245u + 12345u;
+                    edits[i] = (MAGICEdit){ i % 3 == 2 ? MAGIC_EDIT_REMOVE : MAGIC_EDIT_ADD, (int)(x % (BASE * 40)),
+                                            i % 3 == 2 ? 3 : 5 };
+                }
+                double start = now_ns();
+                if (batch) {
+                    MAGICapplyEdits(m, edits, bursts[c]);
+                } else {
+                    for (int i = 0; i < bursts[c]; i++) {
+                        if (edits[i].kind == MAGIC_EDIT_REMOVE) {
+                            MAGICremove(m, edits[i].pos, edits[i].length);
+                        } else {
+                            MAGICadd(m, edits[i].pos, edits[i].length);
+                        }
+                    }
+                }
+                elapsed += now_ns() - start;
+            }
+            ns[batch] = elapsed / ROUNDS / bursts[c];
+            MAGICdestroy(m);
+        }
+        printf("%8d %14.1f %14.1f\n", bursts[c], ns[0], ns[1]);
+    }
+}
+
+// === Streaming edits: every edit at or after the previous ones, against random order ===
+static void bench_append(void) {
+    static const int sizes[] = {10000, 100000, 1000000};
+
+    printf("== Append-only edit stream ==\n");
+    printf("%-12s %10s %14s %14s\n", "engine", "edits", "append ns", "random ns");
+    for (int engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+        for (int c = 0; c < 3; c++) {
+            int edits = sizes[c];
+            double times[2];
+            for (int order = 0; order < 2; order++) {
+#ifdef __GLIBC__
+                malloc_trim(0); // Fresh nodes for every run: the previous run's freed nodes are scattered
+#endif
+                MAGIC m = MAGICinitWithEngine(engine);
+                unsigned x = 3;
+                double start = now_ns();
+                for (int i = 0; i < edits; i++) {
+                    x = x * 1103515245u + 12345u;
+                    int pos = order ? (int)(x % ((unsigned)edits * 50)) : i * 50;
+                    if (i % 4 == 3) {
+                        MAGICremove(m, pos + 20, 8);
+                    } else {
+                        MAGICadd(m, pos, 6);
+                    }
+                }
+                times[order] = (now_ns() - start) / edits;
+                MAGICdestroy(m);
+            }
+            printf("%-12s %10d %14.1f %14.1f\n", MAGICengineName(engine), edits, times[0], times[1]);
+        }
+    }
+}
+
+// === Rank, select and total length from the subtree aggregates ===
+static void bench_aggregates(void) {
+    enum { EDITS = 1000000, QUERIES = 1000000 };
+
+    printf("== Subtree aggregates (%d edits) ==\n", EDITS);
+    printf("%-12s %14s %14s %14s\n", "engine", "length ns", "rank ns", "select ns");
+    for (int engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+        MAGIC m = MAGICinitWithEngine(engine);
+        unsigned x = 5;
+        for (int i = 0; i < EDITS; i++) {
+            x = x * 1103515245u + 12345u;
+            int pos = (int)(x % (EDITS * 50u));
+            if (i % 4 == 3) {
+                MAGICremove(m, pos, 8);
+            } else {
+                MAGICadd(m, pos, 6);
+            }
+        }
+
+        volatile long long sink = 0;
+        double start = now_ns();
+        for (int i = 0; i < QUERIES; i++) {
+            sink += (long long)MAGICoutputLength(m, (size_t)i);
+        }
+        double length = (now_ns() - start) / QUERIES;
+
+        start = now_ns();
+        for (int i = 0; i < QUERIES; i++) {
+            x = x * 1103515245u + 12345u;
+            sink += MAGICeditsBefore(m, (int)(x % (EDITS * 50u)), NULL);
+        }
+        double rank = (now_ns() - start) / QUERIES;
+
+        MAGICEdit edit;
+        start = now_ns();
+        for (int i = 0; i < QUERIES; i++) {
+            x = x * 1103515245u + 12345u;
+            MAGICselectEdit(m, (int)(x % EDITS), &edit);
+            sink += edit.pos;
+        }
+        double select = (now_ns() - start) / QUERIES;
+
+        printf("%-12s %14.1f %14.1f %14.1f\n", MAGICengineName(engine), length, rank, select);
+        MAGICdestroy(m);
+    }
+}
+
+// === Periodic edits: run nodes against a node per edit ===
+static void bench_progression(void) {
+    enum { EDITS = 1000000, QUERIES = 1000000 };
+    static const char *patterns[] = {"add 4/100", "remove 2/64", "add+remove"};
+    static const int strides[] = {100, 64, 100};
+    static const int deltas[] = {4, -2, 4};
+
+    printf("== Progressions of %d edits ==\n", EDITS);
+    printf("%-12s %-6s %10s %10s %12s %10s %10s\n", "pattern", "index", "edit ns", "nodes", "bytes", "map ns", "split us");
+    for (int p = 0; p < 3; p++) {
+        for (int plain = 0; plain < 2; plain++) {
+            MAGIC m = MAGICinit();
+
+            // One byte more on every other edit keeps a node per edit
+            double start = now_ns();
+            for (int i = 0; i < EDITS; i++) {
+                int delta = deltas[p] + (plain && (i & 1) ? 1 : 0);
+                if (delta > 0) {
+                    MAGICadd(m, strides[p] * i, delta);
+                } else {
+                    MAGICremove(m, strides[p] * i, -delta);
+                }
+            }
+            // A remove after every other add, as in test_final.c
+            for (int i = 0; p == 2 && i < EDITS; i += 2) {
+                MAGICremove(m, strides[p] * i + strides[p] / 2, 2);
+            }
+            double edit = (now_ns() - start) / (p == 2 ? EDITS + EDITS / 2 : EDITS);
+
+            MAGICStats stats;
+            MAGICstats(m, &stats);
+            unsigned x = 5;
+            volatile long long sink = 0;
+            start = now_ns();
+            for (int i = 0; i < QUERIES; i++) {
+                x = x * 1103515245u + 12345u;
+                sink += MAGICmap(m, (MAGICDirection)(i & 1), (int)((x >> 4) % ((unsigned)strides[p] * EDITS)));
+            }
+            double map = (now_ns() - start) / QUERIES;
+
+            // An edit among the others splits the run nodes on its path
+            start = now_ns();
+            MAGICadd(m, strides[p] * (EDITS / 3) + 7, 1);
+            double split = (now_ns() - start) / 1e3;
+
+            printf("%-12s %-6s %10.1f %10d %12zu %10.1f %10.1f\n", patterns[p], plain ? "nodes" : "runs", edit,
+                   stats.nodes, stats.bytes, map, split);
+            MAGICdestroy(m);
+        }
+    }
+}
+
+// === Batch map of unsorted positions: interleaved lookups against one by one ===
+static void bench_map_many(void) {
+    static const int sizes[] = {1000000, 4000000};
+    enum { QUERIES = 1000000 };
+
+    int *positions = malloc(QUERIES * sizeof(int));
+    int *results = malloc(QUERIES * sizeof(int));
+    if (!positions || !results) {
+        free(positions);
+        free(results);
+        return;
+    }
+
+    printf("== Batch map, %d queries, edits in random order ==\n", QUERIES);
+    printf("%10s %8s %14s %14s %10s\n", "edits", "queries", "single ns", "batch ns", "speedup");
+    for (int c = 0; c < 2; c++) {
+        int edits = sizes[c];
+        MAGIC m = MAGICinit();
+        unsigned x = 11;
+        for (int i = 0; i < edits; i++) {
+            x = x * 1103515245u + 12345u;
+            int pos = (int)(x % ((unsigned)edits * 40));
+            if (i % 3 == 2) {
+                MAGICremove(m, pos, 3);
+            } else {
+                MAGICadd(m, pos, 5);
+            }
+        }
+
+        for (int sorted = 0; sorted < 2; sorted++) {
+            for (int i = 0; i < QUERIES; i++) {
+                x = x * 1103515245u + 12345u;
+                positions[i] = sorted ? (int)((long)i * edits * 40 / QUERIES) : (int)(x % ((unsigned)edits * 40));
+            }
+
+            volatile int sink = 0;
+            double start = now_ns();
+            for (int i = 0; i < QUERIES; i++) {
+                sink += MAGICmap(m, STREAM_IN_OUT, positions[i]);
+            }
+            double single = (now_ns() - start) / QUERIES;
+
+            start = now_ns();
+            MAGICmapMany(m, STREAM_IN_OUT, positions, results, QUERIES);
+            double batch = (now_ns() - start) / QUERIES;
+
+            printf("%10d %8s %14.1f %14.1f %10.2f\n", edits, sorted ? "sorted" : "random", single, batch,
+                   single / batch);
+        }
+        MAGICdestroy(m);
+    }
+
+    free(positions);
+    free(results);
+}
+
+// === Node layout: lookups on aged trees before and after MAGICoptimize ===
+static void bench_optimize(void) {
+    static const int sizes[] = {1000000, 4000000};
+    enum { QUERIES = 1000000, JUNK = 1 << 16 };
+    static void *junk[JUNK];
+
+    printf("== Layout of aged trees, %d lookups ==\n", QUERIES);
+    printf("%10s %8s %14s %14s %10s %12s\n", "edits", "queries", "scattered ns", "laid out ns", "speedup", "optimize ms");
+    for (int c = 0; c < 2; c++) {
+        int edits = sizes[c];
+        MAGIC m = MAGICinit();
+        // Other allocations come and go between edits, as in a long-running server
+        unsigned x = 13;
+        for (int i = 0; i < edits; i++) {
+            x = x * 1103515245u + 12345u;
+            int pos = (int)(x % ((unsigned)edits * 40));
+            if (i % 3 == 2) {
+                MAGICremove(m, pos, 3);
+            } else {
+                MAGICadd(m, pos, 5);
+            }
+            int slot = (int)((x >> 8) % JUNK);
+            free(junk[slot]);
+            junk[slot] = malloc(16 + (x >> 4) % 200);
+        }
+
+        double ns[2][2], optimize = 0;
+        for (int laidOut = 0; laidOut < 2; laidOut++) {
+            if (laidOut) {
+                double start = now_ns();
+                MAGICoptimize(m);
+                optimize = (now_ns() - start) / 1e6;
+            }
+            for (int sorted = 0; sorted < 2; sorted++) {
+                unsigned y = 17;
+                volatile int sink = 0;
+                double start = now_ns();
+                for (int i = 0; i < QUERIES; i++) {
+                    y = y * 1103515245u + 12345u;
+                    int pos = sorted ? (int)((long)i * edits * 40 / QUERIES) : (int)(y % ((unsigned)edits * 40));
+                    sink += MAGICmap(m, (MAGICDirection)(i & 1), pos);
+                }
+                ns[sorted][laidOut] = (now_ns() - start) / QUERIES;
+            }
+        }
+        for (int sorted = 0; sorted < 2; sorted++) {
+            printf("%10d %8s %14.1f %14.1f %10.2f %12.1f\n", edits, sorted ? "sorted" : "random", ns[sorted][0],
+                   ns[sorted][1], ns[sorted][0] / ns[sorted][1], optimize);
+        }
+        MAGICdestroy(m);
+    }
+    for (int i = 0; i < JUNK; i++) {
+        free(junk[i]);
+        junk[i] = NULL;
+    }
+}
+
+int main(void) {
+    for (int engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+        bench_connections(engine);
+    }
+    for (int engine = 0; engine < MAGIC_ENGINE_COUNT; engine++) {
+        bench_checkpoints(engine);
+    }
+    bench_history();
+    bench_parallel_map();
+    bench_build();
+    bench_streams();
+    bench_from_diff();
+    bench_apply();
+    bench_iovec();
+    bench_rewrite_file();
+    bench_checksum();
+    bench_seq();
+    bench_latency();
+    bench_probes();
+    bench_edit_bursts();
+    bench_append();
+    bench_aggregates();
+    bench_map_many();
+    bench_progression();
+    bench_optimize();
+    return 0;
+}
+
+/*
+gcc -Wall -pedantic -std=c11 -O3 -pthread -o test_magic_bench test_magic_bench.c magic.c magic_streams.c magic_checksum.c magic_seq.c
+./test_magic_bench
+*/
@@ -0,0 +1,232 @@
+#include "magic.c" // The primitives under test are internal to the library
+#include <stdio.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Microbenchmarks of the tree primitives behind MAGICadd and MAGICmap.
+ *
+ * RBTreeInsert, findDeleteNode and RBTreeFindMapping run on trees built
+ * directly, so that each number covers one primitive on a known shape:
+ * keys inserted in ascending, descending or random order (which decides
+ * whether neighbours in the tree are neighbours in memory) and sizes from
+ * cache-resident to far beyond the last-level cache.
+ *
+ * Hardware counters are read with perf_event_open around each run and
+ * reported per operation. Counters the kernel or the machine refuses
+ * (perf_event_paranoid above 2, no PMU in a virtual machine) print as "-",
+ * and the run falls back to timing only.
+ */
+
+enum { SHAPE_ASCENDING, SHAPE_DESCENDING, SHAPE_RANDOM, SHAPE_COUNT };
+static const char *shapeNames[SHAPE_COUNT] = {"ascending", "descending", "random"};
+
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_L1_MISSES, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, COUNTER_COUNT };
+
+// Open counters, -1 for those that are not available
+static int counterFds[COUNTER_COUNT];
+
+// Returns a monotonic timestamp in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#ifdef __linux__
+// Opens one user-space counter of this thread, disabled until counters_start
+static int open_counter(unsigned type, unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Opens every counter it can, returns how many are available
+static int counters_open(void) {
+    int available = 0;
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        counterFds[c] = -1;
+    }
+#ifdef __linux__
+    const unsigned long long l1Read = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    counterFds[COUNTER_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counterFds[COUNTER_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    counterFds[COUNTER_L1_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1Read);
+    counterFds[COUNTER_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counterFds[COUNTER_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        if (counterFds[c] >= 0) available++;
+    }
+#endif
+    return available;
+}
+
+static void counters_close(void) {
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        if (counterFds[c] >= 0) close(counterFds[c]);
+    }
+}
+
+static void counters_start(void) {
+#ifdef __linux__
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        if (counterFds[c] < 0) continue;
+        ioctl(counterFds[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counterFds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+// Stops the counters and reads them, scaled when the kernel multiplexed them (-1 when unavailable)
+static void counters_stop(double values[COUNTER_COUNT]) {
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        values[c] = -1;
+#ifdef __linux__
+        if (counterFds[c] < 0) continue;
+        ioctl(counterFds[c], PERF_EVENT_IOC_DISABLE, 0);
+        unsigned long long data[3]; // Value, time enabled, time running
+        if (read(counterFds[c], data, sizeof(data)) != (ssize_t)sizeof(data) || data[2] == 0) continue;
+        values[c] = (double)data[0] * ((double)data[1] / (double)data[2]);
+#endif
+    }
+}
+
+// Prints one result line, counters divided by the number of operations
+static void report(const char *primitive, int shape, int size, long ops, double elapsed, const double values[COUNTER_COUNT]) {
+    printf("%-18s %-10s %8d %9.1f", primitive, shapeNames[shape], size, elapsed / ops);
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        if (values[c] < 0) {
+            printf(" %9s", "-");
+        } else {
+            printf(" %9.2f", values[c] / ops);
+        }
+    }
+    if (values[COUNTER_CYCLES] > 0 && values[COUNTER_INSTRUCTIONS] >= 0) {
+        printf(" %6.2f\n", values[COUNTER_INSTRUCTIONS] / values[COUNTER_CYCLES]);
+    } else {
+        printf(" %6s\n", "-");
+    }
+}
+
+// Fills keys with 0..n-1 in the order of the shape
+static void shape_keys(int shape, int *keys, int n) {
+    for (int i = 0; i < n; i++) {
+        keys[i] = shape == SHAPE_DESCENDING ? n - 1 - i : i;
+    }
+    if (shape == SHAPE_RANDOM) {
+        unsigned x = 12345;
+        for (int i = n - 1; i > 0; i--) {
+            x = x * 1103515245u + 12345u;
+            int j = (int)((x >> 8) % (unsigned)(i + 1));
+            int t = keys[i];
+            keys[i] = keys[j];
+            keys[j] = t;
+        }
+    }
+}
+
+// Random lookup positions over the span of the trees
+static void lookup_positions(int *positions, int count, int span) {
+    unsigned x = 777;
+    for (int i = 0; i < count; i++) {
+        x = x * 1103515245u + 12345u;
+        positions[i] = (int)((x >> 4) % (unsigned)span);
+    }
+}
+
+// Every key is 8 bytes apart; one in four is a removal of 3 bytes, the others insert 3 bytes
+#define KEY_GAP 8
+#define KEY_LENGTH 3
+
+static void bench_shape(int shape, int size, const int *positions, int lookups) {
+    int *keys = malloc((size_t)size * sizeof(int));
+    RBTree *shiftTree = RBTreeInit();
+    RBTree *deleteTree = RBTreeInit();
+    if (!keys || !shiftTree || !deleteTree) {
+        free(keys);
+        RBTreeDestroy(shiftTree);
+        RBTreeDestroy(deleteTree);
+        return;
+    }
+    shape_keys(shape, keys, size);
+
+    double values[COUNTER_COUNT];
+    double start = now_ns();
+    counters_start();
+    for (int i = 0; i < size; i++) {
+        int delta = keys[i] % 4 == 3 ? -KEY_LENGTH : KEY_LENGTH;
+        RBTreeInsert(shiftTree, keys[i] * KEY_GAP, delta, i + 1);
+    }
+    counters_stop(values);
+    report("RBTreeInsert", shape, size, size, now_ns() - start, values);
+
+    for (int i = 0; i < size; i++) {
+        if (keys[i] % 4 == 3) RBTreeInsert(deleteTree, keys[i] * KEY_GAP, -KEY_LENGTH, i + 1);
+    }
+
+    volatile long sink = 0;
+    int timestamp;
+    start = now_ns();
+    counters_start();
+    for (int i = 0; i < lookups; i++) {
+        sink += findDeleteNode(deleteTree, positions[i], &timestamp);
+    }
+    counters_stop(values);
+    report("findDeleteNode", shape, size, lookups, now_ns() - start, values);
+
+    for (int direction = 0; direction < 2; direction++) {
+        start = now_ns();
+        counters_start();
+        for (int i = 0; i < lookups; i++) {
+            sink += RBTreeFindMapping(shiftTree, deleteTree, positions[i], (MAGICDirection)direction);
+        }
+        counters_stop(values);
+        report(direction ? "FindMapping out>in" : "FindMapping in>out", shape, size, lookups, now_ns() - start, values);
+    }
+
+    RBTreeDestroy(shiftTree);
+    RBTreeDestroy(deleteTree);
+    free(keys);
+}
+
+int main(void) {
+    static const int sizes[] = {1 << 10, 1 << 16, 1 << 20};
+    enum { LOOKUPS = 1 << 20 };
+
+    int available = counters_open();
+    if (available == 0) {
+        printf("perf_event_open unavailable: timing only\n");
+    }
+
+    printf("%-18s %-10s %8s %9s %9s %9s %9s %9s %9s %6s\n", "primitive", "shape", "nodes", "ns/op",
+           "cycles", "instr", "L1d miss", "LLC miss", "br miss", "IPC");
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int *positions = malloc(LOOKUPS * sizeof(int));
+        if (!positions) break;
+        lookup_positions(positions, LOOKUPS, sizes[s] * KEY_GAP);
+        for (int shape = 0; shape < SHAPE_COUNT; shape++) {
+            bench_shape(shape, sizes[s], positions, LOOKUPS);
+        }
+        free(positions);
+    }
+    counters_close();
+    return 0;
+}
+
+/*
+gcc -Wall -pedantic -std=c11 -O3 -pthread -o test_magic_perf test_magic_perf.c
+./test_magic_perf
+*/
@@ -0,0 +1,106 @@
+"""Checks and times the pymagic bindings (build them first, see magic_python.c).
+
+map_array is checked against map on NumPy arrays when NumPy is installed,
+and on array.array otherwise, then timed against a Python loop of map calls.
+"""
+import array
+import random
+import threading
+import time
+
+import pymagic
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+SIZES = (1_000, 1_000_000)
+LOOP_QUERIES = 1_000_000
+ARRAY_QUERIES = 100_000_000 if np is not None else 10_000_000
+
+
+def build(edits):
+    m = pymagic.Magic()
+    rng = random.Random(7)
+    for i in range(edits):
+        pos = rng.randrange(edits * 40)
+        if i % 3 == 2:
+            m.remove(pos, 3)
+        else:
+            m.add(pos, 5)
+    return m
+
+
+def positions(count, span, seed):
+    """Random positions, as an int32 NumPy array or an array.array('i')."""
+    if np is not None:
+        return np.random.default_rng(seed).integers(0, span, size=count, dtype=np.int32)
+    rng = random.Random(seed)
+    return array.array("i", (rng.randrange(span) for _ in range(count)))
+
+
+def check(m, span):
+    small = positions(20_000, span, 1)
+    for direction in (pymagic.IN_OUT, pymagic.OUT_IN):
+        expected = [m.map(direction, int(p)) for p in small]
+        copy = array.array("i", small)
+        assert m.map_array(direction, copy) is copy
+        assert list(copy) == expected
+        parallel = array.array("i", small)
+        m.map_array(direction, parallel, threads=4)
+        assert list(parallel) == expected
+        wide = array.array("q", [int(p) for p in small] + [-5, 2**40])
+        m.map_array(direction, wide)
+        assert list(wide) == expected + [-1, -1]
+        if np is not None:
+            a = np.array(small, dtype=np.int64)
+            m.map_array(direction, a)
+            assert a.tolist() == expected
+
+    for bad in (array.array("d", [1.0]), b"abcd", array.array("h", [1])):
+        try:
+            m.map_array(pymagic.IN_OUT, bad)
+        except (TypeError, BufferError):
+            pass
+        else:
+            raise AssertionError("map_array accepted %r" % (bad,))
+    try:
+        m.map(2, 0)
+    except ValueError:
+        pass
+    else:
+        raise AssertionError("map accepted direction 2")
+
+    # Edits from another thread wait for a map in progress
+    big = positions(2_000_000, span, 2)
+    worker = threading.Thread(target=m.map_array, args=(pymagic.IN_OUT, big))
+    worker.start()
+    m.add(span + 10, 1)
+    worker.join()
+
+
+def bench(m, edits):
+    queries = positions(LOOP_QUERIES, edits * 40, 3)
+    start = time.perf_counter()
+    for p in queries:
+        m.map(pymagic.IN_OUT, int(p))
+    loop = (time.perf_counter() - start) / LOOP_QUERIES * 1e9
+
+    queries = positions(ARRAY_QUERIES, edits * 40, 4)
+    start = time.perf_counter()
+    m.map_array(pymagic.IN_OUT, queries)
+    batch = (time.perf_counter() - start) / ARRAY_QUERIES * 1e9
+
+    print("%10d %14.1f %14.1f %10.2f" % (edits, loop, batch, loop / batch))
+
+
+if __name__ == "__main__":
+    print("map_array on %s, %d positions, against a loop of %d map calls"
+          % ("numpy" if np is not None else "array.array", ARRAY_QUERIES, LOOP_QUERIES))
+    print("%10s %14s %14s %10s" % ("edits", "loop ns", "map_array ns", "speedup"))
+    for size in SIZES:
+        magic = build(size)
+        check(magic, size * 40)
+        bench(magic, size)
+    print("checks passed")